@@ -0,0 +1,72 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Asks a running gateway for recent readings of one sensor from its recent-history cache.
+ * Without a time range it prints the latest reading; with one, the cached readings in it.
+ * Usage: ./cache_query <sensor id> [from ts [to ts [max readings]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "sensor_cache.h"
+
+static int recv_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <sensor id> [from ts [to ts [max readings]]]\n", argv[0]);
+        return -1;
+    }
+
+    cache_request_t request = {
+        .type = argc > 2 ? CACHE_QUERY_RANGE : CACHE_QUERY_LATEST,
+        .sensor_id = (uint16_t)atoi(argv[1]),
+        .from = argc > 2 ? atoll(argv[2]) : INT64_MIN,
+        .to = argc > 3 ? atoll(argv[3]) : INT64_MAX,
+        .max = argc > 4 ? (uint32_t)atoi(argv[4]) : 0,
+    };
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CACHE_SOCKET_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "[!] ERR: Could not connect to %s, is the gateway running?\n", CACHE_SOCKET_PATH);
+        return -1;
+    }
+
+    cache_response_t response;
+    if (send(fd, &request, sizeof(request), 0) != sizeof(request) || recv_all(fd, &response, sizeof(response)) != 0) {
+        fprintf(stderr, "[!] ERR: No answer from the gateway\n");
+        close(fd);
+        return -1;
+    }
+    if (response.status != CACHE_STATUS_OK) {
+        fprintf(stderr, "[!] ERR: %s\n", response.status == CACHE_STATUS_UNKNOWN_SENSOR ? "Sensor not in the cache" : "Bad request");
+        close(fd);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < response.count; i++) {
+        cache_reading_t reading;
+        if (recv_all(fd, &reading, sizeof(reading)) != 0) break;
+        printf("%u, %f, %lld\n", request.sensor_id, reading.value, (long long)reading.ts);
+    }
+    close(fd);
+    return 0;
+}
@@ -16,6 +16,7 @@ typedef struct {
     sensor_id_t id;
     sensor_value_t value;
     sensor_ts_t ts;
+    int64_t ingest_ns;              // CLOCK_MONOTONIC when the gateway received the reading, 0 if not stamped
 } sensor_data_t;
 
 #endif /* _CONFIG_H_ */
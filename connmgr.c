@@ -14,6 +14,9 @@
 #include "sbuffer.h"
 #include "config.h"
 #include "sensor_db.h"
+#include "sensor_metrics.h"
+#include "sensor_latency.h"
+#include "sensor_probes.h"
 #include "lib/tcpsock.h"
 
 pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -73,10 +76,10 @@ void *node_handler(void *arg) {
         if (tcp_receive(client, &data.id, &bytes) != TCP_NO_ERROR) break;
 
         if (!logged) {
-            char log_msg[128];
-            snprintf(log_msg, sizeof(log_msg),
-                    "Sensor node %u has opened a new connection", data.id);
-            write_to_log_process(log_msg);
+            log_event(LOG_CONN_OPENED, (int)data.id);
+            metrics_register("connection", data.id);
+            latency_register();
+            SENSOR_PROBE1(conn_open, data.id);
             logged = true;
         }
 
@@ -93,14 +96,19 @@ void *node_handler(void *arg) {
         bytes = sizeof(data.ts);
         if (tcp_receive(client, &data.ts, &bytes) != TCP_NO_ERROR) break;
 
+        data.ingest_ns = latency_now_ns();
+        SENSOR_PROBE4(conn_record, data.id, data.value * 1000, data.ts, data.ingest_ns);
         sbuffer_insert(buffer, &data);
+        latency_record(LATENCY_SBUFFER, &data, 1, latency_now_ns());
     }
 
-    // Close client
-    char log_msg[128];
-    snprintf(log_msg, sizeof(log_msg),
-            "Sensor node %u has closed the connection", id);
-    write_to_log_process(log_msg);
+    // Close client; a node that never sent its id was never reported as connected either
+    if (logged) {
+        log_event(LOG_CONN_CLOSED, (int)id);
+        SENSOR_PROBE1(conn_close, id);
+    }
+    metrics_unregister();
+    latency_unregister();
 
     tcp_close(&client);
     return NULL;
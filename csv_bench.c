@@ -0,0 +1,125 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Checks that csv_encode_reading() produces exactly what fprintf() produces, then compares the
+ * rows per second of both when writing data.csv rows to /dev/null in groups of DB_GROUP_SIZE.
+ * Usage: ./csv_bench [number of rows]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "sensor_csv.h"
+#include "sensor_db.h"
+
+#define DEFAULT_ROWS 2000000
+#define CHECK_ROWS 2000000
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mostly sensor-like values, plus the cases that are easy to get wrong
+static double test_value(long i) {
+    static const double special[] = {
+        0.0, -0.0, 0.5e-6, -0.5e-6, 1.5e-6, 2.5e-6, 0.0078125, 0.0234375, -0.0234375,
+        999999.9999995, 0.9999995, 1e-320, -1e-320, 5e-324, 1e14 + 0.5, 999999999999999.9,
+        1e15, -1e15, 1e300, NAN, INFINITY, -INFINITY
+    };
+    int nb_special = sizeof(special) / sizeof(special[0]);
+    if (i < nb_special) return special[i];
+
+    switch (i % 4) {
+    case 0: return 15 + (drand48() - 0.5) * 20;                             // sensor readings
+    case 1: return ldexp(floor(drand48() * 4096) + 0.5, -(int)(drand48() * 30)) / 1e6 * 64;  // near ties
+    case 2: return (drand48() - 0.5) * pow(10, drand48() * 16);            // all magnitudes
+    default: {
+        uint64_t bits = ((uint64_t)lrand48() << 33) ^ ((uint64_t)lrand48() << 2) ^ (uint64_t)lrand48();
+        double v;
+        memcpy(&v, &bits, sizeof(v));
+        return v;                                                           // any bit pattern
+    }
+    }
+}
+
+static sensor_data_t test_reading(long i) {
+    sensor_data_t d;
+    d.id = (sensor_id_t)lrand48();
+    d.value = test_value(i);
+    d.ts = i % 7 == 0 ? -(sensor_ts_t)lrand48() : 1700000000 + i;
+    return d;
+}
+
+int main(int argc, char *argv[]) {
+    long nb_rows = argc > 1 ? atol(argv[1]) : DEFAULT_ROWS;
+    if (nb_rows <= 0) {
+        printf("Usage: %s [number of rows]\n", argv[0]);
+        return -1;
+    }
+    srand48(42);
+
+    // Byte-identical output
+    char expected[CSV_MAX_ROW_LEN], actual[CSV_MAX_ROW_LEN];
+    long mismatches = 0;
+    for (long i = 0; i < CHECK_ROWS; i++) {
+        sensor_data_t d = test_reading(i);
+        int len = snprintf(expected, sizeof(expected), "%" PRIu16 ", %f, %lld\n", d.id, d.value, (long long)d.ts);
+        size_t n = csv_encode_reading(&d, actual);
+        if (n != (size_t)len || memcmp(expected, actual, n) != 0) {
+            if (mismatches++ < 5) printf("MISMATCH: %.*s vs %s", (int)n, actual, expected);
+        }
+    }
+    printf("%d rows checked against fprintf: %ld mismatches\n", CHECK_ROWS, mismatches);
+
+    // Throughput, sensor-like rows as the storage manager writes them
+    sensor_data_t *rows = malloc(nb_rows * sizeof(*rows));
+    for (long i = 0; i < nb_rows; i++) {
+        rows[i].id = 1 + i % 1000;
+        rows[i].value = 15 + (drand48() - 0.5) * 20;
+        rows[i].ts = 1700000000 + i / 1000;
+    }
+
+    FILE *f = fopen("/dev/null", "w");
+    setvbuf(f, NULL, _IOFBF, 64 * 1024);
+    double start = now_sec();
+    for (long i = 0; i < nb_rows; i += DB_GROUP_SIZE) {
+        long end = i + DB_GROUP_SIZE < nb_rows ? i + DB_GROUP_SIZE : nb_rows;
+        for (long j = i; j < end; j++) {
+            fprintf(f, "%" PRIu16 ", %f, %lld\n", rows[j].id, rows[j].value, (long long)rows[j].ts);
+        }
+        fflush(f);
+    }
+    double t_stdio = now_sec() - start;
+    fclose(f);
+
+    static char buf[DB_GROUP_SIZE * CSV_MAX_ROW_LEN];
+    int fd = open("/dev/null", O_WRONLY);
+    start = now_sec();
+    for (long i = 0; i < nb_rows; i += DB_GROUP_SIZE) {
+        int count = i + DB_GROUP_SIZE < nb_rows ? DB_GROUP_SIZE : (int)(nb_rows - i);
+        size_t len = csv_encode_batch(rows + i, count, buf);
+        if (write(fd, buf, len) != (ssize_t)len) return -1;
+    }
+    double t_encoder = now_sec() - start;
+    close(fd);
+
+    printf("%12s %15s\n", "path", "rows/s (M)");
+    printf("%12s %15.2f\n", "fprintf", nb_rows / t_stdio / 1e6);
+    printf("%12s %15.2f\n", "encoder", nb_rows / t_encoder / 1e6);
+    printf("speedup %.2fx\n", t_stdio / t_encoder);
+
+    free(rows);
+    return mismatches ? 1 : 0;
+}
@@ -1,201 +1,996 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <assert.h>
 #include <string.h>
-#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "lib/dplist.h"
 #include "datamgr.h"
 #include "config.h"
 #include "sensor_db.h"
+#include "sensor_map.h"
+#include "sensor_kernels.h"
+#include "sensor_metrics.h"
+#include "sensor_latency.h"
+#include "sensor_probes.h"
+
 
+// Every possible sensor_id_t gets a slot, so a lookup is a single array access
+#define SENSOR_ID_SPACE (UINT16_MAX + 1)
 
-// Defining element of dplist
 typedef uint16_t room_id_t;
 
 typedef struct node_info {
+    atomic_uint seq;            // seqlock: odd while the datamgr thread is updating this slot
+    bool in_map;
+    unsigned map_generation;    // last map generation this sensor appeared in
+    int map_index;              // position in the current map
     sensor_id_t sensor_id;
     room_id_t room_id;
-    sensor_value_t *prev_vals;
+    sensor_value_t min_temp;    // copy of the band in the map, for readers
+    sensor_value_t max_temp;
+    sensor_value_t prev_vals[RUN_AVG_LENGTH];   // ring of the last readings
+    int prev_next;                              // where the next reading goes in prev_vals
+    unsigned nb_readings;                       // readings since the sensor was added
+    sensor_value_t value_sum;                   // sum, min and max of those readings
+    sensor_value_t value_min;
+    sensor_value_t value_max;
     sensor_value_t running_avg;
     sensor_ts_t last_modified;
+    alert_state_t alert;                // state that was last reported
+    alert_state_t alert_pending;        // state the average points at, waiting out the dwell time
+    sensor_ts_t alert_pending_since;
+    sensor_ts_t alert_since;
+    sensor_ts_t alert_reported;         // last event or summary for the current alert
+    unsigned batch_no;                  // batch this node was last grouped in
+    int batch_group;                    // its group in that batch
+    double report_interval;             // average seconds between readings, valid from the second reading
+    bool stale;                         // reported silent, no reading since
+    time_t last_seen;                   // gateway time of the last reading
+    time_t deadline;                    // gateway time after which the sensor counts as silent
+    int heap_pos;                       // index in stale_heap + 1, 0 while not watched
 } node_info_t;
 
-// Element copy, free, compare for dplist
-void *element_copy(void *element) {
-    node_info_t *orig = (node_info_t *)element;
-    node_info_t *copy = malloc(sizeof(*copy));
+// Slots never move, so readers can hold on to them; untouched slots stay in zero pages
+static node_info_t sensor_info[SENSOR_ID_SPACE];
+
+// Dense list of the sensors in the map, guarded by its own seqlock
+static atomic_uint map_seq;
+static sensor_id_t map_ids[SENSOR_ID_SPACE];
+static int map_size = 0;
+
+// Running average of each map entry, lined up with the map's min/max columns for SIMD checks
+static sensor_value_t map_avgs[SENSOR_ID_SPACE];
+static uint8_t map_flags[SENSOR_ID_SPACE];
+
+// The map the slots were last brought in line with
+static const sensor_map_t *applied_map = NULL;
+
+// Scratch space for datamgr_process_batch(): readings regrouped per sensor, then one column per group
+static unsigned batch_no = 0;
+static int batch_group_of[DATAMGR_BATCH_SIZE];
+static node_info_t *group_node[DATAMGR_BATCH_SIZE];
+static int group_start[DATAMGR_BATCH_SIZE + 1];
+static sensor_ts_t group_first_ts[DATAMGR_BATCH_SIZE];
+static sensor_ts_t group_ts[DATAMGR_BATCH_SIZE];
+static sensor_value_t group_vals[DATAMGR_BATCH_SIZE];
+static sensor_value_t group_avg[DATAMGR_BATCH_SIZE];
+static sensor_value_t group_min[DATAMGR_BATCH_SIZE];
+static sensor_value_t group_max[DATAMGR_BATCH_SIZE];
+static uint8_t group_flags[DATAMGR_BATCH_SIZE];
+
+/*
+ * Seqlock helpers. There is exactly one writer (the datamgr thread), readers retry
+ * when they raced with it instead of taking a lock.
+ */
+static void seq_write_begin(atomic_uint *seq) {
+    unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(atomic_uint *seq) {
+    unsigned s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+static unsigned seq_read_begin(atomic_uint *seq) {
+    unsigned s;
+    while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1) sched_yield();
+    return s;
+}
+
+static bool seq_read_retry(atomic_uint *seq, unsigned s) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != s;
+}
+
+// Helper function
+static node_info_t *get_element_from_id(sensor_id_t id) {
+    node_info_t *element = &sensor_info[id];
+    return element->in_map ? element : NULL;
+}
+
+/*
+ * Stale sensor detection. Every sensor that reported gets a deadline; the deadlines sit in a
+ * min-heap, so a reading costs O(log n) and checking for overdue sensors only looks at the top.
+ * The heap belongs to the datamgr thread; 'stale' and 'report_interval' are also seqlocked for readers.
+ */
+static node_info_t *stale_heap[SENSOR_ID_SPACE];
+static int stale_heap_size = 0;
+
+static atomic_int stale_sensors;
+static atomic_ulong silent_events;
+static atomic_ulong resumed_events;
+
+static void heap_place(int i, node_info_t *node) {
+    stale_heap[i] = node;
+    node->heap_pos = i + 1;
+}
+
+static void heap_sift_up(int i) {
+    node_info_t *node = stale_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (stale_heap[parent]->deadline <= node->deadline) break;
+        heap_place(i, stale_heap[parent]);
+        i = parent;
+    }
+    heap_place(i, node);
+}
+
+static void heap_sift_down(int i) {
+    node_info_t *node = stale_heap[i];
+    while (2 * i + 1 < stale_heap_size) {
+        int child = 2 * i + 1;
+        if (child + 1 < stale_heap_size && stale_heap[child + 1]->deadline < stale_heap[child]->deadline) child++;
+        if (node->deadline <= stale_heap[child]->deadline) break;
+        heap_place(i, stale_heap[child]);
+        i = child;
+    }
+    heap_place(i, node);
+}
+
+// Watch a sensor, or move its deadline if it is already watched
+static void stale_watch(node_info_t *node, time_t deadline) {
+    if (node->heap_pos == 0) {
+        node->deadline = deadline;
+        heap_place(stale_heap_size++, node);
+        heap_sift_up(stale_heap_size - 1);
+    } else if (deadline < node->deadline) {
+        node->deadline = deadline;
+        heap_sift_up(node->heap_pos - 1);
+    } else {
+        node->deadline = deadline;
+        heap_sift_down(node->heap_pos - 1);
+    }
+}
 
-    copy->sensor_id = orig->sensor_id;
-    copy->room_id = orig->room_id;
-    copy->running_avg = orig->running_avg;
-    copy->last_modified = orig->last_modified;
+static void stale_unwatch(node_info_t *node) {
+    if (node->heap_pos == 0) return;
+    int i = node->heap_pos - 1;
+    node->heap_pos = 0;
 
-    // Deep copy of prev_vals
-    copy->prev_vals = NULL;
-    if (orig->prev_vals) {
-        copy->prev_vals = malloc(sizeof(sensor_value_t) * RUN_AVG_LENGTH);
-        if (!copy->prev_vals) { free(copy); return NULL; }
-        memcpy(copy->prev_vals, orig->prev_vals,
-                sizeof(sensor_value_t) * RUN_AVG_LENGTH);
+    node_info_t *last = stale_heap[--stale_heap_size];
+    if (i < stale_heap_size) {
+        heap_place(i, last);
+        heap_sift_up(i);
+        heap_sift_down(last->heap_pos - 1);
     }
+}
 
-    return (void *)copy;
+// Stop watching a sensor that leaves the map. Call inside the node's seqlock write section.
+static void stale_forget(node_info_t *node) {
+    stale_unwatch(node);
+    if (node->stale) {
+        node->stale = false;
+        atomic_fetch_sub(&stale_sensors, 1);
+    }
 }
 
-void element_free(void **element) {
-    if (!element || !*element) return;
+static time_t stale_timeout(const node_info_t *node) {
+    double interval = node->nb_readings >= 2 ? node->report_interval : DATAMGR_STALE_DEFAULT_INTERVAL;
+    time_t timeout = (time_t)(DATAMGR_STALE_INTERVALS * interval);
+    return timeout < DATAMGR_STALE_MIN_TIMEOUT ? DATAMGR_STALE_MIN_TIMEOUT : timeout;
+}
 
-    node_info_t *e = (node_info_t *)(*element);
-    free(e->prev_vals);
-    e->prev_vals = NULL;
+// Account for 'k' new readings, sent from 'first_ts' to 'ts', that arrived at 'now': update the
+// interval estimate and push the deadline out. Call inside the node's seqlock write section, before
+// last_modified and nb_readings are updated. Returns the seconds the sensor was silent, or -1.
+static time_t stale_seen(node_info_t *node, sensor_ts_t first_ts, sensor_ts_t ts, int k, time_t now) {
+    // Sensor timestamps give the interval it reports at; smooth it so one late reading does not count much
+    int gaps = node->nb_readings > 0 ? k : k - 1;
+    if (gaps > 0) {
+        sensor_ts_t since = node->nb_readings > 0 ? node->last_modified : first_ts;
+        double gap = ts > since ? (double)(ts - since) / gaps : 0;
+        if (node->nb_readings < 2) {
+            node->report_interval = gap;
+        } else {
+            node->report_interval += (gap - node->report_interval) / 4;
+        }
+    }
+
+    time_t silent_for = -1;
+    if (node->stale) {
+        node->stale = false;
+        silent_for = now - node->last_seen;
+        atomic_fetch_sub(&stale_sensors, 1);
+        atomic_fetch_add(&resumed_events, 1);
+    }
 
-    free(e);
-    *element = NULL;
+    node->last_seen = now;
+    stale_watch(node, now + stale_timeout(node));
+    return silent_for;
 }
 
-int element_compare(void *x, void *y) {
-    node_info_t *a = (node_info_t *)x;
-    node_info_t *b = (node_info_t *)y;
+static void log_resumed(const node_info_t *node, time_t silent_for) {
+    if (silent_for < 0) return;
 
-    if (a->sensor_id < b->sensor_id) return -1;
-    if (a->sensor_id > b->sensor_id) return 1;
-    return 0;
+    log_event(LOG_SENSOR_RESUMED, (int)node->sensor_id, (long long)silent_for);
 }
 
-// Create globally accessible dplist
-dplist_t *sensor_info;
+time_t datamgr_check_stale(time_t now) {
+    while (stale_heap_size > 0 && stale_heap[0]->deadline <= now) {
+        node_info_t *node = stale_heap[0];
+        stale_unwatch(node);
 
-// Helper function
-node_info_t *get_element_from_id(sensor_id_t id) {
-    node_info_t dummy_element;
-    dummy_element.sensor_id = id;
+        seq_write_begin(&node->seq);
+        node->stale = true;
+        seq_write_end(&node->seq);
 
-    // Element -> Index
-    int index = dpl_get_index_of_element(sensor_info, &dummy_element);
-    if (index < 0) return NULL;
+        atomic_fetch_add(&stale_sensors, 1);
+        atomic_fetch_add(&silent_events, 1);
 
-    // Index -> Reference (to node)
-    dplist_node_t *ref = dpl_get_reference_at_index(sensor_info, index);
-    if (!ref) return NULL;
+        // Watched again once a reading comes in, so every silence is reported once
+        log_event(LOG_SENSOR_SILENT, (int)node->sensor_id, (long long)(now - node->last_seen),
+                  DATAMGR_STALE_INTERVALS);
+    }
 
-    // Reference -> Element
-    node_info_t *element = dpl_get_element_at_reference(sensor_info, ref);
+    return stale_heap_size > 0 ? stale_heap[0]->deadline : 0;
+}
 
-    return element;
+void datamgr_get_stale_stats(datamgr_stale_stats_t *stats) {
+    if (!stats) return;
+    stats->stale_sensors = atomic_load(&stale_sensors);
+    stats->silent_events = atomic_load(&silent_events);
+    stats->resumed_events = atomic_load(&resumed_events);
 }
 
-// Parse sensor data and arrange it in a dplist
-void *run_datamgr(void *args) {
-    // Parse args
-    datamgr_args_t* datamgr_args = (datamgr_args_t *)args;
-    FILE * fp_sensor_map = datamgr_args->fp_sensor_map;
-    sbuffer_t *buffer = datamgr_args->buffer;
+// What a reading can make the alert state machine say
+typedef enum {
+    ALERT_EVENT_NONE = 0,
+    ALERT_EVENT_ENTER,
+    ALERT_EVENT_CLEAR,
+    ALERT_EVENT_SUMMARY
+} alert_event_t;
+
+// Which state the band flags of the running average point at, given the state we are in now.
+// Leaving an alert needs the average to come ALERT_HYSTERESIS back inside the band.
+static alert_state_t classify(alert_state_t current, uint8_t flags) {
+    if (flags & BAND_ABOVE_MAX) return ALERT_HOT;
+    if (flags & BAND_BELOW_MIN) return ALERT_COLD;
+    if (current == ALERT_HOT && (flags & BAND_NEAR_MAX)) return ALERT_HOT;
+    if (current == ALERT_COLD && (flags & BAND_NEAR_MIN)) return ALERT_COLD;
+    return ALERT_NORMAL;
+}
+
+// Advance the alert state machine of a node for band flags computed at time 'ts'.
+// Must be called inside the node's seqlock write section.
+static alert_event_t update_alert(node_info_t *node, uint8_t flags, sensor_ts_t ts) {
+    alert_state_t target = classify(node->alert, flags);
 
-    // Initialise dplist
-    sensor_info = dpl_create(element_copy, element_free, element_compare);
+    if (target == node->alert) {
+        node->alert_pending = node->alert;
+        if (node->alert != ALERT_NORMAL && ts - node->alert_reported >= ALERT_SUMMARY_INTERVAL) {
+            node->alert_reported = ts;
+            return ALERT_EVENT_SUMMARY;
+        }
+        return ALERT_EVENT_NONE;
+    }
 
-    // Read sensor map file
-    int sensor_id, room_id;
-    while (fscanf(fp_sensor_map, "%d %d", &room_id, &sensor_id) == 2) {
-        node_info_t node;
+    if (target != node->alert_pending) {
+        node->alert_pending = target;
+        node->alert_pending_since = ts;
+    }
+    if (ts - node->alert_pending_since < ALERT_MIN_DWELL) return ALERT_EVENT_NONE;
 
-        // Set id information
-        node.sensor_id = sensor_id;
-        node.room_id = room_id;
+    node->alert = target;
+    node->alert_since = node->alert_pending_since;
+    node->alert_reported = ts;
+    return target == ALERT_NORMAL ? ALERT_EVENT_CLEAR : ALERT_EVENT_ENTER;
+}
 
-        // Initialise running average machinery
-        node.prev_vals = (sensor_value_t *)malloc(
-                sizeof(sensor_value_t) * RUN_AVG_LENGTH);
-        for (int i = 0; i < RUN_AVG_LENGTH; i++) node.prev_vals[i] = -99999;
-        node.running_avg = 0;
+// Cheap pre-check for update_alert(): false when it would leave the node untouched
+static bool alert_may_change(const node_info_t *node, uint8_t flags, sensor_ts_t ts) {
+    if (classify(node->alert, flags) != node->alert || node->alert_pending != node->alert) return true;
+    return node->alert != ALERT_NORMAL && ts - node->alert_reported >= ALERT_SUMMARY_INTERVAL;
+}
 
-        // Insert node into dplist
-        dpl_insert_at_index(sensor_info, &node, 0, true);
+static void log_alert_event(const node_info_t *node, alert_event_t event) {
+    if (event == ALERT_EVENT_NONE) return;
+    bool hot = node->alert == ALERT_HOT;
+    SENSOR_PROBE4(alert, node->sensor_id, event, node->alert, node->running_avg * 1000);
+
+    switch (event) {
+    case ALERT_EVENT_ENTER:
+        if (hot) log_event(LOG_TOO_HOT, (int)node->sensor_id, node->running_avg);
+        else log_event(LOG_TOO_COLD, (int)node->sensor_id, node->running_avg);
+        break;
+    case ALERT_EVENT_CLEAR:
+        log_event(LOG_BACK_TO_NORMAL, (int)node->sensor_id, node->running_avg);
+        break;
+    case ALERT_EVENT_SUMMARY: {
+        long long lasted = node->alert_reported - node->alert_since;
+        if (hot) log_event(LOG_STILL_TOO_HOT, (int)node->sensor_id, lasted, node->running_avg);
+        else log_event(LOG_STILL_TOO_COLD, (int)node->sensor_id, lasted, node->running_avg);
+        break;
+    }
+    default:
+        return;
     }
+}
 
-    fclose(fp_sensor_map);
+// Bring the slots in line with a newly published map.
+// Sensors that stay keep their running state, new ones start fresh, removed ones are dropped.
+void datamgr_apply_map(const sensor_map_t *map) {
+    int added = 0, removed = 0;
+    applied_map = map;
+
+    seq_write_begin(&map_seq);
+
+    for (int i = 0; i < map->size; i++) {
+        node_info_t *node = &sensor_info[map->sensor_ids[i]];
+
+        seq_write_begin(&node->seq);
+        if (!node->in_map) {
+            // Initialise running average machinery
+            node->in_map = true;
+            node->sensor_id = map->sensor_ids[i];
+            for (int j = 0; j < RUN_AVG_LENGTH; j++) node->prev_vals[j] = 0;
+            node->prev_next = 0;
+            node->nb_readings = 0;
+            node->value_sum = node->value_min = node->value_max = 0;
+            node->running_avg = 0;
+            node->last_modified = 0;
+            node->alert = node->alert_pending = ALERT_NORMAL;
+            node->alert_since = node->alert_pending_since = node->alert_reported = 0;
+            node->report_interval = 0;
+            node->stale = false;
+            added++;
+        }
+        node->room_id = map->room_ids[i];
+        node->min_temp = map->min_temps[i];
+        node->max_temp = map->max_temps[i];
+        node->map_index = i;
+        node->map_generation = map->generation;
+        seq_write_end(&node->seq);
+
+        map_avgs[i] = node->running_avg;
+    }
 
-    // Read sensor data from sbuffer
-    sensor_data_t sd;
+    // Drop sensors that are no longer listed, then take over the map order
+    for (int i = 0; i < map_size; i++) {
+        node_info_t *node = &sensor_info[map_ids[i]];
+        if (node->map_generation != map->generation) {
+            seq_write_begin(&node->seq);
+            node->in_map = false;
+            stale_forget(node);
+            seq_write_end(&node->seq);
+            removed++;
+        }
+    }
 
-    while (true) {
-        // Take latest reading from sbuffer
-        if (sbuffer_remove(buffer, &sd, 0) != SBUFFER_NO_DATA) {
-            // Find element in dplist
-            node_info_t *element = get_element_from_id(sd.id);
-
-            // If can't find ID in list
-            if (!element) {
-                char log_msg_err[128];
-                snprintf(log_msg_err, sizeof(log_msg_err),
-                        "Received sensor data with invalid sensor node ID %u",
-                        sd.id);
-                write_to_log_process(log_msg_err);
-                continue;
-            }
+    map_size = map->size;
+    memcpy(map_ids, map->sensor_ids, map->size * sizeof(*map_ids));
 
-            // Update timestamp
-            element->last_modified = sd.ts;
+    seq_write_end(&map_seq);
 
-            // Update prev_vals
-            for (int i = 0; i < RUN_AVG_LENGTH - 1; i++) {
-                (element->prev_vals)[i] = (element->prev_vals)[i+1];
-            }
-            (element->prev_vals)[RUN_AVG_LENGTH - 1] = sd.value;
+    if (map->generation > 1) log_event(LOG_MAP_APPLIED, (int)map->generation, added, removed);
 
-            // Update running_avg
-            element->running_avg = 0;
-            for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-                element->running_avg += (element->prev_vals)[i] / RUN_AVG_LENGTH;
-            }
+    // Bands may have moved: check every sensor against its new band in one pass
+    kernel_band_check(map_avgs, map->min_temps, map->max_temps, map->size,
+            ALERT_HYSTERESIS, map_flags);
+    for (int i = 0; i < map->size; i++) {
+        node_info_t *node = &sensor_info[map->sensor_ids[i]];
+        if (node->nb_readings < RUN_AVG_LENGTH) continue;
+
+        seq_write_begin(&node->seq);
+        alert_event_t event = update_alert(node, map_flags[i], node->last_modified);
+        seq_write_end(&node->seq);
+
+        log_alert_event(node, event);
+    }
+}
+
+// Only a full window gives a meaningful average; before that it reads 0
+static void update_running_avg(node_info_t *node) {
+    if (node->nb_readings < RUN_AVG_LENGTH) {
+        node->running_avg = 0;
+        return;
+    }
 
-            char log_msg[128];
-            // Check if value outside bounds
-            if ((element->prev_vals)[0] != -99999) {
-                if (element->running_avg < SET_MIN_TEMP) {
-                    snprintf(log_msg, sizeof(log_msg),
-                            "Sensor node %u reports it's too cold (avg temp = %f)",
-                            element->sensor_id, element->running_avg);
-                    write_to_log_process(log_msg);
-                } else if (element->running_avg > SET_MAX_TEMP) {
-                    snprintf(log_msg, sizeof(log_msg),
-                            "Sensor node %u reports it's too hot (avg temp = %f)",
-                            element->sensor_id, element->running_avg);
-                    write_to_log_process(log_msg);
-                }
+    sensor_value_t sum = 0;
+    for (int i = 0; i < RUN_AVG_LENGTH; i++) sum += node->prev_vals[i];
+    node->running_avg = sum / RUN_AVG_LENGTH;
+}
+
+static void log_invalid_sensor(sensor_id_t id) {
+    log_event(LOG_INVALID_SENSOR, (int)id);
+}
+
+void datamgr_process_reading(const sensor_data_t *sd) {
+    // Find element in map
+    node_info_t *element = get_element_from_id(sd->id);
+
+    // If can't find ID in map
+    if (!element) {
+        log_invalid_sensor(sd->id);
+        return;
+    }
+
+    seq_write_begin(&element->seq);
+
+    time_t silent_for = stale_seen(element, sd->ts, sd->ts, 1, time(NULL));
+
+    // Update timestamp and statistics
+    element->last_modified = sd->ts;
+    if (element->nb_readings == 0) {
+        element->value_sum = element->value_min = element->value_max = sd->value;
+    } else {
+        element->value_sum += sd->value;
+        if (sd->value < element->value_min) element->value_min = sd->value;
+        if (sd->value > element->value_max) element->value_max = sd->value;
+    }
+
+    // Update prev_vals and running_avg
+    element->prev_vals[element->prev_next] = sd->value;
+    element->prev_next = (element->prev_next + 1) % RUN_AVG_LENGTH;
+    element->nb_readings++;
+    update_running_avg(element);
+
+    int idx = element->map_index;
+    map_avgs[idx] = element->running_avg;
+    alert_event_t event = ALERT_EVENT_NONE;
+    if (element->nb_readings >= RUN_AVG_LENGTH) {
+        uint8_t flags;
+        kernel_band_check(&map_avgs[idx], &applied_map->min_temps[idx],
+                &applied_map->max_temps[idx], 1, ALERT_HYSTERESIS, &flags);
+        event = update_alert(element, flags, sd->ts);
+    }
+
+    seq_write_end(&element->seq);
+
+    log_resumed(element, silent_for);
+    log_alert_event(element, event);
+}
+
+// Group a batch per sensor, fold each group into its sensor, then run all band checks in one pass.
+// Alerts are decided on the average at the end of the batch, not after every single reading.
+void datamgr_process_batch(const sensor_data_t *data, int count) {
+    while (count > DATAMGR_BATCH_SIZE) {
+        datamgr_process_batch(data, DATAMGR_BATCH_SIZE);
+        data += DATAMGR_BATCH_SIZE;
+        count -= DATAMGR_BATCH_SIZE;
+    }
+
+    // Count readings per sensor, numbering sensors in order of first appearance
+    batch_no++;
+    int groups = 0;
+    for (int i = 0; i < count; i++) {
+        node_info_t *node = get_element_from_id(data[i].id);
+        if (!node) {
+            log_invalid_sensor(data[i].id);
+            batch_group_of[i] = -1;
+            continue;
+        }
+        if (node->batch_no != batch_no) {
+            node->batch_no = batch_no;
+            node->batch_group = groups;
+            group_node[groups] = node;
+            group_start[groups + 1] = 0;
+            group_first_ts[groups] = data[i].ts;
+            groups++;
+        }
+        batch_group_of[i] = node->batch_group;
+        group_start[node->batch_group + 1]++;
+    }
+
+    // Stable counting sort: the values of group g end up in group_vals[group_start[g] .. group_start[g+1]-1]
+    group_start[0] = 0;
+    for (int g = 0; g < groups; g++) group_start[g + 1] += group_start[g];
+    int fill[DATAMGR_BATCH_SIZE];
+    memcpy(fill, group_start, groups * sizeof(*fill));
+    for (int i = 0; i < count; i++) {
+        int g = batch_group_of[i];
+        if (g < 0) continue;
+        group_vals[fill[g]++] = data[i].value;
+        group_ts[g] = data[i].ts;
+    }
+
+    // Fold every group into its sensor
+    time_t now = time(NULL);
+    for (int g = 0; g < groups; g++) {
+        node_info_t *node = group_node[g];
+        const sensor_value_t *vals = &group_vals[group_start[g]];
+        int k = group_start[g + 1] - group_start[g];
+
+        // Most groups hold a reading or two; the SIMD reduction only pays off for larger ones.
+        // Its sum is not used: it adds the values in another order, see below.
+        sensor_value_t sum, min, max;
+        if (k >= 8) {
+            kernel_reduce(vals, k, &sum, &min, &max);
+        } else {
+            min = max = vals[0];
+            for (int i = 1; i < k; i++) {
+                if (vals[i] < min) min = vals[i];
+                if (vals[i] > max) max = vals[i];
             }
+        }
+
+        seq_write_begin(&node->seq);
+
+        time_t silent_for = stale_seen(node, group_first_ts[g], group_ts[g], k, now);
+
+        node->last_modified = group_ts[g];
+        int first = 0;
+        if (node->nb_readings == 0) {
+            node->value_sum = vals[0];
+            node->value_min = min;
+            node->value_max = max;
+            first = 1;
         } else {
+            if (min < node->value_min) node->value_min = min;
+            if (max > node->value_max) node->value_max = max;
+        }
+        // One value at a time in arrival order, as datamgr_process_reading() adds them, so the sum has the same bits
+        for (int i = first; i < k; i++) node->value_sum += vals[i];
+
+        // Only the last RUN_AVG_LENGTH values survive in the window; skip the ring ahead
+        // so it ends up exactly as if every value had been pushed
+        int keep = k < RUN_AVG_LENGTH ? k : RUN_AVG_LENGTH;
+        node->prev_next = (node->prev_next + (k - keep)) % RUN_AVG_LENGTH;
+        for (int i = k - keep; i < k; i++) {
+            node->prev_vals[node->prev_next] = vals[i];
+            node->prev_next = (node->prev_next + 1) % RUN_AVG_LENGTH;
+        }
+        node->nb_readings += k;
+        update_running_avg(node);
+
+        seq_write_end(&node->seq);
+
+        log_resumed(node, silent_for);
+
+        int idx = node->map_index;
+        map_avgs[idx] = node->running_avg;
+        group_avg[g] = node->running_avg;
+        group_min[g] = applied_map->min_temps[idx];
+        group_max[g] = applied_map->max_temps[idx];
+    }
+
+    // One band check over every sensor the batch touched
+    kernel_band_check(group_avg, group_min, group_max, groups, ALERT_HYSTERESIS, group_flags);
+
+    for (int g = 0; g < groups; g++) {
+        node_info_t *node = group_node[g];
+        if (node->nb_readings < RUN_AVG_LENGTH) continue;
+        if (!alert_may_change(node, group_flags[g], group_ts[g])) continue;
+
+        seq_write_begin(&node->seq);
+        alert_event_t event = update_alert(node, group_flags[g], group_ts[g]);
+        seq_write_end(&node->seq);
+
+        log_alert_event(node, event);
+    }
+}
+
+/* CHECKPOINT CODE */
+
+#define CKPT_MAGIC "DMCKPT1"
+#define CKPT_VERSION 2
+
+// On-disk layout, fixed-width and without padding
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t run_avg_length;
+    uint32_t record_size;
+    uint32_t count;
+    int64_t written_at;
+    uint32_t checksum;          // FNV-1a over all records
+    uint32_t reserved;
+} ckpt_header_t;
+
+typedef struct {
+    uint16_t sensor_id;
+    uint16_t alert;
+    uint16_t alert_pending;
+    uint16_t prev_next;
+    uint32_t nb_readings;
+    uint32_t reserved;
+    int64_t last_modified;
+    int64_t alert_pending_since;
+    int64_t alert_since;
+    int64_t alert_reported;
+    double value_sum;
+    double value_min;
+    double value_max;
+    double running_avg;
+    double report_interval;
+    double prev_vals[RUN_AVG_LENGTH];
+} ckpt_record_t;
+
+static pthread_t ckpt_thread;
+static pthread_mutex_t ckpt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ckpt_cond = PTHREAD_COND_INITIALIZER;
+static bool ckpt_stop = false;
+
+// Reused by every checkpoint and grown with the map (checkpoint thread, then stop_checkpointer())
+static uint8_t *ckpt_buf = NULL;
+static size_t ckpt_capacity = 0;    // records that fit in ckpt_buf
+
+static uint32_t fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Copy the persistent part of a slot, consistently, without blocking the datamgr thread
+static bool read_record(sensor_id_t sensor_id, ckpt_record_t *rec) {
+    node_info_t *node = &sensor_info[sensor_id];
+    unsigned s;
+    bool in_map;
+
+    do {
+        s = seq_read_begin(&node->seq);
+        in_map = node->in_map;
+        rec->sensor_id = node->sensor_id;
+        rec->reserved = 0;
+        rec->alert = node->alert;
+        rec->alert_pending = node->alert_pending;
+        rec->prev_next = node->prev_next;
+        rec->nb_readings = node->nb_readings;
+        rec->last_modified = node->last_modified;
+        rec->alert_pending_since = node->alert_pending_since;
+        rec->alert_since = node->alert_since;
+        rec->alert_reported = node->alert_reported;
+        rec->value_sum = node->value_sum;
+        rec->value_min = node->value_min;
+        rec->value_max = node->value_max;
+        rec->running_avg = node->running_avg;
+        rec->report_interval = node->report_interval;
+        memcpy(rec->prev_vals, node->prev_vals, sizeof(rec->prev_vals));
+    } while (seq_read_retry(&node->seq, s));
+
+    return in_map;
+}
+
+// Write all sensors to 'path' through a temporary file, so a crash never leaves half a checkpoint
+static int write_checkpoint(const char *path) {
+    uint32_t count;
+    while (true) {
+        unsigned s = seq_read_begin(&map_seq);
+        int size = map_size;
+
+        // The map grew since the last checkpoint: make room and copy it again
+        if (!ckpt_buf || (size_t)size > ckpt_capacity) {
+            size_t capacity = size + size / 4 + 16;
+            uint8_t *buf = realloc(ckpt_buf, sizeof(ckpt_header_t) + capacity * sizeof(ckpt_record_t));
+            if (!buf) return -1;
+            ckpt_buf = buf;
+            ckpt_capacity = capacity;
+            continue;
+        }
+
+        ckpt_record_t *records = (ckpt_record_t *)(ckpt_buf + sizeof(ckpt_header_t));
+        count = 0;
+        for (int i = 0; i < size; i++) {
+            if (read_record(map_ids[i], &records[count])) count++;
+        }
+        if (!seq_read_retry(&map_seq, s)) break;
+    }
+
+    ckpt_header_t *header = (ckpt_header_t *)ckpt_buf;
+    ckpt_record_t *records = (ckpt_record_t *)(ckpt_buf + sizeof(*header));
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CKPT_MAGIC, sizeof(header->magic));
+    header->version = CKPT_VERSION;
+    header->run_avg_length = RUN_AVG_LENGTH;
+    header->record_size = sizeof(ckpt_record_t);
+    header->count = count;
+    header->written_at = time(NULL);
+    header->checksum = fnv1a(records, count * sizeof(ckpt_record_t));
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    size_t len = sizeof(*header) + count * sizeof(ckpt_record_t);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    ssize_t written = write(fd, ckpt_buf, len);
+    int synced = fdatasync(fd);
+    close(fd);
+
+    if (written != (ssize_t)len || synced != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// A record that passed the checksum can still be stale or hand-made; only take states the node can be in
+static bool valid_record(const ckpt_record_t *rec) {
+    return rec->prev_next < RUN_AVG_LENGTH &&
+           rec->alert <= ALERT_COLD && rec->alert_pending <= ALERT_COLD &&
+           rec->report_interval >= 0 && rec->report_interval < 1e12;
+}
+
+// Map the checkpoint and restore the sensors that are still in the map
+static void restore_checkpoint(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ckpt_header_t)) {
+        close(fd);
+        return;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return;
+
+    const ckpt_header_t *header = mem;
+    const ckpt_record_t *records = (const ckpt_record_t *)((const uint8_t *)mem + sizeof(*header));
+
+    if (memcmp(header->magic, CKPT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CKPT_VERSION ||
+        header->run_avg_length != RUN_AVG_LENGTH ||
+        header->record_size != sizeof(ckpt_record_t) ||
+        (size_t)st.st_size != sizeof(*header) + (size_t)header->count * sizeof(ckpt_record_t) ||
+        header->checksum != fnv1a(records, header->count * sizeof(ckpt_record_t))) {
+        log_event(LOG_CKPT_INVALID, path);
+        munmap(mem, st.st_size);
+        return;
+    }
+
+    int restored = 0;
+    time_t now = time(NULL);
+    for (uint32_t i = 0; i < header->count; i++) {
+        const ckpt_record_t *rec = &records[i];
+        node_info_t *node = get_element_from_id(rec->sensor_id);
+        if (!node || !valid_record(rec)) continue;
+
+        seq_write_begin(&node->seq);
+        node->alert = rec->alert;
+        node->alert_pending = rec->alert_pending;
+        node->prev_next = rec->prev_next;
+        node->nb_readings = rec->nb_readings;
+        node->last_modified = rec->last_modified;
+        node->alert_pending_since = rec->alert_pending_since;
+        node->alert_since = rec->alert_since;
+        node->alert_reported = rec->alert_reported;
+        node->value_sum = rec->value_sum;
+        node->value_min = rec->value_min;
+        node->value_max = rec->value_max;
+        node->running_avg = rec->running_avg;
+        node->report_interval = rec->report_interval;
+        memcpy(node->prev_vals, rec->prev_vals, sizeof(node->prev_vals));
+        seq_write_end(&node->seq);
+
+        // Sensors that do not come back after the restart get reported silent too
+        if (node->nb_readings > 0) {
+            node->last_seen = now;
+            stale_watch(node, now + stale_timeout(node));
+        }
+
+        map_avgs[node->map_index] = node->running_avg;
+        restored++;
+    }
+
+    long long written_at = header->written_at;
+    munmap(mem, st.st_size);
+    log_event(LOG_CKPT_RESTORED, restored, written_at);
+}
+
+static void *run_checkpointer(void *arg) {
+    pthread_mutex_lock(&ckpt_mutex);
+    while (!ckpt_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DATAMGR_CHECKPOINT_INTERVAL;
+        pthread_cond_timedwait(&ckpt_cond, &ckpt_mutex, &deadline);
+        if (ckpt_stop) break;
+
+        // Only reads the seqlocked slots, so ingest keeps going while we write
+        pthread_mutex_unlock(&ckpt_mutex);
+        if (write_checkpoint(DATAMGR_CHECKPOINT_FILE) != 0) {
+            log_event(LOG_CKPT_FAILED, DATAMGR_CHECKPOINT_FILE);
+        }
+        pthread_mutex_lock(&ckpt_mutex);
+    }
+    pthread_mutex_unlock(&ckpt_mutex);
+    return NULL;
+}
+
+static void start_checkpointer() {
+    ckpt_stop = false;
+    pthread_create(&ckpt_thread, NULL, run_checkpointer, NULL);
+}
+
+// Stop the background writer and leave a final checkpoint behind for the next start
+static void stop_checkpointer() {
+    pthread_mutex_lock(&ckpt_mutex);
+    ckpt_stop = true;
+    pthread_cond_signal(&ckpt_cond);
+    pthread_mutex_unlock(&ckpt_mutex);
+    pthread_join(ckpt_thread, NULL);
+
+    if (write_checkpoint(DATAMGR_CHECKPOINT_FILE) != 0) {
+        log_event(LOG_CKPT_FAILED, DATAMGR_CHECKPOINT_FILE);
+    }
+    free(ckpt_buf);
+    ckpt_buf = NULL;
+    ckpt_capacity = 0;
+}
+
+// Parse sensor data and keep the per-sensor state up to date
+void *run_datamgr(void *args) {
+    // Parse args
+    datamgr_args_t* datamgr_args = (datamgr_args_t *)args;
+    sbuffer_t *buffer = datamgr_args->buffer;
+
+    metrics_register("datamgr", 0);
+
+    // Pick up the sensor map published by sensor_map_start()
+    int map_reader = sensor_map_register_reader();
+    ERROR_HANDLER(map_reader < 0, "Could not register as sensor map reader");
+    const sensor_map_t *map = sensor_map_get(map_reader);
+    datamgr_apply_map(map);
+
+    // Warm start: pick up where the previous run left off
+    if (DATAMGR_CHECKPOINT_INTERVAL > 0) {
+        restore_checkpoint(DATAMGR_CHECKPOINT_FILE);
+        start_checkpointer();
+    }
+
+    // Read sensor data from sbuffer, as much as is available at once,
+    // but wake up in time for the next stale-sensor deadline
+    sensor_data_t batch[DATAMGR_BATCH_SIZE];
+    int count;
+    time_t next_deadline = 0;
+
+    while (1) {
+        struct timespec until = {.tv_sec = next_deadline, .tv_nsec = 0};
+        int result = sbuffer_remove_batch_until(buffer, batch, DATAMGR_BATCH_SIZE, &count, 0,
+                next_deadline ? &until : NULL);
+        if (result == SBUFFER_SUCCESS) {
+            // A reload only costs a pointer compare until a new map shows up
+            const sensor_map_t *latest = sensor_map_get(map_reader);
+            if (latest != map) {
+                map = latest;
+                datamgr_apply_map(map);
+            }
+
+            datamgr_process_batch(batch, count);
+            latency_record(LATENCY_DATAMGR, batch, count, latency_now_ns());
+            metrics_add(METRIC_DATAMGR_READINGS, count);
+            metrics_add(METRIC_DATAMGR_BATCHES, 1);
+        } else if (result != SBUFFER_TIMEOUT) {
             break;
         }
+
+        next_deadline = datamgr_check_stale(time(NULL));
     }
 
-    datamgr_free(&sensor_info);
+    if (DATAMGR_CHECKPOINT_INTERVAL > 0) stop_checkpointer();
+
+    sensor_map_unregister_reader(map_reader);
+    datamgr_free();
+    metrics_unregister();
 
     return NULL;
 }
 
-// Free sensor data
-void datamgr_free(dplist_t **sensor_info) {
-    dpl_free(sensor_info, true);
+// Forget the sensor map; slots are static so concurrent readers stay safe
+void datamgr_free() {
+    seq_write_begin(&map_seq);
+    for (int i = 0; i < map_size; i++) {
+        node_info_t *node = &sensor_info[map_ids[i]];
+        seq_write_begin(&node->seq);
+        node->in_map = false;
+        stale_forget(node);
+        seq_write_end(&node->seq);
+    }
+    map_size = 0;
+    seq_write_end(&map_seq);
+}
+
+// Copy one slot out consistently; returns false if the sensor is not in the map
+static bool read_slot(sensor_id_t sensor_id, datamgr_sensor_state_t *state) {
+    node_info_t *node = &sensor_info[sensor_id];
+    unsigned s;
+    bool in_map;
+
+    do {
+        s = seq_read_begin(&node->seq);
+        in_map = node->in_map;
+        state->sensor_id = node->sensor_id;
+        state->room_id = node->room_id;
+        state->running_avg = node->running_avg;
+        state->last_modified = node->last_modified;
+        state->min_temp = node->min_temp;
+        state->max_temp = node->max_temp;
+        state->nb_readings = node->nb_readings;
+        state->min_value = node->value_min;
+        state->max_value = node->value_max;
+        state->mean_value = node->nb_readings ? node->value_sum / node->nb_readings : 0;
+        state->alert = node->alert;
+        state->alert_since = node->alert_since;
+        state->report_interval = node->nb_readings >= 2 ? node->report_interval : 0;
+        state->stale = node->stale;
+    } while (seq_read_retry(&node->seq, s));
+
+    return in_map;
+}
+
+int datamgr_read_sensor(sensor_id_t sensor_id, datamgr_sensor_state_t *state) {
+    if (!state) return DATAMGR_FAILURE;
+    return read_slot(sensor_id, state) ? DATAMGR_SUCCESS : DATAMGR_NO_SENSOR;
+}
+
+int datamgr_snapshot(datamgr_sensor_state_t *states, int max_states) {
+    if (!states || max_states < 0) return DATAMGR_FAILURE;
+
+    int count;
+    unsigned s;
+    do {
+        s = seq_read_begin(&map_seq);
+        count = 0;
+        for (int i = 0; i < map_size && count < max_states; i++) {
+            if (read_slot(map_ids[i], &states[count])) count++;
+        }
+    } while (seq_read_retry(&map_seq, s));
+
+    return count;
 }
 
 uint16_t datamgr_get_room_id(sensor_id_t sensor_id) {
-    node_info_t *element = get_element_from_id(sensor_id);
-    return (uint16_t) element->room_id;
+    datamgr_sensor_state_t state;
+    ERROR_HANDLER(!read_slot(sensor_id, &state), "Invalid sensor ID");
+    return state.room_id;
 }
 
 sensor_value_t datamgr_get_avg(sensor_id_t sensor_id) {
-    node_info_t *element = get_element_from_id(sensor_id);
-    return element->running_avg;
+    datamgr_sensor_state_t state;
+    ERROR_HANDLER(!read_slot(sensor_id, &state), "Invalid sensor ID");
+    return state.running_avg;
 }
 
 time_t datamgr_get_last_modified(sensor_id_t sensor_id) {
-    node_info_t *element = get_element_from_id(sensor_id);
-    return (time_t) element->last_modified;
+    datamgr_sensor_state_t state;
+    ERROR_HANDLER(!read_slot(sensor_id, &state), "Invalid sensor ID");
+    return (time_t) state.last_modified;
 }
 
 int datamgr_get_total_sensors() {
-    return dpl_size(sensor_info);
+    unsigned s;
+    int size;
+    do {
+        s = seq_read_begin(&map_seq);
+        size = map_size;
+    } while (seq_read_retry(&map_seq, s));
+    return size;
 }
@@ -10,11 +10,26 @@
 #include <stdio.h>
 #include "config.h"
 #include "sbuffer.h"
+#include "sensor_map.h"
 
 #ifndef RUN_AVG_LENGTH
 #define RUN_AVG_LENGTH 5
 #endif
 
+// Maximum number of readings the datamgr takes from the sbuffer and processes at once
+#ifndef DATAMGR_BATCH_SIZE
+#define DATAMGR_BATCH_SIZE 256
+#endif
+
+// Seconds between checkpoints of the per-sensor state; 0 disables checkpoints and warm starts
+#ifndef DATAMGR_CHECKPOINT_INTERVAL
+#define DATAMGR_CHECKPOINT_INTERVAL 10
+#endif
+
+#ifndef DATAMGR_CHECKPOINT_FILE
+#define DATAMGR_CHECKPOINT_FILE "datamgr.ckpt"
+#endif
+
 #ifndef SET_MAX_TEMP
 #error SET_MAX_TEMP not set
 #endif
@@ -23,6 +38,36 @@
 #error SET_MIN_TEMP not set
 #endif
 
+// Degrees the running average has to move back inside the band before an alert clears
+#ifndef ALERT_HYSTERESIS
+#define ALERT_HYSTERESIS 0.5
+#endif
+
+// Seconds (sensor time) a new alert state has to hold before it is reported
+#ifndef ALERT_MIN_DWELL
+#define ALERT_MIN_DWELL 0
+#endif
+
+// Seconds (sensor time) between reminders for an alert that is still active
+#ifndef ALERT_SUMMARY_INTERVAL
+#define ALERT_SUMMARY_INTERVAL 300
+#endif
+
+// A sensor is reported silent after missing this many of its usual report intervals
+#ifndef DATAMGR_STALE_INTERVALS
+#define DATAMGR_STALE_INTERVALS 3
+#endif
+
+// Never report a sensor silent sooner than this many seconds after its last reading
+#ifndef DATAMGR_STALE_MIN_TIMEOUT
+#define DATAMGR_STALE_MIN_TIMEOUT 5
+#endif
+
+// Report interval (seconds) assumed for a sensor until it has sent two readings
+#ifndef DATAMGR_STALE_DEFAULT_INTERVAL
+#define DATAMGR_STALE_DEFAULT_INTERVAL 10
+#endif
+
 /*
  * Use ERROR_HANDLER() for handling memory allocation problems, invalid sensor IDs, non-existing files, etc.
  */
@@ -33,16 +78,79 @@
                       }                                             \
                     } while(0)
 
+#define DATAMGR_FAILURE -1
+#define DATAMGR_SUCCESS 0
+#define DATAMGR_NO_SENSOR 1
+
 // To pass to run_datamgr
+// The sensor map itself comes from sensor_map_start()
 typedef struct datamgr_args {
-    FILE * fp_sensor_map;
     sbuffer_t *buffer;
 } datamgr_args_t;
 
+// Alert state of a sensor; only transitions between these are logged
+typedef enum {
+    ALERT_NORMAL = 0,
+    ALERT_HOT,
+    ALERT_COLD
+} alert_state_t;
+
+/**
+ * A consistent copy of the live state of one sensor, as handed out to reader threads
+ */
+typedef struct datamgr_sensor_state {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+    sensor_value_t running_avg;
+    sensor_ts_t last_modified;
+    sensor_value_t min_temp;
+    sensor_value_t max_temp;
+    unsigned nb_readings;       /**< readings since the sensor was added to the map */
+    sensor_value_t min_value;   /**< smallest, largest and mean of those readings */
+    sensor_value_t max_value;
+    sensor_value_t mean_value;
+    alert_state_t alert;
+    sensor_ts_t alert_since;
+    double report_interval;     /**< estimated seconds between readings, 0 if not known yet */
+    int stale;                  /**< 1 while the sensor is overdue and reported silent */
+} datamgr_sensor_state_t;
+
+/**
+ * Counters of the stale-sensor detection, for monitoring
+ */
+typedef struct datamgr_stale_stats {
+    int stale_sensors;          /**< sensors that are silent right now */
+    unsigned long silent_events;    /**< times a sensor was reported silent */
+    unsigned long resumed_events;   /**< times a silent sensor started reporting again */
+} datamgr_stale_stats_t;
+
 
 // UPDATED to read from sbuffer
 void *run_datamgr(void *args);
 
+/**
+ * Brings the per-sensor state in line with 'map': new sensors are added, removed ones dropped,
+ * the rest keep their state. Called by run_datamgr() for every published map.
+ * \param map the map to apply; it must stay valid until the next call
+ */
+void datamgr_apply_map(const sensor_map_t *map);
+
+/**
+ * Processes a single reading: updates the running average and statistics, then the alert state
+ * Must only be called from the thread that owns the datamgr state (normally run_datamgr())
+ * \param data the reading
+ */
+void datamgr_process_reading(const sensor_data_t *data);
+
+/**
+ * Processes a block of readings at once: readings are grouped per sensor, each group is folded into
+ * its sensor, and all band checks run in one vectorised pass. Alerts are decided on the average at
+ * the end of the block. Must only be called from the thread that owns the datamgr state.
+ * \param data the readings, in arrival order
+ * \param count the number of readings
+ */
+void datamgr_process_batch(const sensor_data_t *data, int count);
+
 /**
  * This method should be called to clean up the datamgr, and to free all used memory.
  * After this, any call to datamgr_get_room_id, datamgr_get_avg, datamgr_get_last_modified or datamgr_get_total_sensors will not return a valid result
@@ -79,4 +187,39 @@ time_t datamgr_get_last_modified(sensor_id_t sensor_id);
  */
 int datamgr_get_total_sensors();
 
+/**
+ * Copies the latest state of a certain sensor ID into '*state'
+ * Safe to call from any thread while the datamgr is running; readers never block the datamgr thread
+ * \param sensor_id the sensor id to look for
+ * \param state a pointer to pre-allocated space the state is copied into
+ * \return DATAMGR_SUCCESS on success, DATAMGR_NO_SENSOR if the sensor is not in the map, DATAMGR_FAILURE if 'state' is NULL
+ */
+int datamgr_read_sensor(sensor_id_t sensor_id, datamgr_sensor_state_t *state);
+
+/**
+ * Copies the latest state of all known sensors into the contiguous array 'states'
+ * Each entry is consistent on its own; entries are ordered as in the current room_sensor.map
+ * Safe to call from any thread while the datamgr is running
+ * \param states a pointer to pre-allocated space for at least 'max_states' entries
+ * \param max_states the capacity of 'states'
+ * \return the number of entries written, or DATAMGR_FAILURE if 'states' is NULL
+ */
+int datamgr_snapshot(datamgr_sensor_state_t *states, int max_states);
+
+/**
+ * Reports every sensor whose deadline has passed as silent (one log event per silence)
+ * Deadlines sit in a min-heap, so this only looks at sensors that are actually overdue.
+ * Must only be called from the thread that owns the datamgr state; run_datamgr() calls it after every wake-up.
+ * \param now the current time
+ * \return the earliest remaining deadline, or 0 if no sensor is being watched
+ */
+time_t datamgr_check_stale(time_t now);
+
+/**
+ * Copies the stale-sensor counters into '*stats'
+ * Safe to call from any thread
+ * \param stats a pointer to pre-allocated space the counters are copied into
+ */
+void datamgr_get_stale_stats(datamgr_stale_stats_t *stats);
+
 #endif  //DATAMGR_H_
@@ -0,0 +1,161 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Compares datamgr_process_reading() (one reading at a time) against
+ * datamgr_process_batch() (grouped per sensor, SIMD kernels) on synthetic readings,
+ * once on an array and once drained from a pre-filled sbuffer like run_datamgr() does.
+ * Built with SBUFFER_NB_CONSUMERS=1 so the bench is the only consumer.
+ * Usage: ./datamgr_bench [number of readings]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "datamgr.h"
+#include "sensor_map.h"
+#include "sensor_kernels.h"
+#include "sbuffer.h"
+
+#define DEFAULT_READINGS 1000000
+
+static const int sensor_counts[] = {1000, 10000, 60000};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static sensor_map_t *make_map(int nb_sensors) {
+    sensor_map_t *map = calloc(1, sizeof(*map));
+    map->generation = 1;
+    map->size = nb_sensors;
+    map->sensor_ids = malloc(nb_sensors * sizeof(*map->sensor_ids));
+    map->room_ids = malloc(nb_sensors * sizeof(*map->room_ids));
+    map->min_temps = malloc(nb_sensors * sizeof(*map->min_temps));
+    map->max_temps = malloc(nb_sensors * sizeof(*map->max_temps));
+    for (int i = 0; i < nb_sensors; i++) {
+        map->sensor_ids[i] = i + 1;
+        map->room_ids[i] = i / 4;
+        map->min_temps[i] = SET_MIN_TEMP;
+        map->max_temps[i] = SET_MAX_TEMP;
+    }
+    return map;
+}
+
+// Readings for random sensors, staying inside the band so no alerts are logged
+static sensor_data_t *make_readings(int nb_readings, int nb_sensors) {
+    sensor_data_t *data = malloc(nb_readings * sizeof(*data));
+    for (int i = 0; i < nb_readings; i++) {
+        data[i].id = 1 + (sensor_id_t)(drand48() * nb_sensors);
+        data[i].value = (SET_MIN_TEMP + SET_MAX_TEMP) / 2.0 + (drand48() - 0.5);
+        data[i].ts = 1000000 + i / 100;
+    }
+    return data;
+}
+
+// Fill an sbuffer with the readings and the EOS marker
+static sbuffer_t *fill_buffer(sensor_data_t *data, int nb_readings) {
+    sbuffer_t *buffer;
+    sbuffer_init(&buffer);
+    for (int i = 0; i < nb_readings; i++) sbuffer_insert(buffer, &data[i]);
+    sensor_data_t eos = {.id = 0, .value = 0, .ts = 0};
+    sbuffer_insert(buffer, &eos);
+    return buffer;
+}
+
+static datamgr_sensor_state_t *run(const sensor_map_t *map, sensor_data_t *data,
+        int nb_readings, bool batch, bool from_buffer, double *seconds) {
+    datamgr_free();
+    datamgr_apply_map(map);
+
+    sbuffer_t *buffer = from_buffer ? fill_buffer(data, nb_readings) : NULL;
+    sensor_data_t block[DATAMGR_BATCH_SIZE];
+    int count;
+
+    double start = now_sec();
+    if (from_buffer && batch) {
+        while (sbuffer_remove_batch(buffer, block, DATAMGR_BATCH_SIZE, &count, 0) == SBUFFER_SUCCESS) {
+            datamgr_process_batch(block, count);
+        }
+    } else if (from_buffer) {
+        while (sbuffer_remove(buffer, block, 0) == SBUFFER_SUCCESS) {
+            datamgr_process_reading(block);
+        }
+    } else if (batch) {
+        for (int i = 0; i < nb_readings; i += DATAMGR_BATCH_SIZE) {
+            int n = nb_readings - i < DATAMGR_BATCH_SIZE ? nb_readings - i : DATAMGR_BATCH_SIZE;
+            datamgr_process_batch(data + i, n);
+        }
+    } else {
+        for (int i = 0; i < nb_readings; i++) datamgr_process_reading(&data[i]);
+    }
+    *seconds = now_sec() - start;
+
+    if (buffer) sbuffer_free(&buffer);
+
+    datamgr_sensor_state_t *states = malloc(map->size * sizeof(*states));
+    datamgr_snapshot(states, map->size);
+    return states;
+}
+
+int main(int argc, char *argv[]) {
+    int nb_readings = argc > 1 ? atoi(argv[1]) : DEFAULT_READINGS;
+    if (nb_readings <= 0) {
+        printf("Usage: %s [number of readings]\n", argv[0]);
+        return -1;
+    }
+
+    kernel_init();
+    srand48(42);
+
+    printf("kernels: %s, batch size %d, %d readings per run\n",
+            kernel_isa(), DATAMGR_BATCH_SIZE, nb_readings);
+    printf("%10s %10s %20s %20s %10s %8s\n",
+            "sensors", "source", "per-reading (M/s)", "batch (M/s)", "speedup", "match");
+
+    for (int c = 0; c < (int)(sizeof(sensor_counts) / sizeof(sensor_counts[0])); c++) {
+        int nb_sensors = sensor_counts[c];
+        sensor_map_t *map = make_map(nb_sensors);
+        sensor_data_t *data = make_readings(nb_readings, nb_sensors);
+
+        for (int from_buffer = 0; from_buffer <= 1; from_buffer++) {
+            double t_single, t_batch;
+            datamgr_sensor_state_t *single = run(map, data, nb_readings, false, from_buffer, &t_single);
+            datamgr_sensor_state_t *batch = run(map, data, nb_readings, true, from_buffer, &t_batch);
+
+            // Both paths must end in the same per-sensor state, bit for bit
+            bool match = true;
+            for (int i = 0; i < nb_sensors; i++) {
+                if (single[i].running_avg != batch[i].running_avg ||
+                    single[i].nb_readings != batch[i].nb_readings ||
+                    single[i].min_value != batch[i].min_value ||
+                    single[i].max_value != batch[i].max_value ||
+                    single[i].mean_value != batch[i].mean_value ||
+                    single[i].last_modified != batch[i].last_modified) {
+                    match = false;
+                }
+            }
+
+            printf("%10d %10s %20.2f %20.2f %9.2fx %8s\n", nb_sensors,
+                    from_buffer ? "sbuffer" : "array",
+                    nb_readings / t_single / 1e6, nb_readings / t_batch / 1e6,
+                    t_single / t_batch, match ? "yes" : "NO");
+
+            free(single);
+            free(batch);
+        }
+
+        free(data);
+        sensor_map_free(&map);
+    }
+
+    datamgr_free();
+    return 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Turns a binary log (gateway.blog, written with -DLOG_FILE_FORMAT=LOG_FILE_BINARY) into the
+ * lines gateway.log would have held.
+ * Usage: ./log_decode [gateway.blog]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensor_log.h"
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "gateway.blog";
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "[!] ERR: Could not open %s\n", path);
+        return -1;
+    }
+
+    log_file_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC)) != 0) {
+        fprintf(stderr, "[!] ERR: %s is not a binary log\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    char in[64 * 1024], line[LOG_RECORD_MAX + 128];
+    size_t have = 0, n;
+    unsigned seq = 0;
+    log_time_cache_t time_cache = {.second = -1};
+    int size = 0;
+    while ((n = fread(in + have, 1, sizeof(in) - have, f)) > 0) {
+        have += n;
+        size_t start = 0;
+        while ((size = log_record_size(in + start, have - start)) > 0) {
+            int len = log_line_format(seq, header.wall_offset_ns, &time_cache, in + start, line, sizeof(line));
+            if (len < 0) break;
+            fwrite(line, 1, len, stdout);
+            seq++;
+            start += size;
+        }
+        if (size < 0) break;
+        have -= start;
+        memmove(in, in + start, have);
+    }
+    fclose(f);
+
+    // A record cut off at the end was still being written
+    if (size < 0) {
+        fprintf(stderr, "[!] ERR: Damaged record after %u records\n", seq);
+        return -1;
+    }
+    return 0;
+}
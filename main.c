@@ -1,6 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <pthread.h>
 
 #include "config.h"
@@ -9,6 +12,11 @@
 #include "connmgr.h"
 #include "datamgr.h"
 #include "sensor_db.h"
+#include "sensor_map.h"
+#include "sensor_kernels.h"
+#include "sensor_cache.h"
+#include "sensor_metrics.h"
+#include "sensor_latency.h"
 
 sbuffer_t *buffer;
 
@@ -22,10 +30,36 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    // Pick the SIMD kernels for this CPU before any thread uses them
+    kernel_init();
+
+    // SIGHUP reloads the sensor map; block it everywhere so only the reloader thread sees it
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
     // Start logger
     start_logger();
     write_to_log_process("Started logger");
 
+    // Load the sensor map and watch it for changes
+    if (sensor_map_start("room_sensor.map") != SENSOR_MAP_SUCCESS) {
+        printf("Could not read room_sensor.map\n");
+        stop_logger();
+        return -1;
+    }
+
+    // Serve the pipeline metrics
+    if (metrics_start() == METRICS_SUCCESS) {
+        write_to_log_process("Metrics served on " METRICS_SOCKET_PATH);
+    } else {
+        write_to_log_process("Could not serve metrics on " METRICS_SOCKET_PATH);
+    }
+
+    // Report the latency percentiles every LATENCY_REPORT_SECONDS
+    if (latency_start() != LATENCY_SUCCESS) write_to_log_process("Could not start the latency reports");
+
     // Start connmgr thread
     conn_args_t conn_args;
     conn_args.max_conn = atoi(argv[2]);
@@ -37,7 +71,6 @@ int main(int argc, char *argv[]) {
 
     // Start datamgr thread
     datamgr_args_t datamgr_args;
-    datamgr_args.fp_sensor_map = fopen("room_sensor.map", "r");
     datamgr_args.buffer = buffer;
 
     pthread_t datamgr_thread;
@@ -47,10 +80,22 @@ int main(int argc, char *argv[]) {
     pthread_t db_thread;
     pthread_create(&db_thread, NULL, run_db, buffer);
 
+    // Start recent-history cache thread
+    pthread_t cache_thread;
+    pthread_create(&cache_thread, NULL, run_cache, buffer);
+
     // Join all threads
     pthread_join(connmgr_thread, NULL);
     pthread_join(datamgr_thread, NULL);
     pthread_join(db_thread, NULL);
+    pthread_join(cache_thread, NULL);
+
+    // Stop serving metrics, report the latencies since the last report
+    metrics_stop();
+    latency_stop();
+
+    // Stop watching the sensor map
+    sensor_map_stop();
 
     // Stop logger
     write_to_log_process("Stopped logger");
@@ -0,0 +1,110 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Rolls a partition store over many partitions while its maintenance thread compresses the closed
+ * segments, then reads every segment back and checks that no reading went missing.
+ * Usage: ./partition_test [partitions] [readings per partition] [pause after a commit, in us]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "sensor_partition.h"
+#include "sensor_segment.h"
+#include "sensor_db.h"
+
+#define DEFAULT_PARTITIONS 2000
+#define DEFAULT_READINGS 300
+#define DEFAULT_PAUSE_US 200
+#define COMMIT_EVERY 50
+
+// The store logs through the gateway's logger, which is not running here
+bool log_admit(log_category_t category, int level) {
+    (void)category;
+    (void)level;
+    return false;
+}
+
+int log_event_emit(log_event_t event, ...) {
+    (void)event;
+    return 0;
+}
+
+// Readings in every .seg and .segz file of 'dir'; removes the files as it goes
+static long read_back(const char *dir, int *nb_compressed) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+
+    static segment_block_t block;
+    long total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        segment_reader_t *reader = strstr(entry->d_name, ".seg") ? segment_reader_open(path) : NULL;
+        if (reader) {
+            if (strstr(entry->d_name, ".segz")) (*nb_compressed)++;
+            for (int b = 0; b < segment_reader_nb_blocks(reader); b++) {
+                if (segment_reader_read_block(reader, b, &block) == SEGMENT_SUCCESS) total += block.header.count;
+            }
+            segment_reader_close(&reader);
+        }
+        unlink(path);
+    }
+    closedir(d);
+    return total;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 4) {
+        printf("Usage: %s [partitions] [readings per partition] [pause after a commit, in us]\n", argv[0]);
+        return -1;
+    }
+    long partitions = argc > 1 ? atol(argv[1]) : DEFAULT_PARTITIONS;
+    long readings = argc > 2 ? atol(argv[2]) : DEFAULT_READINGS;
+    long pause_us = argc > 3 ? atol(argv[3]) : DEFAULT_PAUSE_US;
+
+    char dir[] = "/tmp/partition_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    partition_store_t *store = partition_open(dir);
+    if (!store) {
+        printf("Could not open %s\n", dir);
+        return -1;
+    }
+
+    long written = 0;
+    for (long p = 0; p < partitions; p++) {
+        for (long i = 0; i < readings; i++) {
+            sensor_data_t d = {.id = 1 + i % 64, .value = 20 + i * 0.01,
+                               .ts = p * PARTITION_SECONDS + i * PARTITION_SECONDS / readings, .ingest_ns = 0};
+            if (partition_append(store, &d) == PARTITION_SUCCESS) written++;
+            if ((i + 1) % COMMIT_EVERY == 0 || i == readings - 1) {
+                partition_commit(store, false);
+                struct timespec pause = {.tv_sec = pause_us / 1000000, .tv_nsec = pause_us % 1000000 * 1000};
+                if (pause_us > 0) nanosleep(&pause, NULL);
+            }
+        }
+    }
+    partition_close(&store, false);
+
+    int nb_compressed = 0;
+    long found = read_back(dir, &nb_compressed);
+    rmdir(dir);
+    printf("%ld partitions (%d segments compressed): %ld readings written, %ld read back\n", partitions,
+           nb_compressed, written, found);
+    return found == written && written == partitions * readings ? 0 : 1;
+}
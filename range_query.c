@@ -0,0 +1,78 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Prints the readings of one sensor in a time range from data.csv, using the sparse index the
+ * storage manager writes next to it (see sensor_index.h). Given storage.manifest instead, the
+ * file of the writer that owns the sensor is queried.
+ * Usage: ./range_query <data.csv|storage.manifest> <sensor id> [from ts [to ts]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "sensor_index.h"
+
+// Looks up the file of the writer that stores 'id' in a storage manifest
+static int manifest_file(const char *manifest, sensor_id_t id, char *path, size_t size) {
+    FILE *f = fopen(manifest, "r");
+    if (!f) return -1;
+
+    char line[512], format[32] = "", file[400];
+    int writers = 0, writer, result = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "format %31s", format) == 1) continue;
+        if (sscanf(line, "writers %d", &writers) == 1) continue;
+        if (writers > 0 && sscanf(line, "writer %d %399s", &writer, file) == 2 && writer == id % writers) {
+            snprintf(path, size, "%s", file);
+            result = 0;
+        }
+    }
+    fclose(f);
+
+    if (result == 0 && strcmp(format, "csv") != 0) {
+        fprintf(stderr, "[!] ERR: Only csv storage has a range index, this is %s\n", format);
+        return -1;
+    }
+    return result;
+}
+
+static void print_reading(const sensor_data_t *data, void *arg) {
+    printf("%" PRIu16 ", %f, %lld\n", data->id, data->value, (long long)data->ts);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <data.csv|storage.manifest> <sensor id> [from ts [to ts]]\n", argv[0]);
+        return -1;
+    }
+
+    sensor_id_t id = (sensor_id_t)atoi(argv[2]);
+    sensor_ts_t from = argc > 3 ? atoll(argv[3]) : INT64_MIN;
+    sensor_ts_t to = argc > 4 ? atoll(argv[4]) : INT64_MAX;
+
+    char path[400];
+    size_t len = strlen(argv[1]);
+    if (len > 9 && strcmp(argv[1] + len - 9, ".manifest") == 0) {
+        if (manifest_file(argv[1], id, path, sizeof(path)) != 0) {
+            fprintf(stderr, "[!] ERR: No file for sensor %d in %s\n", id, argv[1]);
+            return -1;
+        }
+    } else {
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    }
+
+    index_query_stats_t stats;
+    int found = index_query(path, id, from, to, print_reading, NULL, &stats);
+    if (found < 0) {
+        fprintf(stderr, "[!] ERR: Could not read %s\n", path);
+        return -1;
+    }
+
+    fprintf(stderr, "%d readings, %" PRIu64 " of %" PRIu64 " bytes read (%s, %d index entries)\n", found,
+            stats.bytes_read, stats.file_size, stats.indexed ? "indexed" : "no index, full scan", stats.entries);
+    return 0;
+}
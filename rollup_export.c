@@ -0,0 +1,53 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Prints the rollups of one sensor or room as csv: bucket start, count, min, max, mean.
+ * Records of the same bucket are merged, so the output has one line per bucket.
+ * Usage: ./rollup_export <1m|1h|1d> <sensor|room> <id> [from ts [to ts]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "sensor_rollup.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <1m|1h|1d> <sensor|room> <id> [from ts [to ts]]\n", argv[0]);
+        return -1;
+    }
+
+    int resolution = -1;
+    for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+        if (strcmp(argv[1], rollup_resolution_name(r)) == 0) resolution = r;
+    }
+    int kind = strcmp(argv[2], "sensor") == 0 ? ROLLUP_SENSOR : strcmp(argv[2], "room") == 0 ? ROLLUP_ROOM : -1;
+    if (resolution < 0 || kind < 0) {
+        fprintf(stderr, "[!] ERR: Unknown resolution or kind\n");
+        return -1;
+    }
+
+    uint16_t id = (uint16_t)atoi(argv[3]);
+    int64_t from = argc > 4 ? atoll(argv[4]) : INT64_MIN;
+    int64_t to = argc > 5 ? atoll(argv[5]) : INT64_MAX;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s.%s", ROLLUP_FILE_PREFIX, argv[1]);
+
+    rollup_record_t *records;
+    int n = rollup_query(path, kind, id, from, to, &records);
+    if (n < 0) {
+        fprintf(stderr, "[!] ERR: Could not read %s\n", path);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        printf("%lld, %u, %f, %f, %f\n", (long long)records[i].start, records[i].count,
+                records[i].min, records[i].max, records[i].mean);
+    }
+    free(records);
+    return 0;
+}
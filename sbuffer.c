@@ -3,12 +3,17 @@
  * \author Archit Choudhary
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "sbuffer.h"
+#include "sensor_metrics.h"
+#include "sensor_probes.h"
 
 /**
  * basic node for the buffer, these nodes are linked together to create the buffer
@@ -16,8 +21,7 @@
 typedef struct sbuffer_node {
     struct sbuffer_node *next;  /**< a pointer to the next node*/
     sensor_data_t data;         /**< a structure containing the data */
-    bool datamgr_read;
-    bool db_read;
+    int readers_left;           /**< consumers that still have to read this node */
 } sbuffer_node_t;
 
 /**
@@ -26,9 +30,10 @@ typedef struct sbuffer_node {
 struct sbuffer {
     sbuffer_node_t *head;       /**< a pointer to the first node in the buffer */
     sbuffer_node_t *tail;       /**< a pointer to the last node in the buffer */
+    sbuffer_node_t *cursor[SBUFFER_NB_CONSUMERS];   /**< next node each consumer reads, NULL if caught up */
+    bool done[SBUFFER_NB_CONSUMERS];                /**< consumer has read the EOS marker */
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
-    int eos;
 };
 
 int sbuffer_init(sbuffer_t **buffer) {
@@ -36,7 +41,10 @@ int sbuffer_init(sbuffer_t **buffer) {
     if (*buffer == NULL) return SBUFFER_FAILURE;
     (*buffer)->head = NULL;
     (*buffer)->tail = NULL;
-    (*buffer)->eos = 0;
+    for (int i = 0; i < SBUFFER_NB_CONSUMERS; i++) {
+        (*buffer)->cursor[i] = NULL;
+        (*buffer)->done[i] = false;
+    }
 
     pthread_mutex_init(&(*buffer)->mutex, NULL);
     pthread_cond_init(&(*buffer)->not_empty, NULL);
@@ -65,65 +73,91 @@ int sbuffer_free(sbuffer_t **buffer) {
     return SBUFFER_SUCCESS;
 }
 
-// Consumer id is used to identify which thread is calling this
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, int consumer_id) {
-    if (buffer == NULL) return SBUFFER_FAILURE;
-    if (consumer_id != 0 && consumer_id != 1) return SBUFFER_FAILURE;
+// Takes the mutex, timing the wait only when it is contended, so the common case costs nothing extra
+static void lock_buffer(sbuffer_t *buffer) {
+    if (pthread_mutex_trylock(&buffer->mutex) == 0) return;
 
-    // Lock so each thread acts in order
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     pthread_mutex_lock(&buffer->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metrics_add(METRIC_SBUFFER_LOCK_WAITS, 1);
+    metrics_add(METRIC_SBUFFER_LOCK_WAIT_NS, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+}
 
-    while (true) {
-        // If empty and not EOS, wait until not empty
-        while (buffer->head == NULL && !buffer->eos) {
-            pthread_cond_wait(&buffer->not_empty, &buffer->mutex);
-        }
+// Free nodes at the head that every consumer has read. Call with the mutex held.
+static void release_read_nodes(sbuffer_t *buffer) {
+    while (buffer->head && buffer->head->readers_left == 0) {
+        sbuffer_node_t *dummy = buffer->head;
+        buffer->head = dummy->next;
+        if (buffer->head == NULL) buffer->tail = NULL;
+        free(dummy);
+    }
+}
 
-        // If empty and EOS, exit
-        if (buffer->head == NULL && buffer->eos) {
-            pthread_mutex_unlock(&buffer->mutex);
-            return SBUFFER_NO_DATA;
-        }
+// Consumer id is used to identify which thread is calling this
+int sbuffer_remove_batch_until(sbuffer_t *buffer, sensor_data_t *data, int max, int *count, int consumer_id,
+        const struct timespec *deadline) {
+    if (buffer == NULL || data == NULL || count == NULL || max <= 0) return SBUFFER_FAILURE;
+    if (consumer_id < 0 || consumer_id >= SBUFFER_NB_CONSUMERS) return SBUFFER_FAILURE;
 
-        sbuffer_node_t *dummy = buffer->head;
-        *data = dummy->data;
+    *count = 0;
 
-        // Check if current thread has already read the HEAD
-        bool already_read =
-            (consumer_id == 0 && dummy->datamgr_read) ||
-            (consumer_id == 1 && dummy->db_read);
+    // Lock so each thread acts in order
+    lock_buffer(buffer);
 
-        if (already_read) {
+    // Wait until there is something this consumer has not read yet
+    bool waiting = buffer->cursor[consumer_id] == NULL && !buffer->done[consumer_id];
+    if (waiting) SENSOR_PROBE1(sbuffer_wait_begin, consumer_id);
+    while (buffer->cursor[consumer_id] == NULL && !buffer->done[consumer_id]) {
+        if (deadline == NULL) {
             pthread_cond_wait(&buffer->not_empty, &buffer->mutex);
-            continue;
+        } else if (pthread_cond_timedwait(&buffer->not_empty, &buffer->mutex, deadline) == ETIMEDOUT &&
+                   buffer->cursor[consumer_id] == NULL && !buffer->done[consumer_id]) {
+            pthread_mutex_unlock(&buffer->mutex);
+            SENSOR_PROBE1(sbuffer_wait_end, consumer_id);
+            return SBUFFER_TIMEOUT;
         }
-
-        // Mark read field
-        if (consumer_id == 0) {
-            dummy->datamgr_read = true;
-        } else if (consumer_id == 1) {
-            dummy->db_read = true;
+    }
+    if (waiting) SENSOR_PROBE1(sbuffer_wait_end, consumer_id);
+
+    int n = 0;
+    sbuffer_node_t *node = buffer->cursor[consumer_id];
+    while (node && n < max) {
+        // If sensor id = 0, we have reached EOS; hand out what came before it first
+        if (node->data.id == 0) {
+            if (n == 0) {
+                node->readers_left--;
+                node = node->next;
+                buffer->done[consumer_id] = true;
+            }
+            break;
         }
 
-        // Remove node if both threads have read it
-        if (dummy->datamgr_read && dummy->db_read) {
-            buffer->head = dummy->next;
-            if (buffer->head == NULL) buffer->tail = NULL;
-            free(dummy);
-        }
+        data[n++] = node->data;
+        node->readers_left--;
+        node = node->next;
+    }
+    buffer->cursor[consumer_id] = node;
 
-        pthread_cond_broadcast(&buffer->not_empty);
+    release_read_nodes(buffer);
 
-        // If sensor id = 0, we have reached EOS
-        if (data->id == 0) {
-            buffer->eos = 1;
-            pthread_mutex_unlock(&buffer->mutex);
-            return SBUFFER_NO_DATA;
-        }
+    bool eos = n == 0 && buffer->done[consumer_id];
+    pthread_mutex_unlock(&buffer->mutex);
 
-        pthread_mutex_unlock(&buffer->mutex);
-        return SBUFFER_SUCCESS;
-    }
+    *count = n;
+    metrics_add_consumed(consumer_id, n);
+    SENSOR_PROBE2(sbuffer_remove, consumer_id, n);
+    return eos ? SBUFFER_NO_DATA : SBUFFER_SUCCESS;
+}
+
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, int max, int *count, int consumer_id) {
+    return sbuffer_remove_batch_until(buffer, data, max, count, consumer_id, NULL);
+}
+
+int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, int consumer_id) {
+    int count;
+    return sbuffer_remove_batch(buffer, data, 1, &count, consumer_id);
 }
 
 
@@ -136,10 +170,9 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
 
     dummy->data = *data;
     dummy->next = NULL;
-    dummy->datamgr_read = false;
-    dummy->db_read = false;
+    dummy->readers_left = SBUFFER_NB_CONSUMERS;
 
-    pthread_mutex_lock(&buffer->mutex);
+    lock_buffer(buffer);
 
     if (buffer->tail == NULL) // buffer empty (buffer->head should also be NULL
     {
@@ -150,8 +183,15 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
         buffer->tail = buffer->tail->next;
     }
 
-    pthread_cond_signal(&buffer->not_empty);
+    // Consumers that had caught up continue with the new node
+    for (int i = 0; i < SBUFFER_NB_CONSUMERS; i++) {
+        if (buffer->cursor[i] == NULL && !buffer->done[i]) buffer->cursor[i] = dummy;
+    }
+
+    pthread_cond_broadcast(&buffer->not_empty);
     pthread_mutex_unlock(&buffer->mutex);
 
+    if (data->id != 0) metrics_add(METRIC_READINGS_RECEIVED, 1);
+    SENSOR_PROBE2(sbuffer_insert, data->id, data->ingest_ns);
     return SBUFFER_SUCCESS;
 }
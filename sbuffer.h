@@ -5,11 +5,18 @@
 #ifndef _SBUFFER_H_
 #define _SBUFFER_H_
 
+#include <time.h>
 #include "config.h"
 
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
 #define SBUFFER_NO_DATA 1
+#define SBUFFER_TIMEOUT 2
+
+// Every node is read once by each consumer: 0 = datamgr, 1 = storage manager, 2 = recent-history cache
+#ifndef SBUFFER_NB_CONSUMERS
+#define SBUFFER_NB_CONSUMERS 3
+#endif
 
 typedef struct sbuffer sbuffer_t;
 
@@ -28,14 +35,36 @@ int sbuffer_init(sbuffer_t **buffer);
 int sbuffer_free(sbuffer_t **buffer);
 
 /**
- * Removes the first sensor data in 'buffer' (at the 'head') and returns this sensor data as '*data'
- * If 'buffer' is empty, the function doesn't block until new sensor data becomes available but returns SBUFFER_NO_DATA
+ * Removes the first sensor data in 'buffer' that consumer 'consumer_id' has not read yet and returns it as '*data'
+ * Blocks until new sensor data becomes available; returns SBUFFER_NO_DATA once the consumer reaches the end-of-stream marker (sensor id 0)
  * \param buffer a pointer to the buffer that is used
  * \param data a pointer to pre-allocated sensor_data_t space, the data will be copied into this structure. No new memory is allocated for 'data' in this function.
- * \return SBUFFER_SUCCESS on success and SBUFFER_FAILURE if an error occurred
+ * \param consumer_id which consumer is reading, between 0 and SBUFFER_NB_CONSUMERS - 1
+ * \return SBUFFER_SUCCESS on success, SBUFFER_NO_DATA at end-of-stream and SBUFFER_FAILURE if an error occurred
  */
 int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data, int consumer_id);
 
+/**
+ * Like sbuffer_remove(), but copies up to 'max' unread entries in one go
+ * Blocks until at least one entry is available. Entries before the end-of-stream marker are always handed out first;
+ * the call after that returns SBUFFER_NO_DATA.
+ * \param buffer a pointer to the buffer that is used
+ * \param data a pointer to pre-allocated space for at least 'max' entries
+ * \param max the maximum number of entries to copy
+ * \param count set to the number of entries copied into 'data'
+ * \param consumer_id which consumer is reading, between 0 and SBUFFER_NB_CONSUMERS - 1
+ * \return SBUFFER_SUCCESS on success, SBUFFER_NO_DATA at end-of-stream and SBUFFER_FAILURE if an error occurred
+ */
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, int max, int *count, int consumer_id);
+
+/**
+ * Like sbuffer_remove_batch(), but gives up waiting at 'deadline'
+ * \param deadline absolute CLOCK_REALTIME time to wait until, or NULL to wait forever
+ * \return as sbuffer_remove_batch(), or SBUFFER_TIMEOUT if nothing arrived before 'deadline' ('*count' is then 0)
+ */
+int sbuffer_remove_batch_until(sbuffer_t *buffer, sensor_data_t *data, int max, int *count, int consumer_id,
+        const struct timespec *deadline);
+
 /**
  * Inserts the sensor data in 'data' at the end of 'buffer' (at the 'tail')
  * \param buffer a pointer to the buffer that is used
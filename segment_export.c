@@ -0,0 +1,56 @@
+/**
+ * \author Archit Choudhary
+ *
+ * Offline export of a data.seg segment to the data.csv format, optionally for a single sensor
+ * and/or a time range. Blocks that cannot match are skipped using the block index.
+ * Usage: ./segment_export <segment> [sensor id (0 = all) [from ts [to ts]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "sensor_segment.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <segment> [sensor id (0 = all) [from ts [to ts]]]\n", argv[0]);
+        return -1;
+    }
+
+    sensor_id_t sensor_id = argc > 2 ? (sensor_id_t)atoi(argv[2]) : 0;
+    int64_t from = argc > 3 ? atoll(argv[3]) : INT64_MIN;
+    int64_t to = argc > 4 ? atoll(argv[4]) : INT64_MAX;
+
+    segment_reader_t *reader = segment_reader_open(argv[1]);
+    if (!reader) {
+        fprintf(stderr, "[!] ERR: Could not open segment %s\n", argv[1]);
+        return -1;
+    }
+
+    segment_block_t block;
+    int skipped = 0;
+    for (int b = 0; b < segment_reader_nb_blocks(reader); b++) {
+        if (!segment_block_may_contain(segment_reader_header(reader, b), sensor_id, from, to)) {
+            skipped++;
+            continue;
+        }
+        if (segment_reader_read_block(reader, b, &block) != SEGMENT_SUCCESS) {
+            fprintf(stderr, "[!] ERR: Could not read block %d\n", b);
+            segment_reader_close(&reader);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < block.header.count; i++) {
+            if (sensor_id != 0 && block.ids[i] != sensor_id) continue;
+            if (block.ts[i] < from || block.ts[i] > to) continue;
+            printf("%" PRIu16 ", %f, %lld\n", block.ids[i], block.values[i], (long long)block.ts[i]);
+        }
+    }
+
+    fprintf(stderr, "%d of %d blocks skipped\n", skipped, segment_reader_nb_blocks(reader));
+    segment_reader_close(&reader);
+    return 0;
+}
@@ -0,0 +1,442 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "sensor_aio.h"
+
+typedef struct write_buffer {
+    char *data;
+    size_t len;         // bytes filled
+    size_t done;        // bytes already written, a write can come back short
+    off_t offset;       // file offset of data[0]
+    bool in_flight;     // handed to the kernel or the writer thread
+} write_buffer_t;
+
+// The rings shared with the kernel, mapped by uring_setup()
+typedef struct uring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+struct async_writer {
+    int fd;
+    bool uring;
+    off_t offset;                   // where the next buffer goes
+    char *memory;                   // the data of all buffers, in one allocation
+    write_buffer_t buffers[ASYNC_WRITER_BUFFERS];
+    int current;                    // buffer being filled, -1 if none
+    int free[ASYNC_WRITER_BUFFERS]; // stack of buffers that are neither filled nor in flight
+    int nb_free;
+    int in_flight;
+    int error;                      // first failed write since the last flush, as -errno
+
+    uring_t ring;
+
+    // Writer thread, used when io_uring is not. The fields above that it changes are guarded by 'mutex'.
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;            // signalled when a buffer is queued or completed
+    int queue[ASYNC_WRITER_BUFFERS];
+    int queue_head;
+    int queue_size;
+    bool stop;
+};
+
+// Puts a buffer back on the free list once its write is over. In thread mode the caller holds 'mutex'.
+static void release_buffer(async_writer_t *w, int index, int error) {
+    write_buffer_t *b = &w->buffers[index];
+    if (b->in_flight) w->in_flight--;
+    b->len = b->done = 0;
+    b->in_flight = false;
+    w->free[w->nb_free++] = index;
+    if (error && !w->error) w->error = error;
+}
+
+/* IO_URING */
+
+static int uring_setup(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+        u->cq_size = 0;
+    }
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->cq_ptr = u->sq_ptr;
+    if (u->cq_size) {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            munmap(u->sq_ptr, u->sq_size);
+            close(u->fd);
+            return -1;
+        }
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        if (u->cq_size) munmap(u->cq_ptr, u->cq_size);
+        munmap(u->sq_ptr, u->sq_size);
+        close(u->fd);
+        return -1;
+    }
+
+    char *sq = u->sq_ptr, *cq = u->cq_ptr;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(uring_t *u) {
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_size) munmap(u->cq_ptr, u->cq_size);
+    munmap(u->sq_ptr, u->sq_size);
+    close(u->fd);
+}
+
+static int uring_enter(uring_t *u, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+// Queues the unwritten part of a buffer as a write from its registered memory
+static void uring_submit(async_writer_t *w, int index) {
+    uring_t *u = &w->ring;
+    write_buffer_t *b = &w->buffers[index];
+
+    unsigned tail = *u->sq_tail;
+    unsigned slot = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = w->fd;
+    sqe->addr = (unsigned long)(b->data + b->done);
+    sqe->len = b->len - b->done;
+    sqe->off = b->offset + b->done;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    u->sq_array[slot] = slot;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(u, 1, 0, 0) < 0) {
+        // Not taken by the kernel: drop it from the ring again
+        __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+        release_buffer(w, index, -errno);
+    }
+}
+
+// Handles all completions that arrived; with 'wait' set, first waits for at least one
+static void uring_reap(async_writer_t *w, bool wait) {
+    uring_t *u = &w->ring;
+    unsigned head = *u->cq_head;
+
+    if (wait && head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (uring_enter(u, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            // The ring itself is broken; give up on everything in flight
+            int error = -errno;
+            for (int i = 0; i < ASYNC_WRITER_BUFFERS; i++) {
+                if (w->buffers[i].in_flight) release_buffer(w, i, error);
+            }
+            return;
+        }
+    }
+
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        int index = (int)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+        write_buffer_t *b = &w->buffers[index];
+        if (res == -EINTR || res == -EAGAIN) {
+            uring_submit(w, index);
+        } else if (res < 0) {
+            release_buffer(w, index, res);
+        } else if (res == 0) {
+            release_buffer(w, index, -EIO);
+        } else if ((b->done += res) < b->len) {
+            uring_submit(w, index);
+        } else {
+            release_buffer(w, index, 0);
+        }
+    }
+}
+
+/* WRITER THREAD */
+
+static void *run_writer_thread(void *arg) {
+    async_writer_t *w = arg;
+
+    pthread_mutex_lock(&w->mutex);
+    while (true) {
+        while (w->queue_size == 0 && !w->stop) pthread_cond_wait(&w->cond, &w->mutex);
+        if (w->queue_size == 0) break;
+        int index = w->queue[w->queue_head];
+        w->queue_head = (w->queue_head + 1) % ASYNC_WRITER_BUFFERS;
+        w->queue_size--;
+        pthread_mutex_unlock(&w->mutex);
+
+        write_buffer_t *b = &w->buffers[index];
+        int error = 0;
+        while (b->done < b->len) {
+            ssize_t n = pwrite(w->fd, b->data + b->done, b->len - b->done, b->offset + b->done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                error = n < 0 ? -errno : -EIO;
+                break;
+            }
+            b->done += n;
+        }
+
+        pthread_mutex_lock(&w->mutex);
+        release_buffer(w, index, error);
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/* WRITER */
+
+async_writer_t *async_writer_open(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return NULL;
+    off_t offset = lseek(fd, 0, (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+    if (offset < 0) return NULL;
+    if ((flags & O_APPEND) && fcntl(fd, F_SETFL, flags & ~O_APPEND) != 0) return NULL;
+
+    async_writer_t *w = calloc(1, sizeof(*w));
+    if (!w) return NULL;
+    w->memory = aligned_alloc(4096, (size_t)ASYNC_WRITER_BUFFERS * ASYNC_WRITER_BUFFER_SIZE);
+    if (!w->memory) {
+        free(w);
+        return NULL;
+    }
+
+    w->fd = fd;
+    w->offset = offset;
+    w->current = -1;
+    struct iovec iov[ASYNC_WRITER_BUFFERS];
+    for (int i = 0; i < ASYNC_WRITER_BUFFERS; i++) {
+        w->buffers[i].data = w->memory + (size_t)i * ASYNC_WRITER_BUFFER_SIZE;
+        w->free[w->nb_free++] = ASYNC_WRITER_BUFFERS - 1 - i;
+        iov[i].iov_base = w->buffers[i].data;
+        iov[i].iov_len = ASYNC_WRITER_BUFFER_SIZE;
+    }
+
+    // Registered buffers are pinned once here instead of on every write
+    if (ASYNC_WRITER_MODE == ASYNC_WRITER_AUTO && uring_setup(&w->ring, ASYNC_WRITER_BUFFERS) == 0) {
+        if (syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS, iov, ASYNC_WRITER_BUFFERS) == 0) {
+            w->uring = true;
+            return w;
+        }
+        uring_teardown(&w->ring);
+    }
+
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, run_writer_thread, w) != 0) {
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->cond);
+        free(w->memory);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// Returns the first error since the last flush, and forgets it if 'clear' is set
+static int get_error(async_writer_t *w, bool clear) {
+    if (!w->uring) pthread_mutex_lock(&w->mutex);
+    int error = w->error;
+    if (clear) w->error = 0;
+    if (!w->uring) pthread_mutex_unlock(&w->mutex);
+    return error;
+}
+
+// Returns a free buffer, waiting for a write to complete if there is none
+static int take_buffer(async_writer_t *w) {
+    int index;
+    if (w->uring) {
+        uring_reap(w, false);
+        while (w->nb_free == 0) uring_reap(w, true);
+        return w->free[--w->nb_free];
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    while (w->nb_free == 0) pthread_cond_wait(&w->cond, &w->mutex);
+    index = w->free[--w->nb_free];
+    pthread_mutex_unlock(&w->mutex);
+    return index;
+}
+
+// Sends the current buffer to the disk
+static void submit_current(async_writer_t *w) {
+    if (w->current < 0) return;
+    int index = w->current;
+    write_buffer_t *b = &w->buffers[index];
+    w->current = -1;
+
+    if (b->len == 0) {
+        if (!w->uring) pthread_mutex_lock(&w->mutex);
+        release_buffer(w, index, 0);
+        if (!w->uring) pthread_mutex_unlock(&w->mutex);
+        return;
+    }
+
+    b->offset = w->offset;
+    w->offset += b->len;
+
+    if (w->uring) {
+        b->in_flight = true;
+        w->in_flight++;
+        uring_submit(w, index);
+        return;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    w->queue[(w->queue_head + w->queue_size) % ASYNC_WRITER_BUFFERS] = index;
+    w->queue_size++;
+    b->in_flight = true;
+    w->in_flight++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static void wait_idle(async_writer_t *w) {
+    if (w->uring) {
+        while (w->in_flight > 0) uring_reap(w, true);
+        return;
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    while (w->in_flight > 0) pthread_cond_wait(&w->cond, &w->mutex);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int async_writer_write(async_writer_t *w, const void *data, size_t len) {
+    const char *p = data;
+
+    // Picking up completions is only a few loads from the shared ring, no system call
+    if (w->uring) uring_reap(w, false);
+
+    while (len > 0) {
+        if (w->current < 0) w->current = take_buffer(w);
+        write_buffer_t *b = &w->buffers[w->current];
+
+        size_t n = ASYNC_WRITER_BUFFER_SIZE - b->len;
+        if (n > len) n = len;
+        memcpy(b->data + b->len, p, n);
+        b->len += n;
+        p += n;
+        len -= n;
+
+        if (b->len == ASYNC_WRITER_BUFFER_SIZE) submit_current(w);
+    }
+
+    return get_error(w, false) ? ASYNC_WRITER_FAILURE : ASYNC_WRITER_SUCCESS;
+}
+
+int async_writer_flush(async_writer_t *w, bool sync) {
+    submit_current(w);
+    int result = get_error(w, true) ? ASYNC_WRITER_FAILURE : ASYNC_WRITER_SUCCESS;
+    if (sync) {
+        // Nothing is in flight after wait_idle(), so 'error' is ours to read
+        wait_idle(w);
+        if (w->error || fdatasync(w->fd) != 0) result = ASYNC_WRITER_FAILURE;
+        w->error = 0;
+    }
+    return result;
+}
+
+int async_writer_close(async_writer_t **writer, bool sync) {
+    if (writer == NULL || *writer == NULL) return ASYNC_WRITER_FAILURE;
+    async_writer_t *w = *writer;
+
+    int result = async_writer_flush(w, sync);
+    wait_idle(w);
+    if (w->error) result = ASYNC_WRITER_FAILURE;
+
+    if (w->uring) {
+        uring_teardown(&w->ring);
+    } else {
+        pthread_mutex_lock(&w->mutex);
+        w->stop = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->cond);
+    }
+
+    free(w->memory);
+    free(w);
+    *writer = NULL;
+    return result;
+}
+
+unsigned long long async_writer_completed_offset(async_writer_t *w) {
+    if (w->uring) {
+        uring_reap(w, false);
+    } else {
+        pthread_mutex_lock(&w->mutex);
+    }
+
+    // Everything before the oldest write still in flight is on file
+    off_t completed = w->offset;
+    for (int i = 0; i < ASYNC_WRITER_BUFFERS; i++) {
+        if (w->buffers[i].in_flight && w->buffers[i].offset < completed) completed = w->buffers[i].offset;
+    }
+
+    if (!w->uring) pthread_mutex_unlock(&w->mutex);
+    return completed;
+}
+
+const char *async_writer_mode(const async_writer_t *w) {
+    return w->uring ? "io_uring" : "thread";
+}
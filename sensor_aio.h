@@ -0,0 +1,77 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_AIO_H_
+#define _SENSOR_AIO_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ASYNC_WRITER_FAILURE -1
+#define ASYNC_WRITER_SUCCESS 0
+
+// How writes reach the disk
+#define ASYNC_WRITER_AUTO 0     /**< io_uring if the kernel allows it, a writer thread otherwise */
+#define ASYNC_WRITER_THREAD 1   /**< always use a writer thread */
+
+#ifndef ASYNC_WRITER_MODE
+#define ASYNC_WRITER_MODE ASYNC_WRITER_AUTO
+#endif
+
+// Buffers per writer and their size. Writes only block once all of them wait for the disk,
+// so together they are the amount of data a slow disk can fall behind by.
+#ifndef ASYNC_WRITER_BUFFERS
+#define ASYNC_WRITER_BUFFERS 16
+#endif
+
+#ifndef ASYNC_WRITER_BUFFER_SIZE
+#define ASYNC_WRITER_BUFFER_SIZE (64 * 1024)
+#endif
+
+typedef struct async_writer async_writer_t;
+
+/**
+ * Starts asynchronous appends to a file
+ * Data is copied into a pool of buffers; a full or flushed buffer is written at its own offset by
+ * io_uring (the buffers are registered with the kernel once) or, where io_uring is not available,
+ * by a writer thread with pwrite(). Completions are picked up on later calls, so the caller only
+ * waits for the disk when every buffer is in flight or when it asks for a sync.
+ * The writer starts at the current offset of 'fd' and owns the file position from then on. It does
+ * not close 'fd'. O_APPEND is cleared, since it would let concurrent writes land out of order.
+ * \return a new writer, or NULL if it could not be created
+ */
+async_writer_t *async_writer_open(int fd);
+
+/**
+ * Copies 'len' bytes into the current buffer, sending buffers to the disk as they fill up
+ * \return ASYNC_WRITER_SUCCESS, or ASYNC_WRITER_FAILURE if an earlier write failed
+ */
+int async_writer_write(async_writer_t *writer, const void *data, size_t len);
+
+/**
+ * Sends the current buffer to the disk without waiting for it
+ * With 'sync' set, waits until everything written so far is on disk (fdatasync).
+ * \return ASYNC_WRITER_SUCCESS, or ASYNC_WRITER_FAILURE if a write failed since the last flush
+ */
+int async_writer_flush(async_writer_t *writer, bool sync);
+
+/**
+ * Flushes, waits for all writes to complete and frees the writer
+ * \param writer a double pointer to the writer, set to NULL
+ */
+int async_writer_close(async_writer_t **writer, bool sync);
+
+/**
+ * Returns the file offset up to which every write has completed, picking up completions without waiting
+ * Writes can complete out of order; bytes past this offset may still be missing, with holes before
+ * them. Data still in the current buffer is not counted.
+ */
+unsigned long long async_writer_completed_offset(async_writer_t *writer);
+
+/**
+ * Returns "io_uring" or "thread", for logging
+ */
+const char *async_writer_mode(const async_writer_t *writer);
+
+#endif /* _SENSOR_AIO_H_ */
@@ -0,0 +1,228 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "sensor_cache.h"
+#include "sensor_db.h"
+#include "sbuffer.h"
+#include "sensor_metrics.h"
+#include "sensor_server.h"
+
+#define CACHE_BATCH_SIZE 256
+
+/*
+ * One ring per sensor. The cache thread is the only writer: it announces the reading it is about
+ * to overwrite in 'writing' before touching it, and publishes it in 'head' afterwards. A reader
+ * copies what it needs and then checks 'writing' to find out which of its copies may be torn.
+ */
+typedef struct cache_ring {
+    atomic_ullong head;         // readings published; reading i is entries[i % CACHE_RING_SIZE]
+    atomic_ullong writing;      // head + 1 while a reading is being written, head otherwise
+    cache_reading_t entries[CACHE_RING_SIZE];
+} cache_ring_t;
+
+static cache_ring_t *rings = NULL;
+static atomic_ushort slot_of[UINT16_MAX + 1];  // ring of every sensor + 1, 0 if it has none
+static int nb_slots = 0;
+static uint8_t not_cached[UINT16_MAX + 1];     // sensors already reported as not fitting
+
+static socket_server_t server;
+
+/* RINGS */
+
+// Called by the cache thread only
+static void cache_append(const sensor_data_t *data) {
+    unsigned slot = atomic_load_explicit(&slot_of[data->id], memory_order_relaxed);
+    if (slot == 0) {
+        if (nb_slots == CACHE_MAX_SENSORS) {
+            if (!not_cached[data->id]) {
+                not_cached[data->id] = 1;
+                log_event(LOG_CACHE_FULL, (int)data->id);
+            }
+            return;
+        }
+        // The ring is still all zeroes, so it can be published before its first reading
+        slot = ++nb_slots;
+        atomic_store_explicit(&slot_of[data->id], slot, memory_order_release);
+    }
+
+    cache_ring_t *ring = &rings[slot - 1];
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->writing, head + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    ring->entries[head % CACHE_RING_SIZE] = (cache_reading_t){.ts = data->ts, .value = data->value};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copies the readings in a ring to 'out', oldest first, and returns how many there are
+static int ring_snapshot(cache_ring_t *ring, cache_reading_t *out) {
+    while (true) {
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long long first = head > CACHE_RING_SIZE ? head - CACHE_RING_SIZE : 0;
+        for (unsigned long long i = first; i < head; i++) {
+            out[i - first] = ring->entries[i % CACHE_RING_SIZE];
+        }
+
+        // Readings before 'valid' may have been overwritten while they were copied
+        atomic_thread_fence(memory_order_acquire);
+        unsigned long long writing = atomic_load_explicit(&ring->writing, memory_order_relaxed);
+        unsigned long long valid = writing > CACHE_RING_SIZE ? writing - CACHE_RING_SIZE : 0;
+        if (valid <= first) return head - first;
+        if (valid < head) {
+            memmove(out, out + (valid - first), (head - valid) * sizeof(*out));
+            return head - valid;
+        }
+    }
+}
+
+static bool ring_latest(cache_ring_t *ring, cache_reading_t *out) {
+    while (true) {
+        unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head == 0) return false;
+        *out = ring->entries[(head - 1) % CACHE_RING_SIZE];
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&ring->writing, memory_order_relaxed) < head + CACHE_RING_SIZE) return true;
+    }
+}
+
+/* QUERY SERVER */
+
+typedef struct client {
+    int fd;
+    size_t have;                // bytes of 'request' received so far
+    cache_request_t request;
+} client_t;
+
+static int send_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int answer(int fd, const cache_request_t *request) {
+    static cache_reading_t readings[CACHE_RING_SIZE];   // server thread only
+    cache_response_t response = {.status = CACHE_STATUS_OK, .count = 0};
+    cache_reading_t *first = readings;
+
+    unsigned slot = atomic_load_explicit(&slot_of[request->sensor_id], memory_order_acquire);
+    if (request->type != CACHE_QUERY_LATEST && request->type != CACHE_QUERY_RANGE) {
+        response.status = CACHE_STATUS_BAD_REQUEST;
+    } else if (slot == 0) {
+        response.status = CACHE_STATUS_UNKNOWN_SENSOR;
+    } else if (request->type == CACHE_QUERY_LATEST) {
+        response.count = ring_latest(&rings[slot - 1], readings) ? 1 : 0;
+    } else {
+        int n = ring_snapshot(&rings[slot - 1], readings), kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (readings[i].ts >= request->from && readings[i].ts <= request->to) readings[kept++] = readings[i];
+        }
+        // With a limit, the newest readings are the interesting ones
+        if (request->max > 0 && (uint32_t)kept > request->max) {
+            first = readings + (kept - request->max);
+            kept = request->max;
+        }
+        response.count = kept;
+    }
+
+    if (send_all(fd, &response, sizeof(response)) != 0) return -1;
+    return send_all(fd, first, response.count * sizeof(*first));
+}
+
+static void *run_server(void *arg) {
+    (void)arg;
+    client_t clients[CACHE_MAX_CLIENTS];
+    struct pollfd fds[2 + CACHE_MAX_CLIENTS];
+    int nb_clients = 0;
+
+    while (true) {
+        fds[0] = (struct pollfd){.fd = server.wake_pipe[0], .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = server.listen_fd, .events = POLLIN};
+        for (int i = 0; i < nb_clients; i++) fds[2 + i] = (struct pollfd){.fd = clients[i].fd, .events = POLLIN};
+
+        if (poll(fds, 2 + nb_clients, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) break;
+
+        // Walk backwards, so removing a client only moves one that was already handled
+        for (int i = nb_clients - 1; i >= 0; i--) {
+            if (!fds[2 + i].revents) continue;
+            client_t *c = &clients[i];
+            ssize_t n = recv(c->fd, (char *)&c->request + c->have, sizeof(c->request) - c->have, 0);
+            if (n < 0 && errno == EINTR) continue;
+
+            bool keep = n > 0;
+            if (keep && (c->have += n) == sizeof(c->request)) {
+                c->have = 0;
+                keep = answer(c->fd, &c->request) == 0;
+            }
+            if (!keep) {
+                close(c->fd);
+                clients[i] = clients[--nb_clients];
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = socket_server_accept(&server);
+            if (fd >= 0 && nb_clients < CACHE_MAX_CLIENTS) {
+                clients[nb_clients++] = (client_t){.fd = fd, .have = 0};
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    for (int i = 0; i < nb_clients; i++) close(clients[i].fd);
+    return NULL;
+}
+
+/* CACHE THREAD */
+
+void *run_cache(void *arg) {
+    sbuffer_t *buffer = (sbuffer_t *)arg;
+    metrics_register("cache", 0);
+
+    // Without rings or a socket the readings are still taken, so the sbuffer can free them
+    rings = calloc(CACHE_MAX_SENSORS, sizeof(*rings));
+    bool serving = rings && socket_server_start(&server, CACHE_SOCKET_PATH, run_server) == SERVER_SUCCESS;
+
+    if (serving) {
+        log_event(LOG_CACHE_SERVING, CACHE_RING_SIZE, CACHE_SOCKET_PATH);
+    } else {
+        log_event(LOG_CACHE_FAILED, CACHE_SOCKET_PATH);
+    }
+
+    sensor_data_t batch[CACHE_BATCH_SIZE];
+    int count;
+    while (sbuffer_remove_batch(buffer, batch, CACHE_BATCH_SIZE, &count, CACHE_CONSUMER_ID) == SBUFFER_SUCCESS) {
+        if (!serving) continue;
+        for (int i = 0; i < count; i++) cache_append(&batch[i]);
+    }
+
+    socket_server_stop(&server);
+    free(rings);
+    rings = NULL;
+    metrics_unregister();
+    return NULL;
+}
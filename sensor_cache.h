@@ -0,0 +1,80 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_CACHE_H_
+#define _SENSOR_CACHE_H_
+
+#include <stdint.h>
+#include "config.h"
+
+#define CACHE_FAILURE -1
+#define CACHE_SUCCESS 0
+
+// sbuffer consumer the cache reads as
+#define CACHE_CONSUMER_ID 2
+
+// Readings kept per sensor; the oldest is overwritten when a ring is full. Must be a power of two.
+#ifndef CACHE_RING_SIZE
+#define CACHE_RING_SIZE 1024
+#endif
+
+// Sensors with a ring; readings of sensors beyond that are not cached
+#ifndef CACHE_MAX_SENSORS
+#define CACHE_MAX_SENSORS 256
+#endif
+
+#ifndef CACHE_SOCKET_PATH
+#define CACHE_SOCKET_PATH "gateway.sock"
+#endif
+
+// Connections served at the same time
+#ifndef CACHE_MAX_CLIENTS
+#define CACHE_MAX_CLIENTS 16
+#endif
+
+/*
+ * Query protocol on CACHE_SOCKET_PATH (a SOCK_STREAM Unix socket, host byte order).
+ * A client sends cache_request_t's and gets, for each, a cache_response_t followed by 'count'
+ * cache_reading_t's, oldest first. A connection can carry any number of requests.
+ */
+#define CACHE_QUERY_LATEST 1        /**< the most recent reading of a sensor */
+#define CACHE_QUERY_RANGE 2         /**< cached readings with from <= ts <= to, the newest 'max' of them (0: all) */
+
+#define CACHE_STATUS_OK 0
+#define CACHE_STATUS_UNKNOWN_SENSOR 1   /**< no reading of this sensor is cached */
+#define CACHE_STATUS_BAD_REQUEST 2
+
+typedef struct cache_request {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t sensor_id;
+    uint32_t max;
+    int64_t from;
+    int64_t to;
+} cache_request_t;
+
+typedef struct cache_response {
+    int32_t status;
+    uint32_t count;
+} cache_response_t;
+
+typedef struct cache_reading {
+    int64_t ts;
+    double value;
+} cache_reading_t;
+
+_Static_assert(sizeof(cache_request_t) == 24, "cache requests are sent as-is");
+_Static_assert((CACHE_RING_SIZE & (CACHE_RING_SIZE - 1)) == 0, "CACHE_RING_SIZE must be a power of two");
+
+/**
+ * The recent-history cache thread
+ * Reads every reading from the sbuffer as consumer CACHE_CONSUMER_ID into a fixed-size ring per
+ * sensor and serves queries on CACHE_SOCKET_PATH from a second thread. The rings have a single
+ * writer; queries copy from them without taking any lock and retry the part that was overwritten
+ * meanwhile. Returns at end-of-stream, after the socket is closed.
+ * \param arg the sbuffer
+ */
+void *run_cache(void *arg);
+
+#endif /* _SENSOR_CACHE_H_ */
@@ -0,0 +1,202 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#include <string.h>
+
+#include "sensor_codec.h"
+
+/* BIT STREAMS */
+
+void bit_writer_init(bit_writer_t *writer, uint8_t *buf, size_t capacity) {
+    writer->buf = buf;
+    writer->capacity = capacity;
+    writer->bits = 0;
+    writer->overflow = 0;
+}
+
+void bit_write(bit_writer_t *writer, uint64_t value, int nbits) {
+    if (writer->bits + nbits > writer->capacity * 8) {
+        writer->overflow = 1;
+        return;
+    }
+
+    while (nbits > 0) {
+        size_t byte = writer->bits / 8;
+        int used = writer->bits % 8;
+        int space = 8 - used;
+        int take = nbits < space ? nbits : space;
+
+        if (used == 0) writer->buf[byte] = 0;
+        uint8_t chunk = (value >> (nbits - take)) & ((1u << take) - 1);
+        writer->buf[byte] |= chunk << (space - take);
+
+        writer->bits += take;
+        nbits -= take;
+    }
+}
+
+size_t bit_writer_bytes(const bit_writer_t *writer) {
+    return (writer->bits + 7) / 8;
+}
+
+void bit_reader_init(bit_reader_t *reader, const uint8_t *buf, size_t size) {
+    reader->buf = buf;
+    reader->size = size;
+    reader->bits = 0;
+    reader->overflow = 0;
+}
+
+uint64_t bit_read(bit_reader_t *reader, int nbits) {
+    if (reader->bits + nbits > reader->size * 8) {
+        reader->overflow = 1;
+        return 0;
+    }
+
+    uint64_t value = 0;
+    while (nbits > 0) {
+        size_t byte = reader->bits / 8;
+        int used = reader->bits % 8;
+        int space = 8 - used;
+        int take = nbits < space ? nbits : space;
+
+        uint8_t chunk = (reader->buf[byte] >> (space - take)) & ((1u << take) - 1);
+        value = (value << take) | chunk;
+
+        reader->bits += take;
+        nbits -= take;
+    }
+    return value;
+}
+
+/* TIMESTAMPS: delta-of-delta */
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Control bits '0', '10', '110', '1110', '1111' select 0, 7, 9, 12 or 64 payload bits
+void ts_encode(ts_codec_t *codec, bit_writer_t *writer, int64_t ts) {
+    if (codec->count++ == 0) {
+        bit_write(writer, (uint64_t)ts, 64);
+        codec->prev_ts = ts;
+        codec->prev_delta = 0;
+        return;
+    }
+
+    int64_t delta = ts - codec->prev_ts;
+    uint64_t dod = zigzag(delta - codec->prev_delta);
+    codec->prev_ts = ts;
+    codec->prev_delta = delta;
+
+    if (dod == 0) {
+        bit_write(writer, 0x0, 1);
+    } else if (dod < (1u << 7)) {
+        bit_write(writer, 0x2, 2);
+        bit_write(writer, dod, 7);
+    } else if (dod < (1u << 9)) {
+        bit_write(writer, 0x6, 3);
+        bit_write(writer, dod, 9);
+    } else if (dod < (1u << 12)) {
+        bit_write(writer, 0xe, 4);
+        bit_write(writer, dod, 12);
+    } else {
+        bit_write(writer, 0xf, 4);
+        bit_write(writer, dod, 64);
+    }
+}
+
+int64_t ts_decode(ts_codec_t *codec, bit_reader_t *reader) {
+    if (codec->count++ == 0) {
+        codec->prev_ts = (int64_t)bit_read(reader, 64);
+        codec->prev_delta = 0;
+        return codec->prev_ts;
+    }
+
+    int ones = 0;
+    while (ones < 4 && bit_read(reader, 1)) ones++;
+
+    static const int payload_bits[] = {0, 7, 9, 12, 64};
+    uint64_t dod = ones ? bit_read(reader, payload_bits[ones]) : 0;
+
+    codec->prev_delta += unzigzag(dod);
+    codec->prev_ts += codec->prev_delta;
+    return codec->prev_ts;
+}
+
+/* VALUES: Gorilla XOR */
+
+// Control '0': same value. '10': changed bits fit the previous window. '11': new window follows
+void value_encode(value_codec_t *codec, bit_writer_t *writer, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    if (codec->count++ == 0) {
+        bit_write(writer, bits, 64);
+        codec->prev_bits = bits;
+        return;
+    }
+
+    uint64_t x = bits ^ codec->prev_bits;
+    codec->prev_bits = bits;
+    if (x == 0) {
+        bit_write(writer, 0x0, 1);
+        return;
+    }
+
+    int leading = __builtin_clzll(x);
+    int trailing = __builtin_ctzll(x);
+    if (leading > 31) leading = 31;
+
+    if (codec->prev_leading + codec->prev_trailing > 0 &&
+        leading >= codec->prev_leading && trailing >= codec->prev_trailing) {
+        bit_write(writer, 0x2, 2);
+        bit_write(writer, x >> codec->prev_trailing, 64 - codec->prev_leading - codec->prev_trailing);
+        return;
+    }
+
+    int meaningful = 64 - leading - trailing;
+    bit_write(writer, 0x3, 2);
+    bit_write(writer, leading, 5);
+    bit_write(writer, meaningful & 63, 6);
+    bit_write(writer, x >> trailing, meaningful);
+    codec->prev_leading = leading;
+    codec->prev_trailing = trailing;
+}
+
+double value_decode(value_codec_t *codec, bit_reader_t *reader) {
+    double value;
+
+    if (codec->count++ == 0) {
+        codec->prev_bits = bit_read(reader, 64);
+        memcpy(&value, &codec->prev_bits, sizeof(value));
+        return value;
+    }
+
+    if (bit_read(reader, 1)) {
+        uint64_t x;
+        if (bit_read(reader, 1) == 0) {
+            x = bit_read(reader, 64 - codec->prev_leading - codec->prev_trailing) << codec->prev_trailing;
+        } else {
+            int leading = bit_read(reader, 5);
+            int meaningful = bit_read(reader, 6);
+            if (meaningful == 0) meaningful = 64;
+            int trailing = 64 - leading - meaningful;
+            if (trailing < 0) {
+                reader->overflow = 1;
+                return 0;
+            }
+            x = bit_read(reader, meaningful) << trailing;
+            codec->prev_leading = leading;
+            codec->prev_trailing = trailing;
+        }
+        codec->prev_bits ^= x;
+    }
+
+    memcpy(&value, &codec->prev_bits, sizeof(value));
+    return value;
+}
@@ -0,0 +1,70 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_CODEC_H_
+#define _SENSOR_CODEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Time-series codecs from Facebook's Gorilla paper, used to compress closed segments.
+ * Timestamps are stored as delta-of-deltas, which is a single bit for a sensor reporting at a
+ * steady rate. Values are XORed with the previous value and only the bits that changed are kept.
+ * Both work on one series (one sensor) at a time and write to a plain bit stream.
+ */
+
+// Bit stream writer over a caller-owned buffer; bits are written most significant first
+typedef struct bit_writer {
+    uint8_t *buf;
+    size_t capacity;            /**< size of 'buf' in bytes */
+    size_t bits;                /**< bits written so far */
+    int overflow;               /**< set when a write did not fit */
+} bit_writer_t;
+
+typedef struct bit_reader {
+    const uint8_t *buf;
+    size_t size;                /**< size of 'buf' in bytes */
+    size_t bits;                /**< bits read so far */
+    int overflow;               /**< set when a read went past the end */
+} bit_reader_t;
+
+// Encoder and decoder state for one series
+typedef struct ts_codec {
+    uint64_t count;
+    int64_t prev_ts;
+    int64_t prev_delta;
+} ts_codec_t;
+
+typedef struct value_codec {
+    uint64_t count;
+    uint64_t prev_bits;
+    int prev_leading;           /**< leading and trailing zero bits of the last stored XOR */
+    int prev_trailing;
+} value_codec_t;
+
+void bit_writer_init(bit_writer_t *writer, uint8_t *buf, size_t capacity);
+void bit_write(bit_writer_t *writer, uint64_t value, int nbits);
+
+/**
+ * Returns the number of bytes used so far, the last one padded with zero bits
+ */
+size_t bit_writer_bytes(const bit_writer_t *writer);
+
+void bit_reader_init(bit_reader_t *reader, const uint8_t *buf, size_t size);
+uint64_t bit_read(bit_reader_t *reader, int nbits);
+
+/**
+ * Appends a timestamp to a series; the state must start zeroed for every new series
+ */
+void ts_encode(ts_codec_t *codec, bit_writer_t *writer, int64_t ts);
+int64_t ts_decode(ts_codec_t *codec, bit_reader_t *reader);
+
+/**
+ * Appends a value to a series; the state must start zeroed for every new series
+ */
+void value_encode(value_codec_t *codec, bit_writer_t *writer, double value);
+double value_decode(value_codec_t *codec, bit_reader_t *reader);
+
+#endif /* _SENSOR_CODEC_H_ */
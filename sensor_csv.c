@@ -0,0 +1,117 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "sensor_csv.h"
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Decimal digits of 'v' without leading zeros
+static char *format_u64(uint64_t v, char *out) {
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[v * 2], 2);
+    } else {
+        *--p = '0' + v;
+    }
+
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    return out + len;
+}
+
+// Exactly 6 digits, with leading zeros
+static char *format_6_digits(uint32_t v, char *out) {
+    memcpy(out, &digit_pairs[(v / 10000) * 2], 2);
+    memcpy(out + 2, &digit_pairs[(v / 100 % 100) * 2], 2);
+    memcpy(out + 4, &digit_pairs[(v % 100) * 2], 2);
+    return out + 6;
+}
+
+// Same output as printf("%f"). A finite double is m * 2^e with an integer m of at most 53 bits,
+// so |v| * 10^6 rounded to an integer can be computed exactly in 128 bits.
+static char *format_fixed6(double v, char *out) {
+    if (!isfinite(v) || fabs(v) >= 1e15) {
+        return out + snprintf(out, CSV_MAX_ROW_LEN, "%f", v);
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    if (bits >> 63) *out++ = '-';
+
+    int biased = (bits >> 52) & 0x7ff;
+    uint64_t m = bits & ((UINT64_C(1) << 52) - 1);
+    int e = -1074;
+    if (biased != 0) {
+        m |= UINT64_C(1) << 52;
+        e = biased - 1075;
+    }
+
+    unsigned __int128 n;
+    if (e >= 0) {
+        n = ((unsigned __int128)m << e) * 1000000;
+    } else {
+        int shift = -e;
+        unsigned __int128 num = (unsigned __int128)m * 1000000;     // below 2^73
+        if (shift > 100) {
+            n = 0;      // less than half of 10^-6
+        } else {
+            n = num >> shift;
+            unsigned __int128 rest = num - (n << shift);
+            unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+            if (rest > half || (rest == half && (n & 1))) n++;
+        }
+    }
+
+    out = format_u64((uint64_t)(n / 1000000), out);
+    *out++ = '.';
+    return format_6_digits((uint32_t)(n % 1000000), out);
+}
+
+size_t csv_encode_reading(const sensor_data_t *data, char *out) {
+    char *p = format_u64(data->id, out);
+    *p++ = ',';
+    *p++ = ' ';
+    p = format_fixed6(data->value, p);
+    *p++ = ',';
+    *p++ = ' ';
+
+    long long ts = data->ts;
+    if (ts < 0) {
+        *p++ = '-';
+        p = format_u64(-(uint64_t)ts, p);
+    } else {
+        p = format_u64(ts, p);
+    }
+    *p++ = '\n';
+    return p - out;
+}
+
+size_t csv_encode_batch(const sensor_data_t *data, int count, char *out) {
+    char *p = out;
+    for (int i = 0; i < count; i++) p += csv_encode_reading(&data[i], p);
+    return p - out;
+}
@@ -0,0 +1,34 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_CSV_H_
+#define _SENSOR_CSV_H_
+
+#include <stddef.h>
+#include "config.h"
+
+/*
+ * Formats readings as data.csv rows without going through stdio. The output is byte-identical to
+ *   fprintf(f, "%" PRIu16 ", %f, %lld\n", id, value, (long long)ts)
+ * in the C locale: values are rounded to 6 decimals exactly like printf does (round half to even
+ * on the exact binary value). NaN, infinities and values of 1e15 and more fall back to snprintf().
+ */
+
+// Longest row csv_encode_reading() can produce, including the fallback for huge values
+#define CSV_MAX_ROW_LEN 384
+
+/**
+ * Writes one row for 'data' to 'out', which must have room for CSV_MAX_ROW_LEN bytes
+ * \return the number of bytes written (no terminating '\0')
+ */
+size_t csv_encode_reading(const sensor_data_t *data, char *out);
+
+/**
+ * Writes the rows of 'count' readings back to back into 'out'
+ * \param out room for at least count * CSV_MAX_ROW_LEN bytes
+ * \return the number of bytes written
+ */
+size_t csv_encode_batch(const sensor_data_t *data, int count, char *out);
+
+#endif /* _SENSOR_CSV_H_ */
@@ -4,94 +4,381 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "config.h"
 #include "sensor_db.h"
 #include "sbuffer.h"
+#include "sensor_partition.h"
+#include "sensor_sqlite.h"
+#include "sensor_csv.h"
+#include "sensor_aio.h"
+#include "sensor_rollup.h"
+#include "sensor_index.h"
+#include "sensor_map.h"
+#include "sensor_logring.h"
+#include "sensor_log.h"
+#include "sensor_logrotate.h"
+#include "sensor_metrics.h"
+#include "sensor_latency.h"
+#include "sensor_probes.h"
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 /* LOGGER CODE */
 static int pipe_fd[2] = {-1, -1};
+static log_ring_t *log_ring = NULL;
 static pid_t logger_pid = -1;
-static int seq_num = 0;
+
+// Records are passed on whole: a write() of up to PIPE_BUF bytes is never interleaved with others
+_Static_assert(LOG_RECORD_MAX <= LOG_RING_MAX_MESSAGE && LOG_RECORD_MAX <= PIPE_BUF, "a log record must fit the transport");
+
+// Where the logger child writes to
+typedef struct log_output {
+    async_writer_t *writer;
+    int fd;
+    log_rotator_t *rotator;     // NULL if the log is not rotated
+    long long bytes;            // written to the current file
+    int64_t opened;             // when the current file was opened, in ms
+    int64_t wall_offset_ns;
+    log_time_cache_t time_cache;
+    unsigned seq;
+    int64_t pending_since;      // when the oldest line not sent to the disk yet was added, 0 if none
+} log_output_t;
+
+// Opens a new log file, starting it with the file header in a binary log
+static int log_open(log_output_t *out, int flags) {
+    out->fd = open(LOG_FILE, O_WRONLY | O_CREAT | flags, 0644);
+    if (out->fd == -1) return -1;
+    out->writer = async_writer_open(out->fd);
+    if (!out->writer) {
+        close(out->fd);
+        return -1;
+    }
+    out->bytes = 0;
+    out->opened = monotonic_ms();
+
+    if (LOG_FILE_FORMAT == LOG_FILE_BINARY) {
+        log_file_header_t header = {.wall_offset_ns = out->wall_offset_ns};
+        memcpy(header.magic, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC));
+        async_writer_write(out->writer, &header, sizeof(header));
+        out->bytes = sizeof(header);
+    }
+    return 0;
+}
+
+static void log_record(log_output_t *out, const void *record, size_t len);
+
+// Moves the log aside and carries on in a new file. The old writer is closed by the rotator's thread,
+// so the logger never waits for its last writes, nor for the compression.
+static void log_rotate(log_output_t *out) {
+    async_writer_t *writer = out->writer;
+    int fd = out->fd;
+    char rotated[300];
+
+    // Whatever fails, the log stays where it is, and the next attempt waits for another full file
+    out->bytes = 0;
+    out->opened = monotonic_ms();
+    if (log_rotator_rotate(out->rotator, rotated, sizeof(rotated)) != LOG_ROTATE_SUCCESS) return;
+    if (log_open(out, O_TRUNC) != 0) {
+        rename(rotated, LOG_FILE);
+        out->writer = writer;
+        out->fd = fd;
+        return;
+    }
+    if (log_rotator_retire(out->rotator, writer, fd) != LOG_ROTATE_SUCCESS) {
+        async_writer_close(&writer, false);
+        close(fd);
+    }
+
+    char record[LOG_RECORD_MAX];
+    int len = log_record_encode(record, sizeof(record), LOG_ROTATED, rotated);
+    log_record(out, record, len);
+}
+
+// Appends one record to the log: as a line "<seq> - <time> - <message>", or as it is in a binary log.
+// It lands in the writer's buffers; log_flush() sends them to the disk. The log is rotated between
+// records, once it reaches LOG_ROTATE_BYTES.
+static void log_record(log_output_t *out, const void *record, size_t len) {
+    if (out->pending_since == 0) out->pending_since = monotonic_ms();
+    if (LOG_FILE_FORMAT == LOG_FILE_BINARY) {
+        async_writer_write(out->writer, record, len);
+        out->bytes += len;
+    } else {
+        char line[LOG_RECORD_MAX + 128];
+        int n = log_line_format(out->seq, out->wall_offset_ns, &out->time_cache, record, line, sizeof(line));
+        if (n > 0) {
+            async_writer_write(out->writer, line, n);
+            out->bytes += n;
+            out->seq++;
+        }
+    }
+
+    if (LOG_ROTATE_BYTES > 0 && out->rotator && out->bytes >= LOG_ROTATE_BYTES) log_rotate(out);
+}
+
+// Sends the buffered lines to the disk once the oldest has waited LOG_FLUSH_DELAY_MS. Full buffers
+// go out on their own. Returns how long the logger may wait for more, -1 if nothing is pending.
+static int log_flush(log_output_t *out) {
+    if (out->pending_since == 0) return -1;
+    int64_t waited = monotonic_ms() - out->pending_since;
+    if (waited < LOG_FLUSH_DELAY_MS) return LOG_FLUSH_DELAY_MS - waited;
+
+    async_writer_flush(out->writer, false);
+    out->pending_since = 0;
+
+    // The age of the log is only looked at here, once per flush rather than once per record
+    if (LOG_ROTATE_SECONDS > 0 && out->rotator && monotonic_ms() - out->opened >= LOG_ROTATE_SECONDS * 1000LL) {
+        log_rotate(out);
+    }
+    return -1;
+}
+
+// Logger child: logs every record arriving on the pipe until it is closed
+static void drain_pipe(log_output_t *out) {
+    char in[64 * 1024];
+    size_t have = 0;
+    ssize_t n;
+    int timeout = -1;
+    // Main loop: log every complete record of what arrived, in as few reads and writes as possible
+    while (true) {
+        struct pollfd pfd = {.fd = pipe_fd[0], .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == 0) {
+            timeout = log_flush(out);
+            continue;
+        }
+        n = ready < 0 ? -1 : read(pipe_fd[0], in + have, sizeof(in) - have);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        have += n;
+
+        size_t start = 0, skipped = 0;
+        int size;
+        while ((size = log_record_size(in + start, have - start)) != 0) {
+            // A damaged record: move a byte at a time until something looks like a record header again
+            if (size < 0) {
+                start++;
+                skipped++;
+                continue;
+            }
+            log_record(out, in + start, size);
+            start += size;
+        }
+        if (skipped > 0) {
+            char record[LOG_RECORD_MAX];
+            int len = log_record_encode(record, sizeof(record), LOG_PIPE_DAMAGED, (long long)skipped);
+            log_record(out, record, len);
+        }
+        have -= start;
+        memmove(in, in + start, have);
+        timeout = log_flush(out);
+    }
+}
+
+static void log_ring_record(const char *msg, size_t len, void *arg) {
+    if (log_record_size(msg, len) == (int)len) log_record((log_output_t *)arg, msg, len);
+}
+
+// Logger child: logs the records in the shared ring, a batch at a time, until it is closed
+static void drain_ring(log_output_t *out) {
+    uint64_t dropped = 0;
+    int timeout = -1;
+    while (log_ring_read(log_ring, log_ring_record, out, timeout) != LOG_RING_FAILURE) {
+        uint64_t now_dropped = log_ring_dropped(log_ring);
+        if (now_dropped != dropped) {
+            char record[LOG_RECORD_MAX];
+            int len = log_record_encode(record, sizeof(record), LOG_MESSAGES_DROPPED, (long long)(now_dropped - dropped));
+            log_record(out, record, len);
+            dropped = now_dropped;
+        }
+        timeout = log_flush(out);
+    }
+}
 
 static int create_log_process() {
-    if (pipe(pipe_fd) == -1) {
+    // Mapped before the fork, so parent and child share it
+    if (LOG_TRANSPORT == LOG_TRANSPORT_RING) log_ring = log_ring_create();
+    if (!log_ring && pipe(pipe_fd) == -1) {
         fprintf(stderr, "[!] ERR: Could not create pipe");
         return 1;
     }
+    // Should the logger die, writes to the pipe fail with EPIPE instead of killing the gateway
+    if (!log_ring) signal(SIGPIPE, SIG_IGN);
 
     logger_pid = fork();
     if (logger_pid == -1) {
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        pipe_fd[0] = pipe_fd[1] = -1; // Safekeeping
+        if (log_ring) {
+            log_ring_free(&log_ring);
+        } else {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+            pipe_fd[0] = pipe_fd[1] = -1; // Safekeeping
+        }
         fprintf(stderr, "[!] ERR: Could not create child");
         return 1;
     }
 
     if (logger_pid == 0) {
-        close(pipe_fd[1]);
+        if (!log_ring) close(pipe_fd[1]);
 
-        FILE *in = fdopen(pipe_fd[0], "r");
-        if (!in) {
-            fprintf(stderr, "[!] ERR: Could not read fd");
-            _exit(1);
-        }
-
-        FILE *log_file = fopen("gateway.log", "w");
-        if (!log_file) {
+        // Opened in the child: io_uring rings and writer threads do not survive a fork
+        log_output_t out = {.writer = NULL, .rotator = NULL, .wall_offset_ns = log_wall_offset_ns(), .seq = 0,
+                            .pending_since = 0};
+        out.time_cache.second = -1;
+        if (log_open(&out, O_TRUNC) != 0) {
             fprintf(stderr, "[!] ERR: Could not open log file");
-            fclose(in);
+            if (!log_ring) close(pipe_fd[0]);
             _exit(1);
         }
+        // Without its thread the log simply grows
+        if (LOG_ROTATE_BYTES > 0 || LOG_ROTATE_SECONDS > 0) out.rotator = log_rotator_start(LOG_FILE);
 
-        char line[512];
-        // Main loop
-        while (fgets(line, sizeof(line), in)) {
-            // Can also add seqnum/timestamp in next function
-            time_t timestamp = time(0);
-            char *time_str = ctime(&timestamp);
-
-            // Formatting; trimming \n
-            time_str[strcspn(time_str, "\n")] = '\0';
-            line[strcspn(line, "\n")] = '\0';
-
-            fprintf(log_file, "%d - %s - %s\n", seq_num, time_str, line);
-            seq_num++;
-
-            fflush(log_file);
+        if (log_ring) {
+            drain_ring(&out);
+        } else {
+            drain_pipe(&out);
+            close(pipe_fd[0]);
         }
 
-        fclose(log_file);
-        fclose(in);
+        async_writer_close(&out.writer, false);
+        close(out.fd);
+        log_rotator_stop(&out.rotator);
 
         _exit(0);
-    } else if (logger_pid > 0) {
+    } else if (logger_pid > 0 && !log_ring) {
         close(pipe_fd[0]);
     }
 
     return 0;
 }
 
-int write_to_log_process(char* msg) {
-    if (pipe_fd[1] == -1) {
+int log_event_emit(log_event_t event, ...) {
+    if (!log_ring && pipe_fd[1] == -1) {
         return -1;
     }
 
-    int len = strlen(msg);
-    if (len != 0 || msg[len - 1] != '\n') {
-        dprintf(pipe_fd[1], "%s\n", msg);
+    char record[LOG_RECORD_MAX];
+    va_list args;
+    va_start(args, event);
+    int len = log_record_vencode(record, sizeof(record), event, args);
+    va_end(args);
+
+    if (log_ring) return log_ring_write(log_ring, record, len) == LOG_RING_SUCCESS ? 0 : -1;
+    return write(pipe_fd[1], record, len) == len ? 0 : -1;
+}
+
+// Level, rate limit and suppressed events of a log category
+typedef struct log_category_state {
+    _Alignas(64) atomic_int level;
+    atomic_int rate;                // events per second let through, 0 for all
+    atomic_llong window;            // second 'count' is for
+    atomic_int count;
+    atomic_ullong filtered;         // suppressed since the last report, by level
+    atomic_ullong sampled;          // and by rate limit
+    atomic_llong reported;          // time of the last report
+} log_category_state_t;
+
+#define LOG_CATEGORY_STATE(name, text, default_rate) {.level = LOG_DEFAULT_LEVEL, .rate = default_rate},
+static log_category_state_t log_categories[LOG_CATEGORY_COUNT] = {LOG_CATEGORIES(LOG_CATEGORY_STATE)};
+#undef LOG_CATEGORY_STATE
+
+// Logs the suppressed counts of a category, if there are any and the last report is old enough
+static void report_suppressed(log_category_t category, time_t now, bool force) {
+    log_category_state_t *c = &log_categories[category];
+    long long last = atomic_load_explicit(&c->reported, memory_order_relaxed);
+    if (!force && now - last < LOG_SUPPRESSED_REPORT_SECONDS) return;
+    // One thread reports
+    if (!atomic_compare_exchange_strong(&c->reported, &last, now)) return;
+
+    unsigned long long filtered = atomic_exchange(&c->filtered, 0);
+    unsigned long long sampled = atomic_exchange(&c->sampled, 0);
+    if (filtered > 0 || sampled > 0) {
+        log_event_emit(LOG_SUPPRESSED, log_category_name(category), (long long)(now - last), (long long)filtered,
+                       (long long)sampled);
+    }
+}
+
+bool log_admit(log_category_t category, int level) {
+    log_category_state_t *c = &log_categories[category];
+    bool admit = level >= atomic_load_explicit(&c->level, memory_order_relaxed);
+    int rate = atomic_load_explicit(&c->rate, memory_order_relaxed);
+    // Common case: no clock, no shared writes
+    if (admit && rate == 0) return true;
+
+    time_t now = time(NULL);
+    if (!admit) {
+        atomic_fetch_add_explicit(&c->filtered, 1, memory_order_relaxed);
     } else {
-        dprintf(pipe_fd[1], "%s", msg);
+        // Fixed one-second windows: the first 'rate' events of every second get through
+        long long window = atomic_load_explicit(&c->window, memory_order_relaxed);
+        if (window != now && atomic_compare_exchange_strong(&c->window, &window, now)) {
+            atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+        }
+        if (atomic_fetch_add_explicit(&c->count, 1, memory_order_relaxed) >= rate) {
+            atomic_fetch_add_explicit(&c->sampled, 1, memory_order_relaxed);
+            admit = false;
+        }
     }
+    report_suppressed(category, now, false);
+    return admit;
+}
 
-    return 0;
+void log_set_category(log_category_t category, int level, int rate) {
+    if (category >= LOG_CATEGORY_COUNT) return;
+    atomic_store(&log_categories[category].level, level);
+    atomic_store(&log_categories[category].rate, rate);
+}
+
+int log_configure(const char *spec) {
+    int result = 0;
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len), *slash = memchr(spec, '/', len);
+        const char *level_end = slash ? slash : spec + len;
+
+        int category = eq ? log_category_by_name(spec, eq - spec) : -1;
+        int level = eq ? log_level_by_name(eq + 1, level_end - eq - 1) : -1;
+        if (category < 0 || level < 0) {
+            result = -1;
+        } else {
+            int rate = slash ? atoi(slash + 1) : atomic_load(&log_categories[category].rate);
+            log_set_category(category, level, rate < 0 ? 0 : rate);
+        }
+
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+    return result;
+}
+
+int write_to_log_process(char* msg) {
+    if (LOG_MESSAGE_LEVEL < LOG_MIN_LEVEL || !log_admit((log_category_t)LOG_MESSAGE_CATEGORY, LOG_MESSAGE_LEVEL)) return 0;
+    return log_event_emit(LOG_MESSAGE, msg);
+}
+
+unsigned long long log_dropped_messages() {
+    return log_ring ? log_ring_dropped(log_ring) : 0;
 }
 
 static int end_log_process() {
+    if (log_ring) log_ring_close(log_ring);
     if (pipe_fd[1] != -1) {
         close(pipe_fd[1]);
         pipe_fd[1] = -1;
@@ -101,6 +388,7 @@ static int end_log_process() {
         waitpid(logger_pid, NULL, 0);
         logger_pid = -1;
     }
+    log_ring_free(&log_ring);
 
     return 0;
 }
@@ -109,6 +397,10 @@ bool logger_active = false;
 
 void start_logger() {
     if (!logger_active) {
+        const char *spec = getenv("GATEWAY_LOG");
+        if (spec && log_configure(spec) != 0) fprintf(stderr, "[!] ERR: Could not understand all of GATEWAY_LOG\n");
+        for (int i = 0; i < LOG_CATEGORY_COUNT; i++) atomic_store(&log_categories[i].reported, time(NULL));
+
         if (create_log_process() == 0) {
             logger_active = true;
         } else {
@@ -120,6 +412,8 @@ void start_logger() {
 
 void stop_logger() {
     if (logger_active) {
+        // Whatever was suppressed since the last report
+        for (int i = 0; i < LOG_CATEGORY_COUNT; i++) report_suppressed(i, time(NULL), true);
         end_log_process();
         logger_active = false;
     }
@@ -128,57 +422,478 @@ void stop_logger() {
 
 /* STORAGE MANAGER CODE */
 
-void *run_db(void *arg) {
-    sbuffer_t *buffer = (sbuffer_t *)arg;
-    FILE * fp_csv = open_db("data.csv", false);
-    if (!fp_csv) return NULL;
+// Group number each sensor was last counted in, to count distinct sensors per group.
+// Shared by all writers: a sensor only ever reaches the one writer that owns it.
+static unsigned sensor_group[UINT16_MAX + 1];
+
+// A writer thread and the storage it owns. The storage manager hands it groups through 'queue'.
+typedef struct db_writer {
+    int id;
+    char location[256];
+    void *storage;
+    unsigned group_no;
+    int64_t last_sync;
+    bool unsynced;                          // groups were committed since the last sync
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;                    // signalled when a group is queued or taken
+    sensor_data_t (*queue)[DB_GROUP_SIZE];  // DB_WRITER_QUEUE groups
+    int counts[DB_WRITER_QUEUE];
+    int head;
+    int size;
+    bool done;
+} db_writer_t;
+
+static const storage_backend_t *backend = NULL;
+
+// Collect one group from the sbuffer: block for the first readings (until 'idle_deadline', if not NULL),
+// then keep taking whatever arrives until the group is full or its first reading has waited DB_GROUP_DELAY_MS.
+// Returns the number of readings, 0 if none came before 'idle_deadline'; sets '*eos' once the end-of-stream
+// marker was reached.
+static int collect_group(sbuffer_t *buffer, sensor_data_t *group, bool *eos, const struct timespec *idle_deadline) {
+    int n = 0, count;
+
+    int result = sbuffer_remove_batch_until(buffer, group, DB_GROUP_SIZE, &count, 1, idle_deadline);
+    if (result != SBUFFER_SUCCESS) {
+        if (result != SBUFFER_TIMEOUT) *eos = true;
+        return 0;
+    }
+    n = count;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)DB_GROUP_DELAY_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    while (n < DB_GROUP_SIZE) {
+        result = sbuffer_remove_batch_until(buffer, group + n, DB_GROUP_SIZE - n, &count, 1, &deadline);
+        if (result == SBUFFER_SUCCESS) {
+            n += count;
+        } else {
+            if (result != SBUFFER_TIMEOUT) *eos = true;
+            break;
+        }
+    }
+    return n;
+}
 
-    write_to_log_process("A new data.csv file has been created.");
+/* STORAGE BACKENDS */
+
+// Rows of a group are encoded into 'buf' (see sensor_csv.h) and handed to an asynchronous
+// writer (see sensor_aio.h), so a slow disk does not hold up the storage manager
+typedef struct csv_storage {
+    int fd;
+    async_writer_t *out;
+    index_writer_t *index;      // NULL if DB_INDEX is off or the index could not be created
+    uint64_t offset;            // file offset of buf[0]
+    char location[256];
+    size_t len;
+    char buf[DB_GROUP_SIZE * CSV_MAX_ROW_LEN];
+} csv_storage_t;
+
+static void *csv_open(const char *location) {
+    csv_storage_t *csv = malloc(sizeof(*csv));
+    if (!csv) return NULL;
+
+    csv->fd = open(location, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (csv->fd == -1) {
+        fprintf(stderr, "[!] ERR: Could not open db\n");
+        free(csv);
+        return NULL;
+    }
+    csv->out = async_writer_open(csv->fd);
+    if (!csv->out) {
+        close(csv->fd);
+        free(csv);
+        return NULL;
+    }
+    csv->len = 0;
+    csv->offset = 0;
+    snprintf(csv->location, sizeof(csv->location), "%s", location);
+
+    log_event(LOG_DB_CREATED, location);
+
+    csv->index = NULL;
+    if (DB_INDEX) {
+        char index_path[300];
+        snprintf(index_path, sizeof(index_path), "%s.idx", location);
+        csv->index = index_open(index_path);
+        if (!csv->index) log_event(LOG_DB_NO_INDEX, index_path, location);
+    }
+    if (strcmp(async_writer_mode(csv->out), "io_uring") != 0) log_event(LOG_DB_NO_IO_URING, location);
+    return csv;
+}
 
-    sensor_data_t sd;
+static int csv_flush(csv_storage_t *csv) {
+    int result = async_writer_write(csv->out, csv->buf, csv->len);
+    csv->offset += csv->len;
+    csv->len = 0;
+    return result == ASYNC_WRITER_SUCCESS ? 0 : -1;
+}
 
-    while (true) {
-        if (sbuffer_remove(buffer, &sd, 1) != SBUFFER_NO_DATA) {
-            insert_sensor(fp_csv, sd.id, sd.value, sd.ts);
+static int csv_write_batch(void *storage, const sensor_data_t *data, int count) {
+    csv_storage_t *csv = storage;
+    while (count > 0) {
+        int room = (sizeof(csv->buf) - csv->len) / CSV_MAX_ROW_LEN;
+        if (room == 0) {
+            if (csv_flush(csv) != 0) return -1;
+            continue;
+        }
+        int n = count < room ? count : room;
+        if (csv->index) {
+            // Row by row, to know where each one goes
+            for (int i = 0; i < n; i++) {
+                size_t len = csv_encode_reading(&data[i], csv->buf + csv->len);
+                index_add(csv->index, data[i].id, data[i].ts, csv->offset + csv->len, len);
+                csv->len += len;
+            }
         } else {
-            break;
+            csv->len += csv_encode_batch(data, n, csv->buf + csv->len);
         }
+        data += n;
+        count -= n;
     }
+    return 0;
+}
 
-    close_db(fp_csv);
-    return NULL;
+static int csv_commit(void *storage, bool sync) {
+    csv_storage_t *csv = storage;
+    int result = csv_flush(csv);
+    if (async_writer_flush(csv->out, sync) != ASYNC_WRITER_SUCCESS) result = -1;
+    // The index only points at rows the writer has finished, so readers never land in a hole
+    if (csv->index && index_commit(csv->index, async_writer_completed_offset(csv->out), sync) != INDEX_SUCCESS) {
+        result = -1;
+    }
+    return result;
 }
 
-FILE *open_db(char *filename, bool append) {
-    FILE *f = fopen(filename, append ? "a" : "w");
+static int csv_close(void *storage, bool sync) {
+    csv_storage_t *csv = storage;
+    int result = csv_flush(csv);
+    if (async_writer_close(&csv->out, sync) != ASYNC_WRITER_SUCCESS) result = -1;
+    if (csv->index && index_close(&csv->index, sync) != INDEX_SUCCESS) result = -1;
 
-    if (!f) {
-        fprintf(stderr, "[!] ERR: Could not open db");
-        return NULL;
+    log_event(LOG_DB_CLOSED, csv->location);
+    close(csv->fd);
+    free(csv);
+    return result;
+}
+
+const storage_backend_t csv_backend = {
+    .name = "csv",
+    .location = "data.csv",
+    .open = csv_open,
+    .write_batch = csv_write_batch,
+    .commit = csv_commit,
+    .close = csv_close,
+};
+
+static void *segment_store_open(const char *location) {
+    partition_store_t *store = partition_open(location);
+    if (!store) fprintf(stderr, "[!] ERR: Could not open segment directory");
+    return store;
+}
+
+static int segment_store_write_batch(void *storage, const sensor_data_t *data, int count) {
+    for (int i = 0; i < count; i++) {
+        if (partition_append(storage, &data[i]) != PARTITION_SUCCESS) return -1;
     }
+    return 0;
+}
 
-    return f;
+static int segment_store_commit(void *storage, bool sync) {
+    return partition_commit(storage, sync);
 }
 
-int insert_sensor(FILE *f, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
-    fprintf(f, "%" PRIu16 ", %f, %lld\n", id, value, (long long) ts);
-    fflush(f);
+static int segment_store_close(void *storage, bool sync) {
+    // Closing writes the block index of the last segment, which readers use to skip blocks
+    partition_store_t *store = storage;
+    return partition_close(&store, sync);
+}
 
-    char log_msg[128];
-    snprintf(log_msg, sizeof(log_msg),
-            "Data insertion from sensor %u succeeded", id);
-    write_to_log_process(log_msg);
+const storage_backend_t segment_backend = {
+    .name = "segment",
+    .location = DB_SEGMENT_DIR,
+    .open = segment_store_open,
+    .write_batch = segment_store_write_batch,
+    .commit = segment_store_commit,
+    .close = segment_store_close,
+};
+
+const storage_backend_t *storage_backend(int format) {
+    switch (format) {
+    case DB_FORMAT_CSV: return &csv_backend;
+    case DB_FORMAT_SEGMENT: return &segment_backend;
+    case DB_FORMAT_SQLITE: return &sqlite_backend;
+    default: return NULL;
+    }
+}
 
-    return 0;
+/* WRITERS */
+
+// Writes and commits one group of readings, all owned by writer 'w'
+static void write_group(db_writer_t *w, const sensor_data_t *group, int n) {
+    int sensors = 0;
+    w->group_no++;
+    for (int i = 0; i < n; i++) {
+        if (sensor_group[group[i].id] != w->group_no) {
+            sensor_group[group[i].id] = w->group_no;
+            sensors++;
+        }
+    }
+
+    bool sync = DB_SYNC_POLICY == DB_SYNC_GROUP;
+    if (DB_SYNC_POLICY == DB_SYNC_INTERVAL && monotonic_ms() - w->last_sync >= DB_SYNC_INTERVAL_MS) {
+        sync = true;
+    }
+    if (sync) w->last_sync = monotonic_ms();
+    w->unsynced = !sync;
+
+    int result = w->storage ? backend->write_batch(w->storage, group, n) : -1;
+    if (w->storage && backend->commit(w->storage, sync) != 0) result = -1;
+    SENSOR_PROBE4(batch_written, w->id, n, result, group[0].ingest_ns);
+    metrics_add(METRIC_STORAGE_BATCHES, 1);
+    if (result == 0) {
+        metrics_add(METRIC_STORAGE_READINGS, n);
+        int64_t now = latency_now_ns();
+        latency_record(LATENCY_COMMITTED, group, n, now);
+        if (sync) latency_record(LATENCY_DURABLE, group, n, now);
+    }
+
+    if (result != 0) {
+        metrics_add(METRIC_STORAGE_FAILURES, 1);
+        log_event(LOG_DB_INSERT_FAILED, n, sensors, w->location);
+    } else if (DB_WRITERS == 1) {
+        log_event(LOG_DB_INSERTED, n, sensors);
+    } else {
+        log_event(LOG_DB_INSERTED_INTO, n, sensors, w->location);
+    }
+}
+
+// With DB_SYNC_INTERVAL, when the groups 'w' committed without a sync must reach the disk (CLOCK_REALTIME,
+// to wait on); false if nothing is owed. Only a later group would sync them otherwise, and traffic may stop.
+static bool sync_deadline(const db_writer_t *w, struct timespec *deadline) {
+    if (DB_SYNC_POLICY != DB_SYNC_INTERVAL || !w->unsynced) return false;
+
+    int64_t wait_ms = w->last_sync + DB_SYNC_INTERVAL_MS - monotonic_ms();
+    if (wait_ms < 0) wait_ms = 0;
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += wait_ms % 1000 * 1000000;
+    deadline->tv_sec += wait_ms / 1000 + deadline->tv_nsec / 1000000000;
+    deadline->tv_nsec %= 1000000000;
+    return true;
+}
+
+// Syncs the groups a writer committed without a sync, once it has sat idle until their deadline
+static void sync_idle(db_writer_t *w) {
+    w->last_sync = monotonic_ms();
+    w->unsynced = false;
+    if (w->storage && backend->commit(w->storage, true) != 0) log_event(LOG_DB_SYNC_FAILED, w->location);
+}
+
+static void *run_writer(void *arg) {
+    db_writer_t *w = arg;
+    metrics_register("writer", w->id);
+    latency_register();
+
+    pthread_mutex_lock(&w->mutex);
+    while (true) {
+        struct timespec deadline;
+        while (w->size == 0 && !w->done) {
+            if (!sync_deadline(w, &deadline)) {
+                pthread_cond_wait(&w->cond, &w->mutex);
+            } else if (pthread_cond_timedwait(&w->cond, &w->mutex, &deadline) == ETIMEDOUT) {
+                pthread_mutex_unlock(&w->mutex);
+                sync_idle(w);
+                pthread_mutex_lock(&w->mutex);
+            }
+        }
+        if (w->size == 0) break;
+        int slot = w->head;
+        pthread_mutex_unlock(&w->mutex);
+
+        // The slot stays queued while it is written, so the storage manager cannot reuse it
+        write_group(w, w->queue[slot], w->counts[slot]);
+
+        pthread_mutex_lock(&w->mutex);
+        w->head = (w->head + 1) % DB_WRITER_QUEUE;
+        w->size--;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    metrics_unregister();
+    latency_unregister();
+    return NULL;
 }
 
-int close_db(FILE *f) {
-    if (!f) {
-        fprintf(stderr, "[!] ERR: Tried to close NULL file");
+// Queues a copy of 'count' readings for writer 'w'; blocks while its queue is full
+static void writer_enqueue(db_writer_t *w, const sensor_data_t *data, int count) {
+    pthread_mutex_lock(&w->mutex);
+    while (w->size == DB_WRITER_QUEUE) pthread_cond_wait(&w->cond, &w->mutex);
+    int slot = (w->head + w->size) % DB_WRITER_QUEUE;
+    pthread_mutex_unlock(&w->mutex);
+
+    memcpy(w->queue[slot], data, count * sizeof(*data));
+    w->counts[slot] = count;
+
+    pthread_mutex_lock(&w->mutex);
+    w->size++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+// Splits a group by owning writer and queues each part
+static void dispatch_group(db_writer_t *writers, const sensor_data_t *group, int n) {
+    static sensor_data_t parts[DB_WRITERS][DB_GROUP_SIZE];
+    int counts[DB_WRITERS] = {0};
+
+    for (int i = 0; i < n; i++) {
+        int w = group[i].id % DB_WRITERS;
+        parts[w][counts[w]++] = group[i];
+    }
+    for (int w = 0; w < DB_WRITERS; w++) {
+        if (counts[w] > 0) writer_enqueue(&writers[w], parts[w], counts[w]);
+    }
+}
+
+// Location of writer 'id': 'data.csv' -> 'data.<id>.csv', 'segments' -> 'segments.<id>'
+static void writer_location(const char *base, int id, char *out, size_t size) {
+    const char *name = strrchr(base, '/');
+    name = name ? name + 1 : base;
+    const char *ext = strrchr(name, '.');
+
+    if (DB_WRITERS == 1) {
+        snprintf(out, size, "%s", base);
+    } else if (ext && ext != name) {
+        snprintf(out, size, "%.*s.%d%s", (int)(ext - base), base, id, ext);
+    } else {
+        snprintf(out, size, "%s.%d", base, id);
     }
+}
 
-    write_to_log_process("The data.csv file has been closed");
+// Describes the partitioning for readers of the stored data; written next to a temporary name
+// and renamed, so a reader never sees half a manifest
+static int write_manifest(const db_writer_t *writers) {
+    char tmp[] = DB_MANIFEST_FILE ".tmp";
+    FILE *f = fopen(tmp, "w");
+    if (!f) return -1;
+
+    fprintf(f, "# Storage manifest of the sensor gateway\n");
+    fprintf(f, "format %s\n", backend->name);
+    fprintf(f, "writers %d\n", DB_WRITERS);
+    fprintf(f, "partition sensor_id %% %d\n", DB_WRITERS);
+    for (int i = 0; i < DB_WRITERS; i++) {
+        fprintf(f, "writer %d %s\n", writers[i].id, writers[i].location);
+    }
 
-    fclose(f);
+    if (fclose(f) != 0 || rename(tmp, DB_MANIFEST_FILE) != 0) {
+        unlink(tmp);
+        return -1;
+    }
     return 0;
 }
+
+static void close_writers(db_writer_t *writers, int count) {
+    for (int i = 0; i < count; i++) {
+        db_writer_t *w = &writers[i];
+        if (DB_WRITERS > 1) {
+            pthread_mutex_lock(&w->mutex);
+            w->done = true;
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->mutex);
+            pthread_join(w->thread, NULL);
+            pthread_mutex_destroy(&w->mutex);
+            pthread_cond_destroy(&w->cond);
+            free(w->queue);
+        }
+        if (w->storage) backend->close(w->storage, DB_SYNC_POLICY != DB_SYNC_NONE);
+    }
+}
+
+// Opens the storage of every writer and, with more than one, starts their threads.
+// Returns the number of writers that were started: all of them on success.
+static int open_writers(db_writer_t *writers) {
+    for (int i = 0; i < DB_WRITERS; i++) {
+        db_writer_t *w = &writers[i];
+        w->id = i;
+        w->last_sync = monotonic_ms();
+        writer_location(backend->location, i, w->location, sizeof(w->location));
+
+        w->storage = backend->open(w->location);
+        if (!w->storage) return i;
+        if (DB_WRITERS == 1) continue;
+
+        w->queue = malloc(DB_WRITER_QUEUE * sizeof(*w->queue));
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        if (!w->queue || pthread_create(&w->thread, NULL, run_writer, w) != 0) {
+            free(w->queue);
+            pthread_mutex_destroy(&w->mutex);
+            pthread_cond_destroy(&w->cond);
+            backend->close(w->storage, false);
+            return i;
+        }
+    }
+    return DB_WRITERS;
+}
+
+void *run_db(void *arg) {
+    sbuffer_t *buffer = (sbuffer_t *)arg;
+    backend = storage_backend(DB_FORMAT);
+    if (!backend) return NULL;
+    metrics_register("storage", 0);
+
+    static db_writer_t writers[DB_WRITERS];
+    int opened = open_writers(writers);
+    if (opened < DB_WRITERS) {
+        close_writers(writers, opened);
+        metrics_unregister();
+        return NULL;
+    }
+
+    if (DB_WRITERS > 1) {
+        if (write_manifest(writers) == 0) {
+            log_event(LOG_DB_PARTITIONED, DB_WRITERS, DB_MANIFEST_FILE);
+        } else {
+            log_event(LOG_DB_NO_MANIFEST, DB_MANIFEST_FILE);
+        }
+    }
+
+    // Rollups are kept here, where every reading passes; rooms come from the published map
+    rollup_t *rollup = DB_ROLLUPS ? rollup_open() : NULL;
+    if (DB_ROLLUPS && !rollup) write_to_log_process("Could not open the rollup files, rollups are off");
+    int map_reader = rollup ? sensor_map_register_reader() : SENSOR_MAP_FAILURE;
+
+    sensor_data_t group[DB_GROUP_SIZE];
+    bool eos = false;
+
+    while (!eos) {
+        // The single writer is this thread: it syncs from here when it runs out of readings
+        struct timespec deadline;
+        bool idle_sync = DB_WRITERS == 1 && sync_deadline(&writers[0], &deadline);
+        int n = collect_group(buffer, group, &eos, idle_sync ? &deadline : NULL);
+        if (n == 0) {
+            if (idle_sync && !eos) sync_idle(&writers[0]);
+            continue;
+        }
+
+        if (DB_WRITERS == 1) {
+            write_group(&writers[0], group, n);
+        } else {
+            dispatch_group(writers, group, n);
+        }
+
+        if (rollup) {
+            const sensor_map_t *map = map_reader != SENSOR_MAP_FAILURE ? sensor_map_get(map_reader) : NULL;
+            rollup_add(rollup, group, n, map);
+            if (rollup_commit(rollup, false) != ROLLUP_SUCCESS) write_to_log_process("Could not write rollups");
+        }
+    }
+
+    if (map_reader != SENSOR_MAP_FAILURE) sensor_map_unregister_reader(map_reader);
+    if (rollup) rollup_close(&rollup, DB_SYNC_POLICY != DB_SYNC_NONE);
+    close_writers(writers, DB_WRITERS);
+    metrics_unregister();
+    return NULL;
+}
@@ -11,16 +11,190 @@
 
 #include "config.h"
 #include "sbuffer.h"
+#include "sensor_log.h"
+
+// Storage backends the storage manager can write to
+#define DB_FORMAT_CSV 0         /**< data.csv, one text line per reading */
+#define DB_FORMAT_SEGMENT 1     /**< segments/, hourly binary segments with a block index (see sensor_partition.h) */
+#define DB_FORMAT_SQLITE 2      /**< data.db, an indexed SQLite table (see sensor_sqlite.h) */
+
+#ifndef DB_FORMAT
+#define DB_FORMAT DB_FORMAT_CSV
+#endif
+
+#ifndef DB_SEGMENT_DIR
+#define DB_SEGMENT_DIR "segments"
+#endif
+
+#ifndef DB_SQLITE_FILE
+#define DB_SQLITE_FILE "data.db"
+#endif
+
+// Durability policies for the storage manager
+#define DB_SYNC_NONE 0          /**< leave flushing to disk to the OS */
+#define DB_SYNC_GROUP 1         /**< fdatasync after every committed group */
+#define DB_SYNC_INTERVAL 2      /**< fdatasync every DB_SYNC_INTERVAL_MS, also once readings stop coming */
+
+#ifndef DB_SYNC_POLICY
+#define DB_SYNC_POLICY DB_SYNC_NONE
+#endif
+
+#ifndef DB_SYNC_INTERVAL_MS
+#define DB_SYNC_INTERVAL_MS 1000
+#endif
+
+// A group is committed once it holds DB_GROUP_SIZE readings or its first reading waited DB_GROUP_DELAY_MS
+#ifndef DB_GROUP_SIZE
+#define DB_GROUP_SIZE 256
+#endif
+
+#ifndef DB_GROUP_DELAY_MS
+#define DB_GROUP_DELAY_MS 100
+#endif
+
+// Writer threads of the storage manager. With more than one, sensor 'id' is stored by writer
+// 'id % DB_WRITERS' in its own file ('data.csv' becomes 'data.0.csv', 'data.1.csv', ...), and
+// DB_MANIFEST_FILE records which writer owns which sensors and where its data is.
+#ifndef DB_WRITERS
+#define DB_WRITERS 1
+#endif
+
+#ifndef DB_MANIFEST_FILE
+#define DB_MANIFEST_FILE "storage.manifest"
+#endif
+
+// Keep a sparse (sensor, time bucket) -> byte range index next to data.csv, see sensor_index.h
+#ifndef DB_INDEX
+#define DB_INDEX 1
+#endif
+
+// Keep 1-minute, 1-hour and 1-day rollups per sensor and per room next to the raw readings (see sensor_rollup.h)
+#ifndef DB_ROLLUPS
+#define DB_ROLLUPS 1
+#endif
+
+// Groups waiting for each writer before the storage manager stops reading the sbuffer
+#ifndef DB_WRITER_QUEUE
+#define DB_WRITER_QUEUE 8
+#endif
+
+/**
+ * A storage backend, driven by run_db(). Readings arrive in groups: every group is written with
+ * write_batch() and then made visible (and durable, if 'sync' is set) with commit().
+ */
+typedef struct storage_backend {
+    const char *name;
+    const char *location;   /**< file or directory the backend writes to by default */
+    void *(*open)(const char *location);    /**< returns the backend's state, or NULL on failure */
+    int (*write_batch)(void *storage, const sensor_data_t *data, int count);
+    int (*commit)(void *storage, bool sync);
+    int (*close)(void *storage, bool sync); /**< also frees the state */
+} storage_backend_t;
+
+extern const storage_backend_t csv_backend;
+extern const storage_backend_t segment_backend;
+
+/**
+ * Returns the backend for a DB_FORMAT_* value, or NULL if there is none
+ */
+const storage_backend_t *storage_backend(int format);
+
+// How messages reach the logger process
+#define LOG_TRANSPORT_PIPE 0    /**< one write() on a pipe per message */
+#define LOG_TRANSPORT_RING 1    /**< a shared-memory ring (see sensor_logring.h); the pipe if it cannot be mapped */
+
+#ifndef LOG_TRANSPORT
+#define LOG_TRANSPORT LOG_TRANSPORT_RING
+#endif
+
+// What the logger process writes: formatted lines, or the binary records for log_decode to format
+#define LOG_FILE_TEXT 0         /**< gateway.log */
+#define LOG_FILE_BINARY 1       /**< gateway.blog, see sensor_log.h */
+
+#ifndef LOG_FILE_FORMAT
+#define LOG_FILE_FORMAT LOG_FILE_TEXT
+#endif
+
+#ifndef LOG_FILE
+#define LOG_FILE (LOG_FILE_FORMAT == LOG_FILE_BINARY ? "gateway.blog" : "gateway.log")
+#endif
+
+// The logger collects lines in large buffers and writes them once they fill up, or once the oldest
+// has waited LOG_FLUSH_DELAY_MS; 0 writes after every batch it reads
+#ifndef LOG_FLUSH_DELAY_MS
+#define LOG_FLUSH_DELAY_MS 100
+#endif
+
+// The logger rotates the log once it holds LOG_ROTATE_BYTES, or once it is LOG_ROTATE_SECONDS old;
+// 0 turns either off. See sensor_logrotate.h for how many rotated logs are kept.
+#ifndef LOG_ROTATE_BYTES
+#define LOG_ROTATE_BYTES (64LL * 1024 * 1024)
+#endif
+
+#ifndef LOG_ROTATE_SECONDS
+#define LOG_ROTATE_SECONDS (24 * 60 * 60)
+#endif
+
+// Events below LOG_MIN_LEVEL are left out at compile time, call sites and all
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Level every category starts at; the GATEWAY_LOG environment variable can change it per category
+#ifndef LOG_DEFAULT_LEVEL
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Events suppressed by level or rate limit are counted, and the counts logged at most this often
+#ifndef LOG_SUPPRESSED_REPORT_SECONDS
+#define LOG_SUPPRESSED_REPORT_SECONDS 60
+#endif
 
 // Logger methods
+/**
+ * Logs an event of sensor_log.h with its arguments; the message is formatted by the logger process
+ * 'event' must be the name of the event itself: its level and category are looked up at compile
+ * time. The event is dropped when it is below its category's level or over its rate limit.
+ */
+#define log_event(event, ...) \
+    do { \
+        if (event##_LEVEL >= LOG_MIN_LEVEL && log_admit((log_category_t)event##_CATEGORY, event##_LEVEL)) { \
+            log_event_emit(event, __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * Decides whether an event of 'level' in 'category' is logged, counting it if not
+ */
+bool log_admit(log_category_t category, int level);
+
+/**
+ * Sends an event to the logger process, whatever its level
+ */
+int log_event_emit(log_event_t event, ...);
+
+/**
+ * Sets the level and rate limit (events per second, 0: no limit) of a category
+ */
+void log_set_category(log_category_t category, int level, int rate);
+
+/**
+ * Applies a comma-separated list of "<category>=<level>[/<rate>]", e.g. "storage=warn,conn=info/50"
+ * Started with GATEWAY_LOG set, the logger applies its value.
+ * \return 0, or -1 if part of the list was not understood (the rest is still applied)
+ */
+int log_configure(const char *spec);
+
+/**
+ * Log messages dropped so far because the log ring stayed full
+ */
+unsigned long long log_dropped_messages();
+
 int write_to_log_process(char *msg);
 void start_logger();
 void stop_logger();
 
 // Storage manager methods
 void *run_db(void *arg);
-FILE * open_db(char * filename, bool append);
-int insert_sensor(FILE * f, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
-int close_db(FILE * f);
 
 #endif /* _SENSOR_DB_H_ */
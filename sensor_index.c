@@ -0,0 +1,342 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sensor_index.h"
+
+struct index_writer {
+    FILE *f;
+    index_entry_t open[UINT16_MAX + 1];     // open entry of every sensor, count 0 if none
+    index_entry_t previous[UINT16_MAX + 1]; // the one before it, kept open for late readings
+    sensor_id_t open_ids[UINT16_MAX + 1];   // sensors that may have an open entry
+    uint8_t listed[UINT16_MAX + 1];         // set for every sensor in 'open_ids'
+    int nb_open;
+    uint64_t end;                           // end of the last row added
+    index_entry_t *pending;                 // closed entries whose rows may not be on file yet
+    int nb_pending;
+    int pending_capacity;
+};
+
+static int64_t bucket_of(int64_t ts) {
+    return ts - ((ts % INDEX_BUCKET_SECONDS) + INDEX_BUCKET_SECONDS) % INDEX_BUCKET_SECONDS;
+}
+
+/* WRITER */
+
+index_writer_t *index_open(const char *path) {
+    index_writer_t *writer = calloc(1, sizeof(*writer));
+    if (!writer) return NULL;
+
+    writer->f = fopen(path, "w");
+    if (!writer->f) {
+        free(writer);
+        return NULL;
+    }
+
+    index_header_t header = {.bucket_seconds = INDEX_BUCKET_SECONDS, .covered = 0};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    if (fwrite(&header, sizeof(header), 1, writer->f) != 1) {
+        fclose(writer->f);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Closes an entry; index_commit() appends it once its rows are on file
+static void emit(index_writer_t *writer, index_entry_t *entry) {
+    if (writer->nb_pending == writer->pending_capacity) {
+        int capacity = writer->pending_capacity ? 2 * writer->pending_capacity : 64;
+        index_entry_t *grown = realloc(writer->pending, capacity * sizeof(*grown));
+        if (!grown) {
+            // Better an entry that may point ahead of the data than none at all
+            fwrite(entry, sizeof(*entry), 1, writer->f);
+            entry->count = 0;
+            return;
+        }
+        writer->pending = grown;
+        writer->pending_capacity = capacity;
+    }
+    writer->pending[writer->nb_pending++] = *entry;
+    entry->count = 0;
+}
+
+// Appends the closed entries that end at or before 'written' and returns the lowest begin of those kept back
+static uint64_t publish(index_writer_t *writer, uint64_t written) {
+    uint64_t held = UINT64_MAX;
+    int kept = 0;
+    for (int i = 0; i < writer->nb_pending; i++) {
+        index_entry_t *entry = &writer->pending[i];
+        if (entry->end <= written) {
+            fwrite(entry, sizeof(*entry), 1, writer->f);
+        } else {
+            if (entry->begin < held) held = entry->begin;
+            writer->pending[kept++] = *entry;
+        }
+    }
+    writer->nb_pending = kept;
+    return held;
+}
+
+void index_add(index_writer_t *writer, sensor_id_t id, sensor_ts_t ts, uint64_t offset, uint64_t len) {
+    index_entry_t *entry = &writer->open[id], *previous = &writer->previous[id];
+    int64_t bucket = bucket_of(ts);
+    writer->end = offset + len;
+
+    if (entry->count && bucket > entry->bucket) {
+        if (previous->count) emit(writer, previous);
+        *previous = *entry;
+        entry->count = 0;
+    }
+
+    if (entry->count && bucket != entry->bucket) {
+        if (previous->count && bucket == previous->bucket) {
+            entry = previous;
+        } else {
+            // Older than both open entries: an entry of its own
+            index_entry_t late = {.id = id, .bucket = bucket, .begin = offset, .end = offset + len, .count = 1};
+            emit(writer, &late);
+            return;
+        }
+    }
+
+    if (entry->count == 0) {
+        entry->id = id;
+        entry->bucket = bucket;
+        entry->begin = offset;
+        if (!writer->listed[id]) {
+            writer->listed[id] = 1;
+            writer->open_ids[writer->nb_open++] = id;
+        }
+    }
+    entry->end = offset + len;
+    entry->count++;
+}
+
+// Closes the entries of buckets that are over and returns the offset every row before is indexed up to.
+// Sensor timestamps are seconds since the epoch, so they can be compared with the wall clock.
+static uint64_t sweep(index_writer_t *writer, time_t now, bool all) {
+    uint64_t covered = writer->end;
+    int kept = 0;
+
+    for (int i = 0; i < writer->nb_open; i++) {
+        sensor_id_t id = writer->open_ids[i];
+        index_entry_t *entries[2] = {&writer->previous[id], &writer->open[id]};
+        for (int k = 0; k < 2; k++) {
+            index_entry_t *entry = entries[k];
+            if (entry->count && (all || now >= entry->bucket + INDEX_BUCKET_SECONDS + INDEX_GRACE_SECONDS)) {
+                emit(writer, entry);
+            }
+            if (entry->count && entry->begin < covered) covered = entry->begin;
+        }
+        if (entries[0]->count == 0 && entries[1]->count == 0) {
+            writer->listed[id] = 0;
+            continue;
+        }
+        writer->open_ids[kept++] = id;
+    }
+    writer->nb_open = kept;
+    return covered;
+}
+
+static int commit(index_writer_t *writer, uint64_t written, bool sync, bool all) {
+    uint64_t covered = sweep(writer, time(NULL), all);
+    uint64_t held = publish(writer, written);
+    if (held < covered) covered = held;
+    if (written < covered) covered = written;
+
+    // Entries first: a reader that sees the new 'covered' offset must find them
+    if (fflush(writer->f) != 0) return INDEX_FAILURE;
+    if (pwrite(fileno(writer->f), &covered, sizeof(covered), offsetof(index_header_t, covered)) != sizeof(covered)) {
+        return INDEX_FAILURE;
+    }
+    if (sync && fdatasync(fileno(writer->f)) != 0) return INDEX_FAILURE;
+    return INDEX_SUCCESS;
+}
+
+int index_commit(index_writer_t *writer, uint64_t written, bool sync) {
+    return commit(writer, written, sync, false);
+}
+
+int index_close(index_writer_t **writer, bool sync) {
+    if (writer == NULL || *writer == NULL) return INDEX_FAILURE;
+    int result = commit(*writer, UINT64_MAX, sync, true);
+    if (fclose((*writer)->f) != 0) result = INDEX_FAILURE;
+    free((*writer)->pending);
+    free(*writer);
+    *writer = NULL;
+    return result;
+}
+
+/* READER */
+
+typedef struct range {
+    uint64_t begin;
+    uint64_t end;
+} range_t;
+
+static int compare_begin(const void *a, const void *b) {
+    const range_t *x = a, *y = b;
+    return (x->begin > y->begin) - (x->begin < y->begin);
+}
+
+// Parses one "<id>, <value>, <ts>" row of 'len' bytes, without the newline
+static bool parse_row(const char *row, size_t len, sensor_data_t *data) {
+    char line[128];
+    if (len == 0 || len >= sizeof(line)) return false;
+    memcpy(line, row, len);
+    line[len] = '\0';
+
+    char *p = line, *end;
+    unsigned long id = strtoul(p, &end, 10);
+    if (end == p || id > UINT16_MAX || end[0] != ',') return false;
+    p = end + 1;
+    double value = strtod(p, &end);
+    if (end == p || end[0] != ',') return false;
+    p = end + 1;
+    long long ts = strtoll(p, &end, 10);
+    if (end == p || *end != '\0') return false;
+
+    data->id = id;
+    data->value = value;
+    data->ts = ts;
+    return true;
+}
+
+// Reads the index of 'data_path' and adds the byte ranges to scan for the query to 'ranges'.
+// Returns the number of ranges, or -1 if there is no usable index.
+static int index_ranges(const char *data_path, uint64_t size, sensor_id_t id, sensor_ts_t from, sensor_ts_t to,
+                        range_t **ranges, int *entries) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s.idx", data_path);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(index_header_t)) {
+        close(fd);
+        return -1;
+    }
+    const char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return -1;
+
+    const index_header_t *header = (const index_header_t *)file;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->bucket_seconds <= 0) {
+        munmap((void *)file, st.st_size);
+        return -1;
+    }
+
+    const index_entry_t *all = (const index_entry_t *)(file + sizeof(index_header_t));
+    size_t total = (st.st_size - sizeof(index_header_t)) / sizeof(index_entry_t);
+    int n = 0, capacity = 16;
+    range_t *found = malloc(capacity * sizeof(*found));
+
+    // The unindexed tail always has to be read
+    uint64_t covered = header->covered < size ? header->covered : size;
+    if (found && covered < size) found[n++] = (range_t){covered, size};
+
+    for (size_t i = 0; i < total && found; i++) {
+        const index_entry_t *e = &all[i];
+        if (e->id != id || e->bucket > to || e->bucket + header->bucket_seconds <= from) continue;
+        if (n == capacity) {
+            capacity *= 2;
+            range_t *grown = realloc(found, capacity * sizeof(*found));
+            if (!grown) {
+                free(found);
+                found = NULL;
+                break;
+            }
+            found = grown;
+        }
+        found[n++] = (range_t){e->begin, e->end < size ? e->end : size};
+        (*entries)++;
+    }
+    munmap((void *)file, st.st_size);
+    if (!found) return -1;
+
+    *ranges = found;
+    return n;
+}
+
+int index_query(const char *data_path, sensor_id_t id, sensor_ts_t from, sensor_ts_t to,
+                void (*callback)(const sensor_data_t *data, void *arg), void *arg, index_query_stats_t *stats) {
+    index_query_stats_t local;
+    if (!stats) stats = &local;
+    memset(stats, 0, sizeof(*stats));
+
+    int fd = open(data_path, O_RDONLY);
+    if (fd == -1) return INDEX_FAILURE;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return INDEX_FAILURE;
+    }
+    stats->file_size = st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return INDEX_FAILURE;
+
+    range_t *ranges = NULL;
+    int nb_ranges = index_ranges(data_path, st.st_size, id, from, to, &ranges, &stats->entries);
+    stats->indexed = nb_ranges >= 0;
+    if (nb_ranges < 0) {
+        ranges = malloc(sizeof(*ranges));
+        if (!ranges) {
+            munmap((void *)file, st.st_size);
+            return INDEX_FAILURE;
+        }
+        ranges[0] = (range_t){0, st.st_size};
+        nb_ranges = 1;
+    }
+
+    // Overlapping ranges are merged, so no row is read (or reported) twice
+    qsort(ranges, nb_ranges, sizeof(*ranges), compare_begin);
+    int merged = 0;
+    for (int i = 0; i < nb_ranges; i++) {
+        if (merged > 0 && ranges[i].begin <= ranges[merged - 1].end) {
+            if (ranges[i].end > ranges[merged - 1].end) ranges[merged - 1].end = ranges[i].end;
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+
+    int found = 0;
+    for (int i = 0; i < merged; i++) {
+        const char *p = file + ranges[i].begin, *end = file + ranges[i].end;
+        stats->bytes_read += ranges[i].end - ranges[i].begin;
+
+        while (p < end) {
+            // A row that is still being written has no newline yet
+            const char *newline = memchr(p, '\n', file + st.st_size - p);
+            if (!newline) break;
+
+            sensor_data_t data;
+            if (parse_row(p, newline - p, &data) && data.id == id && data.ts >= from && data.ts <= to) {
+                callback(&data, arg);
+                found++;
+            }
+            p = newline + 1;
+        }
+    }
+
+    free(ranges);
+    munmap((void *)file, st.st_size);
+    return found;
+}
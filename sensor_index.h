@@ -0,0 +1,105 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_INDEX_H_
+#define _SENSOR_INDEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+#define INDEX_FAILURE -1
+#define INDEX_SUCCESS 0
+
+/*
+ * Sparse index over a data.csv file, written next to it as '<file>.idx' by the storage manager.
+ * Instead of one entry per row there is one entry per sensor per time bucket of
+ * INDEX_BUCKET_SECONDS, holding the byte range of the file its rows were written to. Rows of
+ * other sensors in that range are skipped by the reader.
+ *
+ *   header | entry 0 | entry 1 | ...
+ *
+ * An entry is appended once the sensor's rows have moved two buckets on, or once its bucket is over
+ * by INDEX_GRACE_SECONDS; until then late rows still extend it. Rows older than that get an entry
+ * of their own. Rows written after the last commit's 'covered' offset may not have an entry yet;
+ * readers scan that tail of the file in full. Neither the entries nor 'covered' ever point past the
+ * rows that have reached the file: asynchronous writes can complete out of order.
+ */
+#define INDEX_MAGIC "SIDX1"
+
+// Length of a time bucket: shorter buckets mean more entries but fewer bytes read per query
+#ifndef INDEX_BUCKET_SECONDS
+#define INDEX_BUCKET_SECONDS 60
+#endif
+
+// Seconds an entry stays open after its bucket ended, for late readings
+#ifndef INDEX_GRACE_SECONDS
+#define INDEX_GRACE_SECONDS 60
+#endif
+
+typedef struct index_header {
+    char magic[8];
+    int64_t bucket_seconds;
+    uint64_t covered;           /**< every row before this offset of the data file has an entry */
+} index_header_t;
+
+typedef struct index_entry {
+    uint16_t id;                /**< sensor id */
+    uint16_t reserved;
+    uint32_t count;             /**< rows of the sensor in the range */
+    int64_t bucket;             /**< first second of the time bucket */
+    uint64_t begin;             /**< byte range of the data file holding those rows */
+    uint64_t end;
+} index_entry_t;
+
+_Static_assert(sizeof(index_entry_t) == 32, "index entries are stored as-is");
+
+typedef struct index_writer index_writer_t;
+
+/**
+ * Starts a new index for a data file that is being written from offset 0
+ * \param path the index file, truncated if it exists
+ * \return a new writer, or NULL if the file could not be created
+ */
+index_writer_t *index_open(const char *path);
+
+/**
+ * Records that the row for reading ('id', 'ts') was written at [offset, offset + len)
+ * Rows must be added in file order.
+ */
+void index_add(index_writer_t *writer, sensor_id_t id, sensor_ts_t ts, uint64_t offset, uint64_t len);
+
+/**
+ * Appends finished entries and updates the 'covered' offset in the header
+ * \param written offset of the data file up to which every row has been written; entries reaching
+ * further are held back until a later commit
+ */
+int index_commit(index_writer_t *writer, uint64_t written, bool sync);
+
+/**
+ * Writes all open entries, so the whole data file is covered, and frees the writer
+ * The data file must be complete: every row added has been written.
+ * \param writer a double pointer to the writer, set to NULL
+ */
+int index_close(index_writer_t **writer, bool sync);
+
+// Statistics of one query, for the query tool
+typedef struct index_query_stats {
+    uint64_t file_size;         /**< bytes in the data file */
+    uint64_t bytes_read;        /**< bytes scanned to answer the query */
+    int entries;                /**< index entries that matched */
+    bool indexed;               /**< false if there was no usable index and the whole file was scanned */
+} index_query_stats_t;
+
+/**
+ * Calls 'callback' for every reading of sensor 'id' with from <= ts <= to in a data.csv file
+ * Only the byte ranges the index points to and the unindexed tail are read, through mmap.
+ * Readings are reported in file order. Without a usable '<data_path>.idx' the whole file is scanned.
+ * \param stats filled in if not NULL
+ * \return the number of readings reported, or INDEX_FAILURE if the data file could not be read
+ */
+int index_query(const char *data_path, sensor_id_t id, sensor_ts_t from, sensor_ts_t to,
+                void (*callback)(const sensor_data_t *data, void *arg), void *arg, index_query_stats_t *stats);
+
+#endif /* _SENSOR_INDEX_H_ */
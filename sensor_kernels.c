@@ -0,0 +1,215 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#include "sensor_kernels.h"
+
+typedef void (*band_check_fn)(const sensor_value_t *, const sensor_value_t *,
+        const sensor_value_t *, int, sensor_value_t, uint8_t *);
+typedef void (*reduce_fn)(const sensor_value_t *, int,
+        sensor_value_t *, sensor_value_t *, sensor_value_t *);
+
+/* SCALAR KERNELS */
+
+static void band_check_scalar(const sensor_value_t *values, const sensor_value_t *min,
+        const sensor_value_t *max, int n, sensor_value_t hysteresis, uint8_t *flags) {
+    for (int i = 0; i < n; i++) {
+        sensor_value_t v = values[i];
+        flags[i] = (v > max[i] ? BAND_ABOVE_MAX : 0) |
+                   (v < min[i] ? BAND_BELOW_MIN : 0) |
+                   (v > max[i] - hysteresis ? BAND_NEAR_MAX : 0) |
+                   (v < min[i] + hysteresis ? BAND_NEAR_MIN : 0);
+    }
+}
+
+static void reduce_scalar(const sensor_value_t *values, int n,
+        sensor_value_t *sum, sensor_value_t *min, sensor_value_t *max) {
+    sensor_value_t s = 0, lo = values[0], hi = values[0];
+    for (int i = 0; i < n; i++) {
+        s += values[i];
+        if (values[i] < lo) lo = values[i];
+        if (values[i] > hi) hi = values[i];
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+#ifdef KERNELS_X86
+
+// Turn the four compare masks of 'lanes' values into BAND_* flags
+static inline void store_flags(int above, int below, int near_hi, int near_lo, int lanes, uint8_t *flags) {
+    for (int j = 0; j < lanes; j++) {
+        flags[j] = ((above >> j) & 1) * BAND_ABOVE_MAX |
+                   ((below >> j) & 1) * BAND_BELOW_MIN |
+                   ((near_hi >> j) & 1) * BAND_NEAR_MAX |
+                   ((near_lo >> j) & 1) * BAND_NEAR_MIN;
+    }
+}
+
+/* SSE2 KERNELS: part of the x86-64 baseline, so they need no runtime check there */
+
+__attribute__((target("sse2")))
+static void band_check_sse2(const sensor_value_t *values, const sensor_value_t *min,
+        const sensor_value_t *max, int n, sensor_value_t hysteresis, uint8_t *flags) {
+    const __m128d h = _mm_set1_pd(hysteresis);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        __m128d lo = _mm_loadu_pd(min + i);
+        __m128d hi = _mm_loadu_pd(max + i);
+
+        store_flags(_mm_movemask_pd(_mm_cmpgt_pd(v, hi)),
+                    _mm_movemask_pd(_mm_cmplt_pd(v, lo)),
+                    _mm_movemask_pd(_mm_cmpgt_pd(v, _mm_sub_pd(hi, h))),
+                    _mm_movemask_pd(_mm_cmplt_pd(v, _mm_add_pd(lo, h))),
+                    2, flags + i);
+    }
+
+    band_check_scalar(values + i, min + i, max + i, n - i, hysteresis, flags + i);
+}
+
+__attribute__((target("sse2")))
+static void reduce_sse2(const sensor_value_t *values, int n,
+        sensor_value_t *sum, sensor_value_t *min, sensor_value_t *max) {
+    if (n < 4) {
+        reduce_scalar(values, n, sum, min, max);
+        return;
+    }
+
+    __m128d s = _mm_setzero_pd();
+    __m128d lo = _mm_loadu_pd(values);
+    __m128d hi = lo;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        s = _mm_add_pd(s, v);
+        lo = _mm_min_pd(lo, v);
+        hi = _mm_max_pd(hi, v);
+    }
+
+    double ls[2], llo[2], lhi[2];
+    _mm_storeu_pd(ls, s);
+    _mm_storeu_pd(llo, lo);
+    _mm_storeu_pd(lhi, hi);
+    sensor_value_t ts = ls[0] + ls[1];
+    sensor_value_t tlo = llo[0] < llo[1] ? llo[0] : llo[1];
+    sensor_value_t thi = lhi[0] > lhi[1] ? lhi[0] : lhi[1];
+
+    for (; i < n; i++) {
+        ts += values[i];
+        if (values[i] < tlo) tlo = values[i];
+        if (values[i] > thi) thi = values[i];
+    }
+    *sum = ts;
+    *min = tlo;
+    *max = thi;
+}
+
+/* AVX2 KERNELS: only used when the CPU reports AVX2 */
+
+__attribute__((target("avx2")))
+static void band_check_avx2(const sensor_value_t *values, const sensor_value_t *min,
+        const sensor_value_t *max, int n, sensor_value_t hysteresis, uint8_t *flags) {
+    const __m256d h = _mm256_set1_pd(hysteresis);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        __m256d lo = _mm256_loadu_pd(min + i);
+        __m256d hi = _mm256_loadu_pd(max + i);
+
+        store_flags(_mm256_movemask_pd(_mm256_cmp_pd(v, hi, _CMP_GT_OQ)),
+                    _mm256_movemask_pd(_mm256_cmp_pd(v, lo, _CMP_LT_OQ)),
+                    _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_sub_pd(hi, h), _CMP_GT_OQ)),
+                    _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_add_pd(lo, h), _CMP_LT_OQ)),
+                    4, flags + i);
+    }
+
+    band_check_sse2(values + i, min + i, max + i, n - i, hysteresis, flags + i);
+}
+
+__attribute__((target("avx2")))
+static void reduce_avx2(const sensor_value_t *values, int n,
+        sensor_value_t *sum, sensor_value_t *min, sensor_value_t *max) {
+    if (n < 8) {
+        reduce_sse2(values, n, sum, min, max);
+        return;
+    }
+
+    __m256d s = _mm256_setzero_pd();
+    __m256d lo = _mm256_loadu_pd(values);
+    __m256d hi = lo;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        s = _mm256_add_pd(s, v);
+        lo = _mm256_min_pd(lo, v);
+        hi = _mm256_max_pd(hi, v);
+    }
+
+    double ls[4], llo[4], lhi[4];
+    _mm256_storeu_pd(ls, s);
+    _mm256_storeu_pd(llo, lo);
+    _mm256_storeu_pd(lhi, hi);
+    sensor_value_t ts = (ls[0] + ls[1]) + (ls[2] + ls[3]);
+    sensor_value_t tlo = llo[0], thi = lhi[0];
+    for (int j = 1; j < 4; j++) {
+        if (llo[j] < tlo) tlo = llo[j];
+        if (lhi[j] > thi) thi = lhi[j];
+    }
+
+    for (; i < n; i++) {
+        ts += values[i];
+        if (values[i] < tlo) tlo = values[i];
+        if (values[i] > thi) thi = values[i];
+    }
+    *sum = ts;
+    *min = tlo;
+    *max = thi;
+}
+
+#endif /* KERNELS_X86 */
+
+/* DISPATCH */
+
+static band_check_fn band_check_impl = band_check_scalar;
+static reduce_fn reduce_impl = reduce_scalar;
+static const char *isa = "scalar";
+
+void kernel_init() {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        band_check_impl = band_check_avx2;
+        reduce_impl = reduce_avx2;
+        isa = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        band_check_impl = band_check_sse2;
+        reduce_impl = reduce_sse2;
+        isa = "sse2";
+    }
+#endif
+}
+
+const char *kernel_isa() {
+    return isa;
+}
+
+void kernel_band_check(const sensor_value_t *values, const sensor_value_t *min,
+        const sensor_value_t *max, int n, sensor_value_t hysteresis, uint8_t *flags) {
+    band_check_impl(values, min, max, n, hysteresis, flags);
+}
+
+void kernel_reduce(const sensor_value_t *values, int n,
+        sensor_value_t *sum, sensor_value_t *min, sensor_value_t *max) {
+    reduce_impl(values, n, sum, min, max);
+}
@@ -0,0 +1,53 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_KERNELS_H_
+#define _SENSOR_KERNELS_H_
+
+#include <stdint.h>
+#include "config.h"
+
+// Flags produced by kernel_band_check() for every value
+#define BAND_ABOVE_MAX 0x1      /**< value > max */
+#define BAND_BELOW_MIN 0x2      /**< value < min */
+#define BAND_NEAR_MAX  0x4      /**< value > max - hysteresis */
+#define BAND_NEAR_MIN  0x8      /**< value < min + hysteresis */
+
+/**
+ * Picks the fastest implementation of every kernel for the CPU we run on (AVX2, SSE2 or scalar)
+ * Kernels work before this is called, they just use the portable version.
+ * Call it once at startup, before other threads use the kernels.
+ */
+void kernel_init();
+
+/**
+ * Returns the name of the instruction set the kernels were dispatched to, e.g. "avx2"
+ */
+const char *kernel_isa();
+
+/**
+ * Checks 'n' values against their own [min, max] band in one vectorised pass
+ * All arrays are structure-of-arrays: entry i of each array belongs to the same sensor
+ * \param values the values to check, e.g. running averages
+ * \param min the lower limit of each band
+ * \param max the upper limit of each band
+ * \param n the number of entries
+ * \param hysteresis the margin used for the BAND_NEAR_* flags
+ * \param flags output, a combination of BAND_* flags for each entry
+ */
+void kernel_band_check(const sensor_value_t *values, const sensor_value_t *min,
+        const sensor_value_t *max, int n, sensor_value_t hysteresis, uint8_t *flags);
+
+/**
+ * Computes the sum, minimum and maximum of 'n' contiguous values
+ * \param values the values to reduce, n must be at least 1
+ * \param n the number of values
+ * \param sum output, the sum of the values
+ * \param min output, the smallest value
+ * \param max output, the largest value
+ */
+void kernel_reduce(const sensor_value_t *values, int n,
+        sensor_value_t *sum, sensor_value_t *min, sensor_value_t *max);
+
+#endif /* _SENSOR_KERNELS_H_ */
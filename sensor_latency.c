@@ -0,0 +1,320 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sensor_latency.h"
+#include "sensor_db.h"
+
+/*
+ * Bucket of a value: exact below 2^LATENCY_SUB_BITS, above that the top LATENCY_SUB_BITS + 1 bits
+ * with a bucket per power of two, so a bucket is never wider than 1/128 of the values in it.
+ */
+#define LATENCY_SUB_BITS 7
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40     // 2^40 ns is about 18 minutes; longer latencies count as that
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+typedef struct histogram {
+    atomic_ullong counts[LATENCY_BUCKETS];
+    atomic_ullong total;
+    atomic_ullong sum_ns;
+    atomic_llong max_ns;
+} histogram_t;
+
+// The histograms of a thread that registered, written by that thread only
+typedef struct latency_slot {
+    histogram_t histograms[LATENCY_STAGE_COUNT];
+    struct latency_slot *next;
+} latency_slot_t;
+
+// What a reader adds up besides the counts
+typedef struct histogram_totals {
+    uint64_t total;
+    uint64_t sum_ns;
+    int64_t max_ns;
+} histogram_totals_t;
+
+typedef struct stage_info {
+    const char *name;
+    const char *help;
+} stage_info_t;
+
+#define LATENCY_STAGE_INFO(name, text, help) {text, help},
+static const stage_info_t stages[LATENCY_STAGE_COUNT] = {LATENCY_STAGES(LATENCY_STAGE_INFO)};
+#undef LATENCY_STAGE_INFO
+
+static const double percentiles[LATENCY_NB_PERCENTILES] = LATENCY_PERCENTILES;
+
+// Shared by the threads that did not register, and what the registered threads that are gone counted
+static histogram_t histograms[LATENCY_STAGE_COUNT];
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static latency_slot_t *slots = NULL;
+static _Thread_local latency_slot_t *latency_self = NULL;
+
+// Counts at the previous report, so each report covers only the readings since (reporter only)
+static uint64_t reported[LATENCY_STAGE_COUNT][LATENCY_BUCKETS];
+
+static pthread_t report_thread;
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t report_cond = PTHREAD_COND_INITIALIZER;
+static bool report_stop = false;
+static bool reporting = false;
+
+int64_t latency_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* HISTOGRAMS */
+
+static int bucket_of(int64_t ns) {
+    uint64_t v = ns < 0 ? 0 : (uint64_t)ns;
+    if (v >= (1ULL << (LATENCY_MAX_BITS + 1))) v = (1ULL << (LATENCY_MAX_BITS + 1)) - 1;
+    if (v < LATENCY_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB + (int)((v >> shift) - LATENCY_SUB);
+}
+
+// Highest value that falls in a bucket
+static int64_t bucket_value(int bucket) {
+    if (bucket < LATENCY_SUB) return bucket;
+    int shift = bucket / LATENCY_SUB - 1;
+    int64_t mantissa = bucket % LATENCY_SUB + LATENCY_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Adds to a counter; one only its own thread writes needs no atomic add, readers still see whole values
+static void add_count(atomic_ullong *counter, uint64_t n, bool own) {
+    if (own) {
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+    }
+}
+
+static void raise_max(atomic_llong *max_ns, int64_t max, bool own) {
+    long long seen = atomic_load_explicit(max_ns, memory_order_relaxed);
+    if (own) {
+        if (max > seen) atomic_store_explicit(max_ns, max, memory_order_relaxed);
+        return;
+    }
+    while (max > seen && !atomic_compare_exchange_weak_explicit(max_ns, &seen, max, memory_order_relaxed,
+                                                                memory_order_relaxed)) {
+    }
+}
+
+void latency_record(latency_stage_t stage, const sensor_data_t *data, int count, int64_t now_ns) {
+    latency_slot_t *self = latency_self;
+    histogram_t *h = self ? &self->histograms[stage] : &histograms[stage];
+    bool own = self != NULL;
+    uint64_t n = 0, sum = 0;
+    int64_t max = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (data[i].ingest_ns == 0) continue;
+        int64_t ns = now_ns - data[i].ingest_ns;
+        add_count(&h->counts[bucket_of(ns)], 1, own);
+        n++;
+        sum += ns > 0 ? ns : 0;
+        if (ns > max) max = ns;
+    }
+    if (n == 0) return;
+
+    // Totals once per batch rather than per reading
+    add_count(&h->total, n, own);
+    add_count(&h->sum_ns, sum, own);
+    raise_max(&h->max_ns, max, own);
+}
+
+int latency_register() {
+    if (latency_self) return LATENCY_SUCCESS;
+
+    latency_slot_t *slot = calloc(1, sizeof(*slot));
+    if (!slot) return LATENCY_FAILURE;
+
+    pthread_mutex_lock(&slots_mutex);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_mutex);
+
+    latency_self = slot;
+    return LATENCY_SUCCESS;
+}
+
+void latency_unregister() {
+    latency_slot_t *slot = latency_self;
+    if (!slot) return;
+    latency_self = NULL;
+
+    // Moved under the lock, so a reader sees the counts either in the slot or in the shared histograms
+    pthread_mutex_lock(&slots_mutex);
+    for (latency_slot_t **p = &slots; *p; p = &(*p)->next) {
+        if (*p == slot) {
+            *p = slot->next;
+            break;
+        }
+    }
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        histogram_t *from = &slot->histograms[s], *to = &histograms[s];
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&from->counts[b], memory_order_relaxed);
+            if (n) add_count(&to->counts[b], n, false);
+        }
+        add_count(&to->total, atomic_load_explicit(&from->total, memory_order_relaxed), false);
+        add_count(&to->sum_ns, atomic_load_explicit(&from->sum_ns, memory_order_relaxed), false);
+        raise_max(&to->max_ns, atomic_load_explicit(&from->max_ns, memory_order_relaxed), false);
+    }
+    pthread_mutex_unlock(&slots_mutex);
+
+    free(slot);
+}
+
+// Percentiles of a copy of the counts; the largest value is that of the highest bucket in use
+static void summarize_counts(const uint64_t *counts, latency_summary_t *summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        summary->count += counts[b];
+        if (counts[b]) summary->max_ns = bucket_value(b);
+    }
+    if (summary->count == 0) return;
+
+    uint64_t seen = 0;
+    int p = 0, b = 0;
+    for (; p < LATENCY_NB_PERCENTILES; p++) {
+        // The smallest value at least this share of the readings does not exceed
+        uint64_t rank = (uint64_t)(percentiles[p] / 100 * summary->count + 0.999999);
+        if (rank == 0) rank = 1;
+        while (b < LATENCY_BUCKETS && seen + counts[b] < rank) seen += counts[b++];
+        summary->percentile_ns[p] = bucket_value(b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1);
+    }
+}
+
+static void accumulate(const histogram_t *h, uint64_t *counts, histogram_totals_t *totals) {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) counts[b] += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    totals->total += atomic_load_explicit(&h->total, memory_order_relaxed);
+    totals->sum_ns += atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    long long max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    if (max > totals->max_ns) totals->max_ns = max;
+}
+
+// What every thread counted for 'stage': the shared histogram plus that of each registered thread
+static void snapshot(latency_stage_t stage, uint64_t *counts, histogram_totals_t *totals) {
+    memset(counts, 0, LATENCY_BUCKETS * sizeof(*counts));
+    memset(totals, 0, sizeof(*totals));
+
+    pthread_mutex_lock(&slots_mutex);
+    accumulate(&histograms[stage], counts, totals);
+    for (latency_slot_t *slot = slots; slot; slot = slot->next) accumulate(&slot->histograms[stage], counts, totals);
+    pthread_mutex_unlock(&slots_mutex);
+}
+
+static void summarize_stage(latency_stage_t stage, latency_summary_t *summary, histogram_totals_t *totals) {
+    static uint64_t counts[LATENCY_BUCKETS];
+    static pthread_mutex_t counts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&counts_mutex);
+    snapshot(stage, counts, totals);
+    summarize_counts(counts, summary);
+    pthread_mutex_unlock(&counts_mutex);
+
+    if (summary->count > 0) summary->max_ns = totals->max_ns;
+}
+
+void latency_summarize(latency_stage_t stage, latency_summary_t *summary) {
+    histogram_totals_t totals;
+    summarize_stage(stage, summary, &totals);
+}
+
+void latency_write_metrics(FILE *out) {
+    fprintf(out, "# HELP gateway_latency_seconds Time from receiving a reading until it is");
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        fprintf(out, "%s %s", s == 0 ? "" : s == LATENCY_STAGE_COUNT - 1 ? " or" : ",", stages[s].help);
+    }
+    fprintf(out, "\n# TYPE gateway_latency_seconds summary\n");
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        latency_summary_t summary;
+        histogram_totals_t totals;
+        summarize_stage(s, &summary, &totals);
+        for (int p = 0; p < LATENCY_NB_PERCENTILES; p++) {
+            fprintf(out, "gateway_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", stages[s].name,
+                    percentiles[p] / 100, summary.percentile_ns[p] * 1e-9);
+        }
+        fprintf(out, "gateway_latency_seconds_sum{stage=\"%s\"} %.9f\n", stages[s].name, totals.sum_ns * 1e-9);
+        fprintf(out, "gateway_latency_seconds_count{stage=\"%s\"} %llu\n", stages[s].name,
+                (unsigned long long)totals.total);
+    }
+}
+
+/* REPORTS */
+
+// Logs the percentiles of the readings timed since the previous report, per stage
+static void report() {
+    static uint64_t counts[LATENCY_BUCKETS];
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+        histogram_totals_t totals;
+        snapshot(s, counts, &totals);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t now = counts[b];
+            counts[b] -= reported[s][b];
+            reported[s][b] = now;
+        }
+
+        latency_summary_t summary;
+        summarize_counts(counts, &summary);
+        if (summary.count == 0) continue;
+        log_event(LOG_LATENCY, stages[s].name, (long long)summary.count, summary.percentile_ns[0] / 1e3,
+                  summary.percentile_ns[1] / 1e3, summary.percentile_ns[2] / 1e3, summary.percentile_ns[3] / 1e3,
+                  summary.percentile_ns[4] / 1e3, summary.max_ns / 1e3);
+    }
+}
+
+static void *run_reporter(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&report_mutex);
+    while (!report_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += LATENCY_REPORT_SECONDS;
+        pthread_cond_timedwait(&report_cond, &report_mutex, &deadline);
+        if (report_stop) break;
+
+        pthread_mutex_unlock(&report_mutex);
+        report();
+        pthread_mutex_lock(&report_mutex);
+    }
+    pthread_mutex_unlock(&report_mutex);
+    return NULL;
+}
+
+int latency_start() {
+    if (LATENCY_REPORT_SECONDS <= 0) return LATENCY_SUCCESS;
+    report_stop = false;
+    if (pthread_create(&report_thread, NULL, run_reporter, NULL) != 0) return LATENCY_FAILURE;
+    reporting = true;
+    return LATENCY_SUCCESS;
+}
+
+void latency_stop() {
+    if (!reporting) return;
+    pthread_mutex_lock(&report_mutex);
+    report_stop = true;
+    pthread_cond_signal(&report_cond);
+    pthread_mutex_unlock(&report_mutex);
+    pthread_join(report_thread, NULL);
+    reporting = false;
+
+    // The readings since the last report
+    report();
+}
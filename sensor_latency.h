@@ -0,0 +1,96 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_LATENCY_H_
+#define _SENSOR_LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define LATENCY_FAILURE -1
+#define LATENCY_SUCCESS 0
+
+// How often the percentiles of the readings since the previous report are logged; 0: never
+#ifndef LATENCY_REPORT_SECONDS
+#define LATENCY_REPORT_SECONDS 60
+#endif
+
+/*
+ * Stages a reading is timed at, each from the moment the connection manager received it
+ * (sensor_data_t.ingest_ns); the time spent in the sbuffer is the difference between stages.
+ * 'committed' is when the storage backend accepted the group, which may only mean it is queued for
+ * the kernel; 'durable' is when a commit with a sync returned, so it only times the groups that
+ * DB_SYNC_POLICY syncs (none with DB_SYNC_NONE).
+ */
+#define LATENCY_STAGES(X) \
+    X(LATENCY_SBUFFER, "sbuffer", "in the sbuffer") \
+    X(LATENCY_DATAMGR, "datamgr", "through the alert decision") \
+    X(LATENCY_COMMITTED, "committed", "handed to the storage backend") \
+    X(LATENCY_DURABLE, "durable", "synced to disk")
+
+#define LATENCY_STAGE_ID(name, text, help) name,
+typedef enum latency_stage {
+    LATENCY_STAGES(LATENCY_STAGE_ID)
+    LATENCY_STAGE_COUNT
+} latency_stage_t;
+#undef LATENCY_STAGE_ID
+
+// Percentiles reported, in percent
+#define LATENCY_PERCENTILES {50, 90, 99, 99.9, 99.99}
+#define LATENCY_NB_PERCENTILES 5
+
+typedef struct latency_summary {
+    uint64_t count;
+    int64_t max_ns;
+    int64_t percentile_ns[LATENCY_NB_PERCENTILES];  /**< in the order of LATENCY_PERCENTILES */
+} latency_summary_t;
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds, the clock of sensor_data_t.ingest_ns
+ */
+int64_t latency_now_ns();
+
+/**
+ * Adds now - ingest_ns of every stamped reading to the histogram of 'stage'
+ * The histograms are HDR histograms: buckets of under 1% of their value, from 1 ns to about 18
+ * minutes. A thread that called latency_register() counts in histograms of its own; the others share
+ * one set and count with relaxed atomic adds. Either way no lock is taken.
+ */
+void latency_record(latency_stage_t stage, const sensor_data_t *data, int count, int64_t now_ns);
+
+/**
+ * Gives the calling thread its own histograms, for threads that record often and in parallel
+ * \return LATENCY_SUCCESS, or LATENCY_FAILURE if they could not be allocated (the shared ones are used then)
+ */
+int latency_register();
+
+/**
+ * Adds the histograms of the calling thread to the shared ones and frees them
+ */
+void latency_unregister();
+
+/**
+ * Percentiles of everything recorded for 'stage' so far
+ */
+void latency_summarize(latency_stage_t stage, latency_summary_t *summary);
+
+/**
+ * Writes every stage as a Prometheus summary, in seconds
+ */
+void latency_write_metrics(FILE *out);
+
+/**
+ * Starts logging the percentiles of each stage every LATENCY_REPORT_SECONDS
+ * \return LATENCY_SUCCESS, or LATENCY_FAILURE if the reporting thread could not be started
+ */
+int latency_start();
+
+/**
+ * Logs a last report and stops the reporting thread
+ */
+void latency_stop();
+
+#endif /* _SENSOR_LATENCY_H_ */
@@ -0,0 +1,234 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sensor_log.h"
+
+typedef struct event_info {
+    const char *args;
+    const char *format;
+} event_info_t;
+
+#define LOG_EVENT_INFO(name, level, category, args, format) {args, format},
+static const event_info_t events[LOG_EVENT_COUNT] = {LOG_EVENTS(LOG_EVENT_INFO)};
+#undef LOG_EVENT_INFO
+
+#define LOG_CATEGORY_NAME(name, text, rate) text,
+static const char *category_names[LOG_CATEGORY_COUNT] = {LOG_CATEGORIES(LOG_CATEGORY_NAME)};
+#undef LOG_CATEGORY_NAME
+
+static const char *level_names[] = {"debug", "info", "warn", "error", "off"};
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t log_wall_offset_ns() {
+    return clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+}
+
+/* ENCODING */
+
+int log_record_vencode(void *buf, size_t size, log_event_t event, va_list args) {
+    char *out = buf;
+    log_record_t record = {.event = event, .ns = clock_ns(CLOCK_MONOTONIC)};
+    size_t n = sizeof(record);
+
+    for (const char *type = events[event].args; *type; type++) {
+        int64_t number;
+        double real;
+        switch (*type) {
+        case 'i':
+            number = va_arg(args, int);
+            break;
+        case 'l':
+            number = va_arg(args, long long);
+            break;
+        case 'f':
+            real = va_arg(args, double);
+            memcpy(&number, &real, sizeof(number));
+            break;
+        default: {
+            // A string, cut off where it would leave no room for the arguments after it
+            const char *s = va_arg(args, const char *);
+            size_t needed = n + sizeof(uint16_t);
+            for (const char *rest = type + 1; *rest; rest++) needed += *rest == 's' ? sizeof(uint16_t) : sizeof(number);
+            size_t len = strlen(s), room = needed < size ? size - needed : 0;
+            if (len > room) len = room;
+            uint16_t len16 = len;
+            memcpy(out + n, &len16, sizeof(len16));
+            memcpy(out + n + sizeof(len16), s, len);
+            n += sizeof(len16) + len;
+            continue;
+        }
+        }
+        memcpy(out + n, &number, sizeof(number));
+        n += sizeof(number);
+    }
+
+    record.size = n;
+    memcpy(out, &record, sizeof(record));
+    return n;
+}
+
+int log_record_encode(void *buf, size_t size, log_event_t event, ...) {
+    va_list args;
+    va_start(args, event);
+    int n = log_record_vencode(buf, size, event, args);
+    va_end(args);
+    return n;
+}
+
+int log_record_size(const void *buf, size_t len) {
+    if (len < sizeof(log_record_t)) return 0;
+    log_record_t record;
+    memcpy(&record, buf, sizeof(record));
+    if (record.event >= LOG_EVENT_COUNT || record.size < sizeof(record) || record.size > LOG_RECORD_MAX) return -1;
+    return record.size <= len ? record.size : 0;
+}
+
+/* FORMATTING */
+
+// Appends with snprintf semantics: 'n' keeps counting past 'size', like the return value of snprintf
+#define APPEND(...) n += snprintf(out + (n < size ? n : size), n < size ? size - n : 0, __VA_ARGS__)
+
+int log_record_format(const void *buf, char *out, size_t size) {
+    log_record_t record;
+    memcpy(&record, buf, sizeof(record));
+    if (record.event >= LOG_EVENT_COUNT) return -1;
+
+    const char *p = (const char *)buf + sizeof(record), *end = (const char *)buf + record.size;
+    const char *type = events[record.event].args;
+    const char *f = events[record.event].format;
+    size_t n = 0;
+    if (size > 0) out[0] = '\0';
+
+    while (*f) {
+        if (f[0] != '%' || f[1] == '%') {
+            const char *next = f[0] == '%' ? f + 2 : strchr(f, '%');
+            if (!next) next = f + strlen(f);
+            if (f[0] == '%') APPEND("%%");
+            else APPEND("%.*s", (int)(next - f), f);
+            f = next;
+            continue;
+        }
+
+        // Keep flags, width and precision, drop the length modifier, print integers as long long
+        const char *s = f + 1;
+        s += strspn(s, "-+ #0123456789.");
+        char spec[32];
+        int spec_len = s - f;
+        if (spec_len > (int)sizeof(spec) - 4) return -1;
+        memcpy(spec, f, spec_len);
+        s += strspn(s, "hlLqjzt");
+        char conversion = *s;
+        if (conversion == '\0' || *type == '\0') return -1;
+        f = s + 1;
+
+        if (*type == 's') {
+            uint16_t len;
+            if (end - p < (long)sizeof(len)) return -1;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if (end - p < len) return -1;
+            spec[spec_len++] = '.';
+            spec[spec_len++] = '*';
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            APPEND(spec, (int)len, p);
+            p += len;
+        } else {
+            int64_t number;
+            if (end - p < (long)sizeof(number)) return -1;
+            memcpy(&number, p, sizeof(number));
+            p += sizeof(number);
+            if (*type == 'f') {
+                double real;
+                memcpy(&real, &number, sizeof(real));
+                spec[spec_len++] = conversion;
+                spec[spec_len] = '\0';
+                APPEND(spec, real);
+            } else {
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = conversion;
+                spec[spec_len] = '\0';
+                APPEND(spec, (long long)number);
+            }
+        }
+        type++;
+    }
+
+    return n < size ? (int)n : (int)size - 1;
+}
+
+// Writes the decimal digits of 'value' at the end of a buffer of 12 and returns where they start
+static char *format_unsigned(unsigned value, char *end) {
+    do {
+        *--end = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    return end;
+}
+
+int log_line_format(unsigned seq, int64_t wall_offset_ns, log_time_cache_t *cache, const void *record,
+                    char *out, size_t size) {
+    log_record_t header;
+    memcpy(&header, record, sizeof(header));
+    time_t timestamp = (header.ns + wall_offset_ns) / 1000000000;
+    if (timestamp != cache->second) {
+        ctime_r(&timestamp, cache->text);
+
+        // Formatting; trimming \n
+        cache->len = strcspn(cache->text, "\n");
+        cache->text[cache->len] = '\0';
+        cache->second = timestamp;
+    }
+
+    // "<seq> - <time> - " without snprintf, which would cost more than the message itself
+    char digits[12];
+    char *seq_str = format_unsigned(seq, digits + sizeof(digits));
+    size_t seq_len = digits + sizeof(digits) - seq_str;
+    size_t n = seq_len + 3 + cache->len + 3;
+    if (n >= size) return -1;
+    memcpy(out, seq_str, seq_len);
+    memcpy(out + seq_len, " - ", 3);
+    memcpy(out + seq_len + 3, cache->text, cache->len);
+    memcpy(out + seq_len + 3 + cache->len, " - ", 3);
+
+    int len = log_record_format(record, out + n, size - n - 1);
+    if (len < 0) return -1;
+    n += len;
+    out[n++] = '\n';
+    out[n] = '\0';
+    return n;
+}
+
+/* NAMES */
+
+const char *log_category_name(log_category_t category) {
+    return category < LOG_CATEGORY_COUNT ? category_names[category] : "unknown";
+}
+
+static int find_name(const char **names, int count, const char *name, size_t len) {
+    for (int i = 0; i < count; i++) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+int log_category_by_name(const char *name, size_t len) {
+    return find_name(category_names, LOG_CATEGORY_COUNT, name, len);
+}
+
+int log_level_by_name(const char *name, size_t len) {
+    return find_name(level_names, sizeof(level_names) / sizeof(level_names[0]), name, len);
+}
@@ -0,0 +1,185 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_LOG_H_
+#define _SENSOR_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+
+// Log levels, from least to most important
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4         /**< only as a minimum level: log nothing */
+
+/*
+ * Log categories, with the number of events per second each lets through by default (0: all).
+ * The limits of busy categories keep a flood of connections or inserts from flooding the log.
+ */
+#define LOG_CATEGORIES(X) \
+    X(LOG_CAT_GENERAL,  "general",  0) \
+    X(LOG_CAT_CONN,     "conn",     200) \
+    X(LOG_CAT_ALERT,    "alert",    0) \
+    X(LOG_CAT_SENSOR,   "sensor",   0) \
+    X(LOG_CAT_STORAGE,  "storage",  100) \
+    X(LOG_CAT_LOGGER,   "logger",   0) \
+    X(LOG_CAT_LATENCY,  "latency",  0)
+
+#define LOG_CATEGORY_ID(name, text, rate) name,
+typedef enum log_category {
+    LOG_CATEGORIES(LOG_CATEGORY_ID)
+    LOG_CATEGORY_COUNT
+} log_category_t;
+#undef LOG_CATEGORY_ID
+
+/*
+ * Log events. Instead of formatting a message, a thread that logs sends a binary record holding the
+ * event, a CLOCK_MONOTONIC timestamp and the raw arguments; the format string below is only applied
+ * in the logger process (or by log_decode, for a binary log file).
+ * Arguments are given by letter, and log_event() must be called with exactly these types:
+ *   'i' int, 'l' long long, 'f' double, 's' const char * (copied into the record)
+ * Integer conversions in the format may use any length modifier; the value is printed as long long.
+ */
+#define LOG_EVENTS(X) \
+    X(LOG_MESSAGE,          LOG_LEVEL_INFO,  LOG_CAT_GENERAL, "s",    "%s") \
+    X(LOG_MESSAGES_DROPPED, LOG_LEVEL_WARN,  LOG_CAT_LOGGER,  "l",    "%lld log messages were dropped because the log ring was full") \
+    X(LOG_PIPE_DAMAGED,     LOG_LEVEL_WARN,  LOG_CAT_LOGGER,  "l",    "Skipped %lld damaged bytes in the log pipe") \
+    X(LOG_SUPPRESSED,       LOG_LEVEL_INFO,  LOG_CAT_LOGGER,  "slll", "Suppressed %s events in the last %lld s: %lld below the log level, %lld over the rate limit") \
+    X(LOG_ROTATED,          LOG_LEVEL_INFO,  LOG_CAT_LOGGER,  "s",    "Log rotated; earlier messages are in %s") \
+    X(LOG_CONN_OPENED,      LOG_LEVEL_INFO,  LOG_CAT_CONN,    "i",    "Sensor node %u has opened a new connection") \
+    X(LOG_CONN_CLOSED,      LOG_LEVEL_INFO,  LOG_CAT_CONN,    "i",    "Sensor node %u has closed the connection") \
+    X(LOG_TOO_HOT,          LOG_LEVEL_WARN,  LOG_CAT_ALERT,   "if",   "Sensor node %u reports it's too hot (avg temp = %f)") \
+    X(LOG_TOO_COLD,         LOG_LEVEL_WARN,  LOG_CAT_ALERT,   "if",   "Sensor node %u reports it's too cold (avg temp = %f)") \
+    X(LOG_STILL_TOO_HOT,    LOG_LEVEL_WARN,  LOG_CAT_ALERT,   "ilf",  "Sensor node %u is still too hot after %lld s (avg temp = %f)") \
+    X(LOG_STILL_TOO_COLD,   LOG_LEVEL_WARN,  LOG_CAT_ALERT,   "ilf",  "Sensor node %u is still too cold after %lld s (avg temp = %f)") \
+    X(LOG_BACK_TO_NORMAL,   LOG_LEVEL_INFO,  LOG_CAT_ALERT,   "if",   "Sensor node %u is back to normal (avg temp = %f)") \
+    X(LOG_SENSOR_SILENT,    LOG_LEVEL_WARN,  LOG_CAT_SENSOR,  "ili",  "Sensor node %u is silent: no reading for %lld s (%d report intervals)") \
+    X(LOG_SENSOR_RESUMED,   LOG_LEVEL_INFO,  LOG_CAT_SENSOR,  "il",   "Sensor node %u is reporting again after %lld s of silence") \
+    X(LOG_INVALID_SENSOR,   LOG_LEVEL_WARN,  LOG_CAT_SENSOR,  "i",    "Received sensor data with invalid sensor node ID %u") \
+    X(LOG_MAP_RELOADED,     LOG_LEVEL_INFO,  LOG_CAT_SENSOR,  "ii",   "Reloaded sensor map with %d sensors (generation %u)") \
+    X(LOG_MAP_RELOAD_FAILED, LOG_LEVEL_WARN, LOG_CAT_SENSOR,  "s",    "Could not reload %s, keeping the current sensor map") \
+    X(LOG_MAP_APPLIED,      LOG_LEVEL_INFO,  LOG_CAT_SENSOR,  "iii",  "Applied sensor map generation %u (%d added, %d removed)") \
+    X(LOG_CKPT_RESTORED,    LOG_LEVEL_INFO,  LOG_CAT_SENSOR,  "il",   "Restored state of %d sensors from checkpoint written at %lld") \
+    X(LOG_CKPT_INVALID,     LOG_LEVEL_WARN,  LOG_CAT_SENSOR,  "s",    "Ignoring invalid datamgr checkpoint %s") \
+    X(LOG_CKPT_FAILED,      LOG_LEVEL_ERROR, LOG_CAT_SENSOR,  "s",    "Could not write datamgr checkpoint %s") \
+    X(LOG_DB_INSERTED,      LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "ii",   "Data insertion of %d readings from %d sensors succeeded") \
+    X(LOG_DB_INSERTED_INTO, LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "iis",  "Data insertion of %d readings from %d sensors into %s succeeded") \
+    X(LOG_DB_INSERT_FAILED, LOG_LEVEL_ERROR, LOG_CAT_STORAGE, "iis",  "Data insertion of %d readings from %d sensors into %s failed") \
+    X(LOG_DB_SYNC_FAILED,   LOG_LEVEL_ERROR, LOG_CAT_STORAGE, "s",    "Could not sync %s to disk") \
+    X(LOG_DB_CREATED,       LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "A new %s file has been created.") \
+    X(LOG_DB_CLOSED,        LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "The %s file has been closed") \
+    X(LOG_DB_NO_INDEX,      LOG_LEVEL_WARN,  LOG_CAT_STORAGE, "ss",   "Could not create %s, queries will scan all of %s") \
+    X(LOG_DB_NO_IO_URING,   LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "io_uring is not in use, %s is written by a writer thread") \
+    X(LOG_DB_PARTITIONED,   LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "is",   "Storage partitioned over %d writers, see %s") \
+    X(LOG_DB_NO_MANIFEST,   LOG_LEVEL_ERROR, LOG_CAT_STORAGE, "s",    "Could not write %s") \
+    X(LOG_SEGMENT_CREATED,  LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "A new segment %s has been created.") \
+    X(LOG_SEGMENT_DELETED,  LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "Deleted segment %s (past retention)") \
+    X(LOG_SEGMENT_COMPRESSED, LOG_LEVEL_INFO, LOG_CAT_STORAGE, "sll", "Compressed segment %s (%lld -> %lld bytes)") \
+    X(LOG_SEGMENT_COMPRESS_FAILED, LOG_LEVEL_WARN, LOG_CAT_STORAGE, "s", "Could not compress segment %s") \
+    X(LOG_SEGMENTS_CLOSED,  LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "The segment directory %s has been closed") \
+    X(LOG_SEGMENT_CLOSE_FAILED, LOG_LEVEL_ERROR, LOG_CAT_STORAGE, "s", "Could not close the last segment in %s") \
+    X(LOG_SQLITE_OPENED,    LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "The %s database has been opened.") \
+    X(LOG_SQLITE_CLOSED,    LOG_LEVEL_INFO,  LOG_CAT_STORAGE, "s",    "The %s database has been closed") \
+    X(LOG_SQLITE_ERROR,     LOG_LEVEL_ERROR, LOG_CAT_STORAGE, "ss",   "SQLite error while %s: %s") \
+    X(LOG_CACHE_SERVING,    LOG_LEVEL_INFO,  LOG_CAT_GENERAL, "is",   "Recent-history cache of %d readings per sensor serving on %s") \
+    X(LOG_CACHE_FAILED,     LOG_LEVEL_ERROR, LOG_CAT_GENERAL, "s",    "Could not start the recent-history cache on %s") \
+    X(LOG_CACHE_FULL,       LOG_LEVEL_WARN,  LOG_CAT_GENERAL, "i",    "The recent-history cache is full, sensor %d is not cached") \
+    X(LOG_LATENCY,          LOG_LEVEL_INFO,  LOG_CAT_LATENCY, "slffffff", "Latency to %s of %lld readings: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, p99.99 %.1f us, max %.1f us")
+
+#define LOG_EVENT_ID(name, level, category, args, format) name,
+typedef enum log_event {
+    LOG_EVENTS(LOG_EVENT_ID)
+    LOG_EVENT_COUNT
+} log_event_t;
+#undef LOG_EVENT_ID
+
+// <event>_LEVEL and <event>_CATEGORY as constants, so log_event() can leave out disabled events at compile time
+#define LOG_EVENT_TRAITS(name, level, category, args, format) name##_LEVEL = level, name##_CATEGORY = category,
+enum log_event_traits {
+    LOG_EVENTS(LOG_EVENT_TRAITS)
+};
+#undef LOG_EVENT_TRAITS
+
+// Largest record; longer string arguments are cut off
+#ifndef LOG_RECORD_MAX
+#define LOG_RECORD_MAX 1024
+#endif
+
+typedef struct log_record {
+    uint16_t event;
+    uint16_t size;          /**< bytes in the record, this header included */
+    uint32_t reserved;
+    int64_t ns;             /**< CLOCK_MONOTONIC when the event was logged */
+    // Arguments follow, unaligned: 8 bytes per number, strings as a uint16_t length and the bytes
+} log_record_t;
+
+/*
+ * Binary log file: this header followed by the records as they arrived. The offset turns the
+ * records' monotonic timestamps into wall-clock time.
+ */
+#define LOG_FILE_MAGIC "SLOG1"
+
+typedef struct log_file_header {
+    char magic[8];
+    int64_t wall_offset_ns;     /**< CLOCK_REALTIME - CLOCK_MONOTONIC when the file was created */
+} log_file_header_t;
+
+/**
+ * Builds the record of an event in 'buf', stamped with the current monotonic time
+ * \return the size of the record
+ */
+int log_record_encode(void *buf, size_t size, log_event_t event, ...);
+int log_record_vencode(void *buf, size_t size, log_event_t event, va_list args);
+
+/**
+ * Checks that 'len' bytes start with a complete record
+ * \return the size of the record, 0 if more bytes are needed, or -1 if it is not a valid record
+ */
+int log_record_size(const void *buf, size_t len);
+
+/**
+ * Formats the message of a record, without a newline
+ * \return the length of the message (cut off at 'size' - 1), or -1 if the record is damaged
+ */
+int log_record_format(const void *record, char *out, size_t size);
+
+// The time text of the last second a line was formatted for; lines within that second reuse it
+typedef struct log_time_cache {
+    time_t second;          /**< -1 before the first line */
+    int len;
+    char text[32];
+} log_time_cache_t;
+
+/**
+ * Formats a whole gateway.log line, "<seq> - <time> - <message>\n"
+ * \param wall_offset_ns CLOCK_REALTIME - CLOCK_MONOTONIC of the process that logged the record
+ * \param cache the time text of the previous line, updated when the second changes
+ * \return the length of the line, or -1 if the record is damaged
+ */
+int log_line_format(unsigned seq, int64_t wall_offset_ns, log_time_cache_t *cache, const void *record,
+                    char *out, size_t size);
+
+/**
+ * CLOCK_REALTIME - CLOCK_MONOTONIC, in nanoseconds
+ */
+int64_t log_wall_offset_ns();
+
+/**
+ * Name of a category ("conn", ...) and the category of a name
+ * \return the category, or -1 if there is none by that name
+ */
+const char *log_category_name(log_category_t category);
+int log_category_by_name(const char *name, size_t len);
+
+/**
+ * Level of a name: "debug", "info", "warn", "error" or "off"
+ * \return the level, or -1 if there is none by that name
+ */
+int log_level_by_name(const char *name, size_t len);
+
+#endif /* _SENSOR_LOG_H_ */
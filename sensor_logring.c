@@ -0,0 +1,197 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "sensor_logring.h"
+
+#define SLOT_DATA (LOG_RING_SLOT_SIZE - 16)
+
+/*
+ * A message starting at position 'pos' takes the slots pos, pos + 1, ... (modulo LOG_RING_SLOTS).
+ * Its first slot holds the length and is published last, by setting 'seq' to pos + 1; the reader
+ * only ever looks at first slots, so the other slots need no flag of their own. Positions only
+ * grow, so a slot left over from an earlier round never looks published.
+ */
+typedef struct slot {
+    atomic_ullong seq;
+    uint32_t len;
+    uint32_t reserved;
+    char data[SLOT_DATA];
+} slot_t;
+
+_Static_assert(sizeof(slot_t) == LOG_RING_SLOT_SIZE, "slots are laid out by hand");
+
+struct log_ring {
+    // Written by the writers
+    _Alignas(64) atomic_ullong head;        // next position to claim
+    atomic_ullong dropped;
+    atomic_uint writers_waiting;            // writers waiting for room
+    // Written by the reader
+    _Alignas(64) atomic_ullong tail;        // position of the next message to read
+    atomic_uint space_seq;                  // futex: bumped when room is made for waiting writers
+    atomic_uint reader_sleeping;
+    // Rarely written
+    _Alignas(64) atomic_uint data_seq;      // futex: bumped to wake the reader
+    atomic_uint closed;
+    _Alignas(64) slot_t slots[LOG_RING_SLOTS];
+};
+
+// No FUTEX_PRIVATE_FLAG: the words are shared with the logger process
+static void futex_wait(atomic_uint *word, unsigned value, const struct timespec *timeout) {
+    syscall(SYS_futex, word, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static size_t slots_for(size_t len) {
+    return len <= SLOT_DATA ? 1 : (len + SLOT_DATA - 1) / SLOT_DATA;
+}
+
+static long long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+log_ring_t *log_ring_create() {
+    // Anonymous shared memory starts zeroed, which is an empty ring
+    log_ring_t *ring = mmap(NULL, sizeof(log_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return ring == MAP_FAILED ? NULL : ring;
+}
+
+// Waits for the reader to make room. Returns false once the ring is closed or the wait took too long.
+static bool wait_for_room(log_ring_t *ring, size_t n, const struct timespec *start) {
+    atomic_fetch_add(&ring->writers_waiting, 1);
+    unsigned seq = atomic_load(&ring->space_seq);
+    unsigned long long head = atomic_load(&ring->head);
+    bool full = head + n - atomic_load(&ring->tail) > LOG_RING_SLOTS;
+    if (full && !atomic_load(&ring->closed)) {
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000000};
+        futex_wait(&ring->space_seq, seq, &pause);
+    }
+    atomic_fetch_sub(&ring->writers_waiting, 1);
+    return !atomic_load(&ring->closed) && elapsed_ms(start) < LOG_RING_FULL_TIMEOUT_MS;
+}
+
+int log_ring_write(log_ring_t *ring, const char *msg, size_t len) {
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed)) return LOG_RING_FAILURE;
+    if (len > LOG_RING_MAX_MESSAGE) len = LOG_RING_MAX_MESSAGE;
+    size_t n = slots_for(len);
+
+    // Claim n slots, as long as the reader is done with them
+    struct timespec start = {0, 0};
+    unsigned long long pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (true) {
+        unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (pos + n - tail > LOG_RING_SLOTS) {
+            if (start.tv_sec == 0 && start.tv_nsec == 0) clock_gettime(CLOCK_MONOTONIC, &start);
+            if (!wait_for_room(ring, n, &start)) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return LOG_RING_FAILURE;
+            }
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + n, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    // The rest of the message first, then the first slot, which publishes it
+    for (size_t i = 1; i < n; i++) {
+        size_t off = i * SLOT_DATA, chunk = len - off < SLOT_DATA ? len - off : SLOT_DATA;
+        memcpy(ring->slots[(pos + i) % LOG_RING_SLOTS].data, msg + off, chunk);
+    }
+    slot_t *first = &ring->slots[pos % LOG_RING_SLOTS];
+    first->len = len;
+    memcpy(first->data, msg, len < SLOT_DATA ? len : SLOT_DATA);
+    atomic_store_explicit(&first->seq, pos + 1, memory_order_release);
+
+    // Pairs with the fence in log_ring_read: either the reader sees the message or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->reader_sleeping, memory_order_relaxed)) {
+        atomic_fetch_add(&ring->data_seq, 1);
+        futex_wake(&ring->data_seq, 1);
+    }
+    return LOG_RING_SUCCESS;
+}
+
+int log_ring_read(log_ring_t *ring, void (*callback)(const char *msg, size_t len, void *arg), void *arg,
+                  int timeout_ms) {
+    static char msg[LOG_RING_MAX_MESSAGE];
+    int count = 0;
+    bool waited = false;
+
+    while (count < LOG_RING_BATCH) {
+        unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        slot_t *first = &ring->slots[tail % LOG_RING_SLOTS];
+
+        if (atomic_load_explicit(&first->seq, memory_order_acquire) == tail + 1) {
+            size_t len = first->len, n = slots_for(len);
+            for (size_t i = 0; i < n; i++) {
+                size_t off = i * SLOT_DATA, chunk = len - off < SLOT_DATA ? len - off : SLOT_DATA;
+                memcpy(msg + off, ring->slots[(tail + i) % LOG_RING_SLOTS].data, chunk);
+            }
+            atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+            callback(msg, len, arg);
+            count++;
+            continue;
+        }
+
+        // Hand over what there is before going to sleep
+        if (count > 0) break;
+        if (atomic_load(&ring->closed)) return LOG_RING_FAILURE;
+        if (waited && timeout_ms >= 0) return 0;
+
+        unsigned seq = atomic_load(&ring->data_seq);
+        atomic_store(&ring->reader_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&first->seq, memory_order_acquire) != tail + 1 && !atomic_load(&ring->closed)) {
+            struct timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+            futex_wait(&ring->data_seq, seq, timeout_ms >= 0 ? &timeout : NULL);
+            waited = true;
+        }
+        atomic_store(&ring->reader_sleeping, 0);
+    }
+
+    // Writers waiting for room are woken once per batch, not once per message
+    atomic_thread_fence(memory_order_seq_cst);
+    if (count > 0 && atomic_load_explicit(&ring->writers_waiting, memory_order_relaxed)) {
+        atomic_fetch_add(&ring->space_seq, 1);
+        futex_wake(&ring->space_seq, INT_MAX);
+    }
+    return count;
+}
+
+uint64_t log_ring_dropped(log_ring_t *ring) {
+    return atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+}
+
+void log_ring_close(log_ring_t *ring) {
+    atomic_store(&ring->closed, 1);
+    atomic_fetch_add(&ring->data_seq, 1);
+    futex_wake(&ring->data_seq, 1);
+    atomic_fetch_add(&ring->space_seq, 1);
+    futex_wake(&ring->space_seq, INT_MAX);
+}
+
+void log_ring_free(log_ring_t **ring) {
+    if (ring == NULL || *ring == NULL) return;
+    munmap(*ring, sizeof(log_ring_t));
+    *ring = NULL;
+}
@@ -0,0 +1,85 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_LOGRING_H_
+#define _SENSOR_LOGRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_FAILURE -1
+#define LOG_RING_SUCCESS 0
+
+// Slots in the ring and their size. A message takes one slot per LOG_RING_SLOT_SIZE - 16 bytes.
+#ifndef LOG_RING_SLOTS
+#define LOG_RING_SLOTS 8192
+#endif
+
+#ifndef LOG_RING_SLOT_SIZE
+#define LOG_RING_SLOT_SIZE 128
+#endif
+
+// Longer messages are cut off
+#ifndef LOG_RING_MAX_MESSAGE
+#define LOG_RING_MAX_MESSAGE 1024
+#endif
+
+// How long a writer waits for room in a full ring before its message is dropped
+#ifndef LOG_RING_FULL_TIMEOUT_MS
+#define LOG_RING_FULL_TIMEOUT_MS 1000
+#endif
+
+// Messages handed to the reader per call of log_ring_read()
+#ifndef LOG_RING_BATCH
+#define LOG_RING_BATCH 256
+#endif
+
+_Static_assert((LOG_RING_SLOTS & (LOG_RING_SLOTS - 1)) == 0, "LOG_RING_SLOTS must be a power of two");
+_Static_assert(LOG_RING_MAX_MESSAGE / (LOG_RING_SLOT_SIZE - 16) + 1 <= LOG_RING_SLOTS, "a message must fit in the ring");
+
+typedef struct log_ring log_ring_t;
+
+/**
+ * Maps a new ring of log messages in shared memory
+ * Any number of threads write to it; one reader drains it. Created before fork(), it is shared
+ * between parent and child. Writers claim slots with an atomic compare-and-swap and only make a
+ * system call to wake up the reader when it is asleep; the reader sleeps on a process-shared futex.
+ * \return the ring, or NULL if it could not be mapped
+ */
+log_ring_t *log_ring_create();
+
+/**
+ * Copies a message into the ring
+ * When the ring is full, waits up to LOG_RING_FULL_TIMEOUT_MS for the reader to make room.
+ * \return LOG_RING_SUCCESS, or LOG_RING_FAILURE if the ring is closed or the message was dropped
+ */
+int log_ring_write(log_ring_t *ring, const char *msg, size_t len);
+
+/**
+ * Waits for messages and passes up to LOG_RING_BATCH of them to 'callback', in the order they were
+ * written. The message is not terminated and is only valid during the call. Single reader only.
+ * \param timeout_ms how long to wait for a message, -1 to wait until one arrives
+ * \return the number of messages, 0 if none arrived in time, or LOG_RING_FAILURE once the ring is
+ * closed and empty
+ */
+int log_ring_read(log_ring_t *ring, void (*callback)(const char *msg, size_t len, void *arg), void *arg,
+                  int timeout_ms);
+
+/**
+ * Messages dropped so far because the ring stayed full
+ */
+uint64_t log_ring_dropped(log_ring_t *ring);
+
+/**
+ * Tells the reader no more messages follow; it returns LOG_RING_FAILURE once it has read the rest
+ */
+void log_ring_close(log_ring_t *ring);
+
+/**
+ * Unmaps the ring in the calling process
+ * \param ring a double pointer to the ring, set to NULL
+ */
+void log_ring_free(log_ring_t **ring);
+
+#endif /* _SENSOR_LOGRING_H_ */
@@ -0,0 +1,218 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "sensor_logrotate.h"
+
+// A rotated log the background thread still has to close
+typedef struct closing {
+    async_writer_t *writer;
+    int fd;
+    struct closing *next;
+} closing_t;
+
+struct log_rotator {
+    char path[256];
+    char dir[256];
+    const char *base;           // file name of the log within 'dir'
+    long next;                  // number of the next rotated file
+    long retired;               // newest rotated file whose writer was handed over, guarded by 'mutex'
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    closing_t *closing;         // guarded by 'mutex'
+    bool stop;
+};
+
+// Number of a rotated log "<base>.<n>" or "<base>.<n>.gz", -1 for any other file
+static long rotated_number(const log_rotator_t *rotator, const char *name, bool *compressed) {
+    size_t len = strlen(rotator->base);
+    if (strncmp(name, rotator->base, len) != 0 || name[len] != '.') return -1;
+
+    char *end;
+    long n = strtol(name + len + 1, &end, 10);
+    if (end == name + len + 1 || n < 0) return -1;
+    *compressed = strcmp(end, ".gz") == 0;
+    return *compressed || *end == '\0' ? n : -1;
+}
+
+/* BACKGROUND THREAD */
+
+static int compress_file(const char *path) {
+    char tmp[300], gz[300];
+    snprintf(tmp, sizeof(tmp), "%s.gz.tmp", path);
+    snprintf(gz, sizeof(gz), "%s.gz", path);
+
+    FILE *in = fopen(path, "rb");
+    if (!in) return LOG_ROTATE_FAILURE;
+    gzFile out = gzopen(tmp, "wb6");
+    if (!out) {
+        fclose(in);
+        return LOG_ROTATE_FAILURE;
+    }
+
+    char buf[64 * 1024];
+    size_t n;
+    int result = LOG_ROTATE_SUCCESS;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (gzwrite(out, buf, n) != (int)n) {
+            result = LOG_ROTATE_FAILURE;
+            break;
+        }
+    }
+    if (ferror(in)) result = LOG_ROTATE_FAILURE;
+    fclose(in);
+    if (gzclose(out) != Z_OK) result = LOG_ROTATE_FAILURE;
+
+    // The original goes only once the compressed copy is complete
+    if (result == LOG_ROTATE_SUCCESS && rename(tmp, gz) == 0) {
+        unlink(path);
+        return LOG_ROTATE_SUCCESS;
+    }
+    unlink(tmp);
+    return LOG_ROTATE_FAILURE;
+}
+
+// Compress closed rotated logs and delete all but the newest LOG_ROTATE_KEEP
+static void maintain(log_rotator_t *rotator, long newest) {
+    DIR *dir = opendir(rotator->dir);
+    if (!dir) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        bool compressed;
+        long n = rotated_number(rotator, entry->d_name, &compressed);
+        if (n < 0 || n > newest) continue;
+
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", rotator->dir, entry->d_name);
+        if (n <= newest - LOG_ROTATE_KEEP) {
+            unlink(path);
+        } else if (LOG_ROTATE_COMPRESS && !compressed) {
+            compress_file(path);
+        }
+    }
+    closedir(dir);
+}
+
+static void *run_rotator(void *arg) {
+    log_rotator_t *rotator = arg;
+
+    // Only use CPU time nobody else wants, so logging is never slowed down
+    struct sched_param param = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pthread_mutex_lock(&rotator->mutex);
+    while (true) {
+        while (!rotator->closing && !rotator->stop) pthread_cond_wait(&rotator->cond, &rotator->mutex);
+        if (!rotator->closing && rotator->stop) break;
+
+        closing_t *closing = rotator->closing;
+        rotator->closing = NULL;
+        long newest = rotator->retired;
+        pthread_mutex_unlock(&rotator->mutex);
+
+        // Closing waits for the writes still in flight
+        while (closing) {
+            closing_t *next = closing->next;
+            async_writer_close(&closing->writer, false);
+            close(closing->fd);
+            free(closing);
+            closing = next;
+        }
+        maintain(rotator, newest);
+
+        pthread_mutex_lock(&rotator->mutex);
+    }
+    pthread_mutex_unlock(&rotator->mutex);
+    return NULL;
+}
+
+/* ROTATION */
+
+log_rotator_t *log_rotator_start(const char *path) {
+    log_rotator_t *rotator = calloc(1, sizeof(*rotator));
+    if (!rotator) return NULL;
+
+    snprintf(rotator->path, sizeof(rotator->path), "%s", path);
+    const char *slash = strrchr(rotator->path, '/');
+    if (slash) {
+        snprintf(rotator->dir, sizeof(rotator->dir), "%.*s", (int)(slash - rotator->path), rotator->path);
+        rotator->base = slash + 1;
+    } else {
+        strcpy(rotator->dir, ".");
+        rotator->base = rotator->path;
+    }
+
+    // Carry on after the rotated logs of earlier runs
+    DIR *dir = opendir(rotator->dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        bool compressed;
+        long n = rotated_number(rotator, entry->d_name, &compressed);
+        if (n >= rotator->next) rotator->next = n + 1;
+    }
+    if (dir) closedir(dir);
+    if (rotator->next == 0) rotator->next = 1;
+
+    pthread_mutex_init(&rotator->mutex, NULL);
+    pthread_cond_init(&rotator->cond, NULL);
+    if (pthread_create(&rotator->thread, NULL, run_rotator, rotator) != 0) {
+        pthread_mutex_destroy(&rotator->mutex);
+        pthread_cond_destroy(&rotator->cond);
+        free(rotator);
+        return NULL;
+    }
+    return rotator;
+}
+
+int log_rotator_rotate(log_rotator_t *rotator, char *rotated, size_t size) {
+    pthread_mutex_lock(&rotator->mutex);
+    snprintf(rotated, size, "%s.%ld", rotator->path, rotator->next);
+    int result = LOG_ROTATE_FAILURE;
+    if (rename(rotator->path, rotated) == 0) {
+        rotator->next++;
+        result = LOG_ROTATE_SUCCESS;
+    }
+    pthread_mutex_unlock(&rotator->mutex);
+    return result;
+}
+
+int log_rotator_retire(log_rotator_t *rotator, async_writer_t *writer, int fd) {
+    closing_t *closing = malloc(sizeof(*closing));
+    if (!closing) return LOG_ROTATE_FAILURE;
+
+    pthread_mutex_lock(&rotator->mutex);
+    *closing = (closing_t){.writer = writer, .fd = fd, .next = rotator->closing};
+    rotator->closing = closing;
+    rotator->retired = rotator->next - 1;
+    pthread_cond_signal(&rotator->cond);
+    pthread_mutex_unlock(&rotator->mutex);
+    return LOG_ROTATE_SUCCESS;
+}
+
+void log_rotator_stop(log_rotator_t **rotator) {
+    if (rotator == NULL || *rotator == NULL) return;
+
+    pthread_mutex_lock(&(*rotator)->mutex);
+    (*rotator)->stop = true;
+    pthread_cond_signal(&(*rotator)->cond);
+    pthread_mutex_unlock(&(*rotator)->mutex);
+    pthread_join((*rotator)->thread, NULL);
+
+    pthread_mutex_destroy(&(*rotator)->mutex);
+    pthread_cond_destroy(&(*rotator)->cond);
+    free(*rotator);
+    *rotator = NULL;
+}
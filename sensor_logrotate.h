@@ -0,0 +1,57 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_LOGROTATE_H_
+#define _SENSOR_LOGROTATE_H_
+
+#include <stdbool.h>
+
+#include "sensor_aio.h"
+
+#define LOG_ROTATE_FAILURE -1
+#define LOG_ROTATE_SUCCESS 0
+
+// Rotated logs kept; older ones are deleted
+#ifndef LOG_ROTATE_KEEP
+#define LOG_ROTATE_KEEP 8
+#endif
+
+// Compress rotated logs to '<log>.<n>.gz'
+#ifndef LOG_ROTATE_COMPRESS
+#define LOG_ROTATE_COMPRESS 1
+#endif
+
+typedef struct log_rotator log_rotator_t;
+
+/**
+ * Starts the rotation of a log file
+ * Rotated files are named '<path>.<n>', with n counting on from the last rotated file already there.
+ * A background thread at idle priority closes them, compresses them with zlib and deletes all but
+ * the newest LOG_ROTATE_KEEP, so rotating never waits for the disk.
+ * \return the rotator, or NULL if its thread could not be started
+ */
+log_rotator_t *log_rotator_start(const char *path);
+
+/**
+ * Renames the log to its next rotated name. Writes still in flight follow the file there; the caller
+ * then opens a new log at 'path' and hands the old one over with log_rotator_retire().
+ * \param rotated filled in with the new name of the log
+ * \return LOG_ROTATE_SUCCESS, or LOG_ROTATE_FAILURE if the log could not be renamed
+ */
+int log_rotator_rotate(log_rotator_t *rotator, char *rotated, size_t size);
+
+/**
+ * Hands the writer and file descriptor of a rotated log to the background thread, which closes them
+ * \return LOG_ROTATE_SUCCESS, or LOG_ROTATE_FAILURE if they could not be queued; they are then still
+ * the caller's
+ */
+int log_rotator_retire(log_rotator_t *rotator, async_writer_t *writer, int fd);
+
+/**
+ * Finishes the work handed to the background thread and stops it
+ * \param rotator a double pointer to the rotator, set to NULL
+ */
+void log_rotator_stop(log_rotator_t **rotator);
+
+#endif /* _SENSOR_LOGROTATE_H_ */
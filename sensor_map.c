@@ -0,0 +1,283 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sensor_map.h"
+#include "sensor_db.h"
+
+// The map that readers currently see
+static _Atomic(sensor_map_t *) current_map = NULL;
+
+// Generation each registered reader last picked up, 0 if the slot is free
+static atomic_uint reader_generation[SENSOR_MAP_MAX_READERS];
+
+// Maps that were replaced but may still be in use by a reader
+static sensor_map_t *retired = NULL;
+
+static char *map_path = NULL;
+static pthread_t reloader_thread;
+static atomic_bool reloader_stop = false;
+
+// Make room for at least one more entry in every column of the map
+static bool grow(sensor_map_t *map, int *capacity) {
+    if (map->size < *capacity) return true;
+
+    int new_capacity = *capacity ? *capacity * 2 : 64;
+    sensor_id_t *ids = realloc(map->sensor_ids, new_capacity * sizeof(*ids));
+    if (ids) map->sensor_ids = ids;
+    uint16_t *rooms = realloc(map->room_ids, new_capacity * sizeof(*rooms));
+    if (rooms) map->room_ids = rooms;
+    sensor_value_t *mins = realloc(map->min_temps, new_capacity * sizeof(*mins));
+    if (mins) map->min_temps = mins;
+    sensor_value_t *maxs = realloc(map->max_temps, new_capacity * sizeof(*maxs));
+    if (maxs) map->max_temps = maxs;
+
+    if (!ids || !rooms || !mins || !maxs) return false;
+    *capacity = new_capacity;
+    return true;
+}
+
+sensor_map_t *sensor_map_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    sensor_map_t *map = calloc(1, sizeof(*map));
+    // Position of each sensor id in the map plus one, to merge duplicate lines
+    int *position = calloc(UINT16_MAX + 1, sizeof(*position));
+    // Band of each room that has a "room" line, NAN otherwise
+    sensor_value_t (*room_band)[2] = malloc((UINT16_MAX + 1) * sizeof(*room_band));
+    if (!map || !position || !room_band) {
+        fclose(fp);
+        free(position);
+        free(room_band);
+        sensor_map_free(&map);
+        return NULL;
+    }
+    for (int i = 0; i <= UINT16_MAX; i++) room_band[i][0] = room_band[i][1] = NAN;
+
+    int capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+        int sensor_id, room_id;
+        sensor_value_t min_temp, max_temp;
+
+        // room <room id> <min> <max>
+        if (sscanf(p, "room %d %lf %lf", &room_id, &min_temp, &max_temp) == 3) {
+            if (room_id >= 0 && room_id <= UINT16_MAX && min_temp < max_temp) {
+                room_band[room_id][0] = min_temp;
+                room_band[room_id][1] = max_temp;
+            }
+            continue;
+        }
+
+        // <room id> <sensor id> [<min> <max>]
+        int fields = sscanf(p, "%d %d %lf %lf", &room_id, &sensor_id, &min_temp, &max_temp);
+        if (fields != 2 && fields != 4) continue;
+        if (fields != 4 || !(min_temp < max_temp)) min_temp = max_temp = NAN;
+
+        // Sensor id 0 is the end-of-stream marker in the sbuffer
+        if (sensor_id <= 0 || sensor_id > UINT16_MAX || room_id < 0 || room_id > UINT16_MAX) {
+            continue;
+        }
+
+        // A sensor listed twice keeps its first position and takes the last values
+        int i = position[sensor_id] - 1;
+        if (i < 0) {
+            if (!grow(map, &capacity)) {
+                fclose(fp);
+                free(position);
+                free(room_band);
+                sensor_map_free(&map);
+                return NULL;
+            }
+            i = map->size++;
+            position[sensor_id] = map->size;
+        }
+
+        map->sensor_ids[i] = sensor_id;
+        map->room_ids[i] = room_id;
+        map->min_temps[i] = min_temp;
+        map->max_temps[i] = max_temp;
+    }
+
+    // Sensors without a band of their own take their room's, or the compiled-in default
+    for (int i = 0; i < map->size; i++) {
+        if (!isnan(map->min_temps[i])) continue;
+        sensor_value_t *band = room_band[map->room_ids[i]];
+        map->min_temps[i] = isnan(band[0]) ? SET_MIN_TEMP : band[0];
+        map->max_temps[i] = isnan(band[1]) ? SET_MAX_TEMP : band[1];
+    }
+
+    fclose(fp);
+    free(position);
+    free(room_band);
+    return map;
+}
+
+void sensor_map_free(sensor_map_t **map) {
+    if (!map || !*map) return;
+    free((*map)->sensor_ids);
+    free((*map)->room_ids);
+    free((*map)->min_temps);
+    free((*map)->max_temps);
+    free(*map);
+    *map = NULL;
+}
+
+// Frees retired maps that no registered reader can still be holding
+static void reclaim_retired() {
+    unsigned oldest = UINT_MAX;
+    for (int i = 0; i < SENSOR_MAP_MAX_READERS; i++) {
+        unsigned g = atomic_load_explicit(&reader_generation[i], memory_order_acquire);
+        if (g != 0 && g < oldest) oldest = g;
+    }
+
+    sensor_map_t **link = &retired;
+    while (*link) {
+        sensor_map_t *map = *link;
+        if (map->generation < oldest) {
+            *link = map->next;
+            sensor_map_free(&map);
+        } else {
+            link = &map->next;
+        }
+    }
+}
+
+// Swap in a new map; the old one is retired until every reader has moved on
+static void publish(sensor_map_t *map) {
+    sensor_map_t *old = atomic_load_explicit(&current_map, memory_order_relaxed);
+    map->generation = old ? old->generation + 1 : 1;
+    atomic_store_explicit(&current_map, map, memory_order_release);
+
+    if (old) {
+        old->next = retired;
+        retired = old;
+    }
+}
+
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void *run_reloader(void *arg) {
+    struct stat last, now;
+    bool have_last = stat(map_path, &last) == 0;
+
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    struct timespec poll = {.tv_sec = SENSOR_MAP_POLL_INTERVAL, .tv_nsec = 0};
+
+    while (!atomic_load(&reloader_stop)) {
+        bool reload = sigtimedwait(&hup, NULL, &poll) == SIGHUP;
+        if (atomic_load(&reloader_stop)) break;
+
+        if (stat(map_path, &now) == 0) {
+            if (!have_last || !same_file(&last, &now)) reload = true;
+            last = now;
+            have_last = true;
+        }
+
+        if (reload) {
+            // Parsing happens here, off the ingest path
+            sensor_map_t *map = sensor_map_load(map_path);
+            if (map) {
+                publish(map);
+                log_event(LOG_MAP_RELOADED, map->size, (int)map->generation);
+            } else {
+                log_event(LOG_MAP_RELOAD_FAILED, map_path);
+            }
+        }
+
+        reclaim_retired();
+    }
+
+    return NULL;
+}
+
+int sensor_map_start(const char *path) {
+    sensor_map_t *map = sensor_map_load(path);
+    if (!map) return SENSOR_MAP_FAILURE;
+
+    map_path = strdup(path);
+    if (!map_path) {
+        sensor_map_free(&map);
+        return SENSOR_MAP_FAILURE;
+    }
+    publish(map);
+
+    atomic_store(&reloader_stop, false);
+    if (pthread_create(&reloader_thread, NULL, run_reloader, NULL) != 0) {
+        free(map_path);
+        map_path = NULL;
+        return SENSOR_MAP_FAILURE;
+    }
+
+    return SENSOR_MAP_SUCCESS;
+}
+
+void sensor_map_stop() {
+    if (!map_path) return;
+
+    atomic_store(&reloader_stop, true);
+    pthread_kill(reloader_thread, SIGHUP);
+    pthread_join(reloader_thread, NULL);
+
+    sensor_map_t *map = atomic_exchange(&current_map, NULL);
+    sensor_map_free(&map);
+    while (retired) {
+        map = retired;
+        retired = map->next;
+        sensor_map_free(&map);
+    }
+
+    free(map_path);
+    map_path = NULL;
+}
+
+int sensor_map_register_reader() {
+    // Claim the oldest generation so nothing is reclaimed before the first sensor_map_get()
+    for (int i = 0; i < SENSOR_MAP_MAX_READERS; i++) {
+        unsigned expected = 0;
+        if (atomic_compare_exchange_strong(&reader_generation[i], &expected, 1)) {
+            return i;
+        }
+    }
+    return SENSOR_MAP_FAILURE;
+}
+
+void sensor_map_unregister_reader(int reader) {
+    if (reader < 0 || reader >= SENSOR_MAP_MAX_READERS) return;
+    atomic_store_explicit(&reader_generation[reader], 0, memory_order_release);
+}
+
+const sensor_map_t *sensor_map_get(int reader) {
+    sensor_map_t *map = atomic_load_explicit(&current_map, memory_order_acquire);
+
+    // Announce that older maps are no longer used, only when something changed
+    atomic_uint *seen = &reader_generation[reader];
+    if (atomic_load_explicit(seen, memory_order_relaxed) != map->generation) {
+        atomic_store_explicit(seen, map->generation, memory_order_release);
+    }
+
+    return map;
+}
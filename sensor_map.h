@@ -0,0 +1,100 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_MAP_H_
+#define _SENSOR_MAP_H_
+
+#include <stdint.h>
+#include "config.h"
+
+#define SENSOR_MAP_FAILURE -1
+#define SENSOR_MAP_SUCCESS 0
+
+#ifndef SET_MAX_TEMP
+#error SET_MAX_TEMP not set
+#endif
+
+#ifndef SET_MIN_TEMP
+#error SET_MIN_TEMP not set
+#endif
+
+// How often (in seconds) the reloader checks room_sensor.map for changes
+#ifndef SENSOR_MAP_POLL_INTERVAL
+#define SENSOR_MAP_POLL_INTERVAL 1
+#endif
+
+// Maximum number of threads that can read the published map at the same time
+#ifndef SENSOR_MAP_MAX_READERS
+#define SENSOR_MAP_MAX_READERS 8
+#endif
+
+/**
+ * An immutable, parsed copy of room_sensor.map
+ * A published map is never modified; a reload publishes a new one instead.
+ * Entries are stored as structure-of-arrays so whole columns can be scanned with SIMD.
+ */
+typedef struct sensor_map {
+    unsigned generation;        /**< increases by one with every published reload */
+    int size;                   /**< number of entries */
+    sensor_id_t *sensor_ids;    /**< sensor id of entry i */
+    uint16_t *room_ids;         /**< room id of entry i */
+    sensor_value_t *min_temps;  /**< too-cold limit of entry i */
+    sensor_value_t *max_temps;  /**< too-hot limit of entry i */
+    struct sensor_map *next;    /**< link in the list of retired maps */
+} sensor_map_t;
+
+/**
+ * Parses a room/sensor map file. Every line is one of
+ *   <room id> <sensor id>                  sensor with its room's band
+ *   <room id> <sensor id> <min> <max>      sensor with a band of its own
+ *   room <room id> <min> <max>             band for every sensor in a room
+ * Rooms without a band use SET_MIN_TEMP / SET_MAX_TEMP. Lines starting with '#' are ignored.
+ * \param path the file to read
+ * \return a newly allocated map, or NULL if the file could not be read
+ */
+sensor_map_t *sensor_map_load(const char *path);
+
+/**
+ * Frees a map returned by sensor_map_load() and sets '*map' to NULL
+ * \param map a double pointer to the map
+ */
+void sensor_map_free(sensor_map_t **map);
+
+/**
+ * Loads and publishes 'path', then starts the reloader thread
+ * The map is reloaded on SIGHUP or when the file changes on disk. SIGHUP must be blocked
+ * in every thread of the process before this is called, so only the reloader receives it.
+ * \param path the map file to watch
+ * \return SENSOR_MAP_SUCCESS on success, SENSOR_MAP_FAILURE if the initial map could not be loaded
+ */
+int sensor_map_start(const char *path);
+
+/**
+ * Stops the reloader thread and frees every map that was published
+ * No reader may still be registered
+ */
+void sensor_map_stop();
+
+/**
+ * Registers the calling thread as a reader of the published map
+ * \return a reader id to pass to sensor_map_get(), or SENSOR_MAP_FAILURE if all reader slots are taken
+ */
+int sensor_map_register_reader();
+
+/**
+ * Unregisters a reader; maps it obtained may be freed afterwards
+ * \param reader the id returned by sensor_map_register_reader()
+ */
+void sensor_map_unregister_reader(int reader);
+
+/**
+ * Returns the currently published map
+ * The pointer stays valid until the same reader calls sensor_map_get() again or unregisters;
+ * calling it announces that the reader no longer uses any map it got earlier.
+ * \param reader the id returned by sensor_map_register_reader()
+ * \return the current map
+ */
+const sensor_map_t *sensor_map_get(int reader);
+
+#endif /* _SENSOR_MAP_H_ */
@@ -0,0 +1,213 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "sensor_metrics.h"
+#include "sensor_db.h"
+#include "datamgr.h"
+#include "sensor_latency.h"
+#include "sensor_server.h"
+
+_Thread_local metrics_slot_t *metrics_self = NULL;
+
+typedef struct metric_info {
+    const char *name;
+    const char *help;
+    double scale;
+} metric_info_t;
+
+#define METRIC_INFO(name, text, help, scale) {text, help, scale},
+static const metric_info_t metric_info[METRIC_COUNT] = {METRICS(METRIC_INFO)};
+#undef METRIC_INFO
+
+// Consumers of the sbuffer, by id (see sbuffer.h)
+static const char *consumer_names[] = {"datamgr", "storage", "cache"};
+
+// Registered slots, and what the threads that are gone counted
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_slot_t *slots = NULL;
+static uint64_t retired[METRIC_COUNT];
+static uint64_t retired_consumed[SBUFFER_NB_CONSUMERS];
+
+static socket_server_t server;
+
+/* SLOTS */
+
+int metrics_register(const char *kind, long id) {
+    if (metrics_self) return METRICS_SUCCESS;
+
+    // Rounded up to whole cache lines, so no other data shares them
+    size_t size = (sizeof(metrics_slot_t) + 63) / 64 * 64;
+    metrics_slot_t *slot = aligned_alloc(64, size);
+    if (!slot) return METRICS_FAILURE;
+    memset(slot, 0, size);
+    snprintf(slot->kind, sizeof(slot->kind), "%s", kind);
+    slot->id = id;
+
+    pthread_mutex_lock(&slots_mutex);
+    slot->next = slots;
+    slots = slot;
+    pthread_mutex_unlock(&slots_mutex);
+
+    metrics_self = slot;
+    return METRICS_SUCCESS;
+}
+
+void metrics_unregister() {
+    metrics_slot_t *slot = metrics_self;
+    if (!slot) return;
+    metrics_self = NULL;
+
+    pthread_mutex_lock(&slots_mutex);
+    for (metrics_slot_t **p = &slots; *p; p = &(*p)->next) {
+        if (*p == slot) {
+            *p = slot->next;
+            break;
+        }
+    }
+    for (int i = 0; i < METRIC_COUNT; i++) retired[i] += atomic_load_explicit(&slot->values[i], memory_order_relaxed);
+    for (int i = 0; i < SBUFFER_NB_CONSUMERS; i++) {
+        retired_consumed[i] += atomic_load_explicit(&slot->consumed[i], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&slots_mutex);
+
+    free(slot);
+}
+
+/* EXPOSITION */
+
+static void write_header(FILE *out, const char *name, const char *type, const char *help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write(FILE *out) {
+    uint64_t totals[METRIC_COUNT];
+    uint64_t consumed[SBUFFER_NB_CONSUMERS];
+    int connections = 0;
+
+    pthread_mutex_lock(&slots_mutex);
+
+    memcpy(consumed, retired_consumed, sizeof(consumed));
+    for (metrics_slot_t *slot = slots; slot; slot = slot->next) {
+        for (int i = 0; i < SBUFFER_NB_CONSUMERS; i++) {
+            consumed[i] += atomic_load_explicit(&slot->consumed[i], memory_order_relaxed);
+        }
+    }
+    memcpy(totals, retired, sizeof(totals));
+    for (metrics_slot_t *slot = slots; slot; slot = slot->next) {
+        for (int i = 0; i < METRIC_COUNT; i++) totals[i] += atomic_load_explicit(&slot->values[i], memory_order_relaxed);
+    }
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        write_header(out, metric_info[i].name, "counter", metric_info[i].help);
+        if (metric_info[i].scale == 1) {
+            fprintf(out, "%s %llu\n", metric_info[i].name, (unsigned long long)totals[i]);
+        } else {
+            fprintf(out, "%s %.9g\n", metric_info[i].name, totals[i] * metric_info[i].scale);
+        }
+    }
+
+    write_header(out, "gateway_connection_readings_total", "counter", "Readings received per open connection");
+    for (metrics_slot_t *slot = slots; slot; slot = slot->next) {
+        if (strcmp(slot->kind, "connection") != 0) continue;
+        connections++;
+        fprintf(out, "gateway_connection_readings_total{sensor=\"%ld\"} %llu\n", slot->id,
+                (unsigned long long)atomic_load_explicit(&slot->values[METRIC_READINGS_RECEIVED], memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&slots_mutex);
+
+    write_header(out, "gateway_connections_open", "gauge", "Sensor node connections open");
+    fprintf(out, "gateway_connections_open %d\n", connections);
+
+    // A reading stays in the sbuffer until the slowest consumer has read it
+    uint64_t depth = 0;
+    write_header(out, "gateway_sbuffer_consumer_lag", "gauge", "Readings in the sbuffer a consumer has not read yet");
+    for (int i = 0; i < SBUFFER_NB_CONSUMERS; i++) {
+        // The counts are not read atomically: threads keep bumping them meanwhile, so a consumer can seem
+        // ahead of the inserts. Its lag is clamped to 0 then.
+        uint64_t lag = totals[METRIC_READINGS_RECEIVED] > consumed[i] ? totals[METRIC_READINGS_RECEIVED] - consumed[i] : 0;
+        if (lag > depth) depth = lag;
+        if (i < (int)(sizeof(consumer_names) / sizeof(consumer_names[0]))) {
+            fprintf(out, "gateway_sbuffer_consumer_lag{consumer=\"%s\"} %llu\n", consumer_names[i], (unsigned long long)lag);
+        } else {
+            fprintf(out, "gateway_sbuffer_consumer_lag{consumer=\"%d\"} %llu\n", i, (unsigned long long)lag);
+        }
+    }
+    write_header(out, "gateway_sbuffer_depth", "gauge", "Readings held in the sbuffer");
+    fprintf(out, "gateway_sbuffer_depth %llu\n", (unsigned long long)depth);
+
+    write_header(out, "gateway_log_messages_dropped_total", "counter", "Log messages dropped because the log ring was full");
+    fprintf(out, "gateway_log_messages_dropped_total %llu\n", (unsigned long long)log_dropped_messages());
+
+    datamgr_stale_stats_t stale;
+    datamgr_get_stale_stats(&stale);
+    write_header(out, "gateway_stale_sensors", "gauge", "Sensors that are silent right now");
+    fprintf(out, "gateway_stale_sensors %d\n", stale.stale_sensors);
+    write_header(out, "gateway_sensor_silent_total", "counter", "Times a sensor was reported silent");
+    fprintf(out, "gateway_sensor_silent_total %lu\n", stale.silent_events);
+    write_header(out, "gateway_sensor_resumed_total", "counter", "Times a silent sensor started reporting again");
+    fprintf(out, "gateway_sensor_resumed_total %lu\n", stale.resumed_events);
+
+    latency_write_metrics(out);
+}
+
+/* SERVER */
+
+static void serve(int fd) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) return;
+    metrics_write(out);
+    fclose(out);
+
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+    }
+    free(text);
+}
+
+static void *run_server(void *arg) {
+    (void)arg;
+    while (true) {
+        struct pollfd fds[2] = {
+            {.fd = server.wake_pipe[0], .events = POLLIN},
+            {.fd = server.listen_fd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) break;
+
+        int fd = socket_server_accept(&server);
+        if (fd < 0) continue;
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start() {
+    return socket_server_start(&server, METRICS_SOCKET_PATH, run_server) == SERVER_SUCCESS ? METRICS_SUCCESS
+                                                                                         : METRICS_FAILURE;
+}
+
+void metrics_stop() {
+    socket_server_stop(&server);
+}
@@ -0,0 +1,102 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_METRICS_H_
+#define _SENSOR_METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "sbuffer.h"
+
+#define METRICS_FAILURE -1
+#define METRICS_SUCCESS 0
+
+#ifndef METRICS_SOCKET_PATH
+#define METRICS_SOCKET_PATH "gateway.metrics.sock"
+#endif
+
+/*
+ * Counters every thread keeps for itself: name, help text, and the factor that turns the count into
+ * the unit in the name (nanoseconds are shown as seconds).
+ */
+#define METRICS(X) \
+    X(METRIC_READINGS_RECEIVED,    "gateway_readings_received_total",         "Readings put in the sbuffer", 1) \
+    X(METRIC_SBUFFER_LOCK_WAITS,   "gateway_sbuffer_lock_contended_total",    "Times the sbuffer mutex was taken already", 1) \
+    X(METRIC_SBUFFER_LOCK_WAIT_NS, "gateway_sbuffer_lock_wait_seconds_total", "Time spent waiting for the sbuffer mutex", 1e-9) \
+    X(METRIC_DATAMGR_READINGS,     "gateway_datamgr_readings_total",          "Readings processed by the datamgr", 1) \
+    X(METRIC_DATAMGR_BATCHES,      "gateway_datamgr_batches_total",           "Batches processed by the datamgr", 1) \
+    X(METRIC_STORAGE_READINGS,     "gateway_storage_readings_total",          "Readings written to storage", 1) \
+    X(METRIC_STORAGE_BATCHES,      "gateway_storage_batches_total",           "Groups written to storage", 1) \
+    X(METRIC_STORAGE_FAILURES,     "gateway_storage_failures_total",          "Groups that could not be written", 1)
+
+#define METRIC_ID(name, text, help, scale) name,
+typedef enum metric {
+    METRICS(METRIC_ID)
+    METRIC_COUNT
+} metric_t;
+#undef METRIC_ID
+
+/*
+ * The counters of one thread, on cache lines of their own. Only that thread writes them, with plain
+ * (relaxed) loads and stores; a scrape reads every slot and adds them up.
+ */
+typedef struct metrics_slot {
+    _Alignas(64) atomic_ullong values[METRIC_COUNT];
+    atomic_ullong consumed[SBUFFER_NB_CONSUMERS];  /**< readings taken from the sbuffer per consumer */
+    char kind[16];
+    long id;
+    struct metrics_slot *next;
+} metrics_slot_t;
+
+// The slot of the calling thread, NULL if it did not register
+extern _Thread_local metrics_slot_t *metrics_self;
+
+static inline void metrics_bump(atomic_ullong *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Adds 'n' to a counter of the calling thread; free of locked instructions and of shared cache lines
+ */
+static inline void metrics_add(metric_t metric, uint64_t n) {
+    if (metrics_self) metrics_bump(&metrics_self->values[metric], n);
+}
+
+static inline void metrics_add_consumed(int consumer_id, uint64_t n) {
+    if (metrics_self) metrics_bump(&metrics_self->consumed[consumer_id], n);
+}
+
+/**
+ * Gives the calling thread its own counters. Updates by threads that did not register are not counted.
+ * \param kind what the thread does, e.g. "connection"; connections are listed per 'id' (the sensor)
+ * \return METRICS_SUCCESS, or METRICS_FAILURE if no slot could be allocated
+ */
+int metrics_register(const char *kind, long id);
+
+/**
+ * Adds the counters of the calling thread to the totals of finished threads and frees its slot
+ */
+void metrics_unregister();
+
+/**
+ * Writes all metrics in the Prometheus text format: the counters of every thread added up, the
+ * connections, the sbuffer depth and the lag of each consumer, dropped log messages and silent sensors
+ */
+void metrics_write(FILE *out);
+
+/**
+ * Serves metrics_write() on METRICS_SOCKET_PATH, a SOCK_STREAM Unix socket: every connection gets
+ * the current metrics and is closed
+ * \return METRICS_SUCCESS, or METRICS_FAILURE if the socket could not be opened
+ */
+int metrics_start();
+
+/**
+ * Stops serving and removes the socket
+ */
+void metrics_stop();
+
+#endif /* _SENSOR_METRICS_H_ */
@@ -0,0 +1,229 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sensor_partition.h"
+#include "sensor_segment.h"
+#include "sensor_db.h"
+
+struct partition_store {
+    char dir[200];
+    segment_writer_t *segment;      // segment of the current partition, NULL before the first reading
+    long long current_start;        // partition of the file being written, LLONG_MIN before the first
+    char current_path[256];         // file being written, empty if none; both guarded by 'mutex'
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stop;
+    bool wake;                      // a segment was closed, compress it now
+};
+
+static long long partition_start(long long ts) {
+    return ts - ((ts % PARTITION_SECONDS) + PARTITION_SECONDS) % PARTITION_SECONDS;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* MAINTENANCE THREAD */
+
+// Whether the writer is writing 'path' right now, and the partition it is writing. Asked again right
+// before every step: the writer can move on to a new segment at any time during a pass.
+static bool is_current(partition_store_t *store, const char *path, long long *current_start) {
+    pthread_mutex_lock(&store->mutex);
+    bool current = strcmp(path, store->current_path) == 0;
+    if (current_start) *current_start = store->current_start;
+    pthread_mutex_unlock(&store->mutex);
+    return current;
+}
+
+// Compress closed segments and delete expired ones. Never touches the file being written.
+static void maintain(partition_store_t *store) {
+    DIR *dir = opendir(store->dir);
+    if (!dir) return;
+
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[512];
+        long long start;
+        int n, len = 0;
+        snprintf(path, sizeof(path), "%s/%s", store->dir, entry->d_name);
+
+        // Leftover of a compression that was interrupted
+        if (strstr(entry->d_name, ".tmp")) {
+            unlink(path);
+            continue;
+        }
+        if (sscanf(entry->d_name, "%lld.%d.seg%n", &start, &n, &len) != 2 || len == 0) continue;
+
+        bool compressed = strcmp(entry->d_name + len, "z") == 0;
+        if (!compressed && entry->d_name[len] != '\0') continue;
+
+        long long current_start;
+        if (is_current(store, path, &current_start)) continue;
+
+        if (PARTITION_RETENTION_SECONDS > 0 && start + PARTITION_SECONDS <= now - PARTITION_RETENTION_SECONDS) {
+            if (unlink(path) == 0) log_event(LOG_SEGMENT_DELETED, path);
+            continue;
+        }
+
+        // Finished for sure: closed with its index, or left without one by a crash in a partition that is over
+        if (compressed || (!segment_is_closed(path) && start >= current_start)) continue;
+
+        char zpath[520];
+        snprintf(zpath, sizeof(zpath), "%sz", path);
+        long raw_size = file_size(path);
+        if (is_current(store, path, NULL)) continue;
+        if (segment_compress(path, zpath) != SEGMENT_SUCCESS) {
+            log_event(LOG_SEGMENT_COMPRESS_FAILED, path);
+        } else if (is_current(store, path, NULL)) {
+            unlink(zpath);
+        } else {
+            unlink(path);
+            log_event(LOG_SEGMENT_COMPRESSED, path, (long long)raw_size, (long long)file_size(zpath));
+        }
+    }
+    closedir(dir);
+}
+
+static void *run_maintenance(void *arg) {
+    partition_store_t *store = arg;
+
+    // Only use CPU time nobody else wants, so ingest is never slowed down
+    struct sched_param param = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    maintain(store);
+
+    pthread_mutex_lock(&store->mutex);
+    while (!store->stop) {
+        if (!store->wake) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += PARTITION_MAINTENANCE_INTERVAL;
+            pthread_cond_timedwait(&store->cond, &store->mutex, &deadline);
+            if (store->stop) break;
+        }
+        store->wake = false;
+
+        pthread_mutex_unlock(&store->mutex);
+        maintain(store);
+        pthread_mutex_lock(&store->mutex);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    return NULL;
+}
+
+/* WRITER */
+
+partition_store_t *partition_open(const char *dir) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return NULL;
+
+    partition_store_t *store = calloc(1, sizeof(*store));
+    if (!store) return NULL;
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->current_start = LLONG_MIN;
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->cond, NULL);
+
+    if (pthread_create(&store->thread, NULL, run_maintenance, store) != 0) {
+        pthread_mutex_destroy(&store->mutex);
+        pthread_cond_destroy(&store->cond);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Close the current segment and hand it to the maintenance thread
+static int close_segment(partition_store_t *store, bool sync) {
+    if (!store->segment) return PARTITION_SUCCESS;
+    int result = segment_close(&store->segment, sync) == SEGMENT_SUCCESS ? PARTITION_SUCCESS : PARTITION_FAILURE;
+
+    pthread_mutex_lock(&store->mutex);
+    store->current_path[0] = '\0';
+    store->wake = true;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->mutex);
+    return result;
+}
+
+// Start a new file for partition 'start', next to any files an earlier run left for it
+static int open_segment(partition_store_t *store, long long start) {
+    char path[256], zpath[260];
+    for (int n = 0; ; n++) {
+        snprintf(path, sizeof(path), "%s/%lld.%d.seg", store->dir, start, n);
+        snprintf(zpath, sizeof(zpath), "%sz", path);
+        if (access(path, F_OK) != 0 && access(zpath, F_OK) != 0) break;
+    }
+
+    // Publish the name first, so the maintenance thread never compresses it
+    pthread_mutex_lock(&store->mutex);
+    strcpy(store->current_path, path);
+    store->current_start = start;
+    pthread_mutex_unlock(&store->mutex);
+
+    store->segment = segment_open(path);
+    if (!store->segment) {
+        pthread_mutex_lock(&store->mutex);
+        store->current_path[0] = '\0';
+        pthread_mutex_unlock(&store->mutex);
+        return PARTITION_FAILURE;
+    }
+
+    log_event(LOG_SEGMENT_CREATED, path);
+    return PARTITION_SUCCESS;
+}
+
+int partition_append(partition_store_t *store, const sensor_data_t *data) {
+    long long start = partition_start(data->ts);
+
+    if (!store->segment || start > store->current_start) {
+        close_segment(store, false);
+        if (open_segment(store, start) != PARTITION_SUCCESS) return PARTITION_FAILURE;
+    }
+
+    return segment_append(store->segment, data) == SEGMENT_SUCCESS ? PARTITION_SUCCESS : PARTITION_FAILURE;
+}
+
+int partition_commit(partition_store_t *store, bool sync) {
+    if (!store->segment) return PARTITION_SUCCESS;
+    return segment_commit(store->segment, sync) == SEGMENT_SUCCESS ? PARTITION_SUCCESS : PARTITION_FAILURE;
+}
+
+int partition_close(partition_store_t **store, bool sync) {
+    if (store == NULL || *store == NULL) return PARTITION_FAILURE;
+    partition_store_t *s = *store;
+    int result = close_segment(s, sync);
+    if (result != PARTITION_SUCCESS) log_event(LOG_SEGMENT_CLOSE_FAILED, s->dir);
+
+    pthread_mutex_lock(&s->mutex);
+    s->stop = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->thread, NULL);
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    log_event(LOG_SEGMENTS_CLOSED, s->dir);
+    free(s);
+    *store = NULL;
+    return result;
+}
@@ -0,0 +1,63 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_PARTITION_H_
+#define _SENSOR_PARTITION_H_
+
+#include <stdbool.h>
+#include "config.h"
+
+#define PARTITION_FAILURE -1
+#define PARTITION_SUCCESS 0
+
+// Length of a partition in seconds of sensor time: 3600 gives hourly segments, 86400 daily ones
+#ifndef PARTITION_SECONDS
+#define PARTITION_SECONDS 3600
+#endif
+
+// Partitions that ended more than this many seconds ago are deleted; 0 keeps everything
+#ifndef PARTITION_RETENTION_SECONDS
+#define PARTITION_RETENTION_SECONDS (30 * 86400)
+#endif
+
+// Seconds between background passes over the directory, besides the one after every closed partition
+#ifndef PARTITION_MAINTENANCE_INTERVAL
+#define PARTITION_MAINTENANCE_INTERVAL 60
+#endif
+
+typedef struct partition_store partition_store_t;
+
+/**
+ * Opens a directory of time-partitioned segments and starts its background maintenance thread
+ * Readings go to '<dir>/<partition start>.<n>.seg'; existing files are never overwritten, so a
+ * restart adds a new file to the current partition. The maintenance thread compresses every closed
+ * segment to '.segz' (see segment_compress()) and deletes partitions past the retention period.
+ * It runs at idle priority and never blocks the writer.
+ * \param dir the directory, created if it does not exist
+ * \return a new store, or NULL if the directory could not be used
+ */
+partition_store_t *partition_open(const char *dir);
+
+/**
+ * Appends a reading to the segment of its partition
+ * A reading for a newer partition closes the current segment and starts the next one. Late readings
+ * for an older partition go to the current segment; block headers still record their real timestamps.
+ * \return PARTITION_SUCCESS on success, PARTITION_FAILURE if the reading could not be written
+ */
+int partition_append(partition_store_t *store, const sensor_data_t *data);
+
+/**
+ * Commits the readings appended so far to the current segment, see segment_commit()
+ */
+int partition_commit(partition_store_t *store, bool sync);
+
+/**
+ * Closes the current segment, stops the maintenance thread and frees the store
+ * Segments left uncompressed are picked up the next time the directory is opened.
+ * \param store a double pointer to the store, set to NULL
+ * \param sync wait until the current segment is on disk
+ */
+int partition_close(partition_store_t **store, bool sync);
+
+#endif /* _SENSOR_PARTITION_H_ */
@@ -0,0 +1,78 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_PROBES_H_
+#define _SENSOR_PROBES_H_
+
+#include <stdint.h>
+
+/*
+ * USDT probes (provider "gateway") for perf, bpftrace and SystemTap, e.g.
+ *   bpftrace -e 'usdt:./sensor_gateway:gateway:sbuffer_insert { @[arg0] = count(); }'
+ * A probe is a single nop at the probe site plus an ELF note (.note.stapsdt) saying where its
+ * arguments are; a tracer turns the nop into a breakpoint only while it is attached. This is the
+ * layout of <sys/sdt.h>, written out here so the build does not need systemtap-sdt-dev. Arguments
+ * are passed as 64-bit signed integers (pointers as addresses, temperatures in millidegrees).
+ * Build with -DSENSOR_USDT=0 (make USDT=0) to leave them out entirely.
+ */
+#ifndef SENSOR_USDT
+#define SENSOR_USDT 1
+#endif
+
+#if SENSOR_USDT && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define SENSOR_PROBE_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"gateway\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+// Where an argument is: an immediate, a register or a memory operand, whichever the compiler has
+#define SENSOR_PROBE_ARG(n, x) [a##n] "nor" ((int64_t)(x))
+
+#define SENSOR_PROBE0(name) \
+    __asm__ __volatile__(SENSOR_PROBE_ASM(name, "") ::)
+#define SENSOR_PROBE1(name, x1) \
+    __asm__ __volatile__(SENSOR_PROBE_ASM(name, "-8@%[a1]") :: SENSOR_PROBE_ARG(1, x1))
+#define SENSOR_PROBE2(name, x1, x2) \
+    __asm__ __volatile__(SENSOR_PROBE_ASM(name, "-8@%[a1] -8@%[a2]") \
+                         :: SENSOR_PROBE_ARG(1, x1), SENSOR_PROBE_ARG(2, x2))
+#define SENSOR_PROBE3(name, x1, x2, x3) \
+    __asm__ __volatile__(SENSOR_PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3]") \
+                         :: SENSOR_PROBE_ARG(1, x1), SENSOR_PROBE_ARG(2, x2), SENSOR_PROBE_ARG(3, x3))
+#define SENSOR_PROBE4(name, x1, x2, x3, x4) \
+    __asm__ __volatile__(SENSOR_PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]") \
+                         :: SENSOR_PROBE_ARG(1, x1), SENSOR_PROBE_ARG(2, x2), SENSOR_PROBE_ARG(3, x3), \
+                            SENSOR_PROBE_ARG(4, x4))
+
+#else
+
+// Compiled out: the arguments are not even evaluated
+#define SENSOR_PROBE0(name) do {} while (0)
+#define SENSOR_PROBE1(name, x1) do {} while (0)
+#define SENSOR_PROBE2(name, x1, x2) do {} while (0)
+#define SENSOR_PROBE3(name, x1, x2, x3) do {} while (0)
+#define SENSOR_PROBE4(name, x1, x2, x3, x4) do {} while (0)
+
+#endif
+
+#endif /* _SENSOR_PROBES_H_ */
@@ -0,0 +1,345 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sensor_rollup.h"
+#include "sensor_map.h"
+
+typedef struct bucket {
+    int64_t start;
+    uint32_t count;             // 0 if the bucket is not in use
+    double min;
+    double max;
+    double sum;
+} bucket_t;
+
+// Open buckets of one sensor or room, per resolution: the current one and the one before it,
+// which takes late readings until ROLLUP_GRACE_SECONDS after it ended
+typedef struct series {
+    uint16_t id;
+    uint8_t kind;
+    bucket_t current[ROLLUP_NB_RESOLUTIONS];
+    bucket_t previous[ROLLUP_NB_RESOLUTIONS];
+} series_t;
+
+struct rollup {
+    FILE *files[ROLLUP_NB_RESOLUTIONS];
+    series_t *series[2][UINT16_MAX + 1];    // [kind][id], allocated on the first reading
+    series_t **all;                         // every allocated series, for sweep()
+    int nb_series;
+    int32_t room_of[UINT16_MAX + 1];        // room of every sensor in the map, -1 if none
+    unsigned map_generation;
+    bool have_map;
+    time_t last_sweep;
+};
+
+static const int64_t resolution_seconds[ROLLUP_NB_RESOLUTIONS] = {60, 3600, 86400};
+static const char *resolution_names[ROLLUP_NB_RESOLUTIONS] = {"1m", "1h", "1d"};
+
+int64_t rollup_resolution_seconds(int resolution) {
+    return resolution_seconds[resolution];
+}
+
+const char *rollup_resolution_name(int resolution) {
+    return resolution_names[resolution];
+}
+
+static int64_t bucket_start(int64_t ts, int64_t length) {
+    return ts - ((ts % length) + length) % length;
+}
+
+/* WRITER */
+
+// Opens a rollup file for appending. A record torn by a crash is cut off.
+static FILE *open_file(int resolution) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s.%s", ROLLUP_FILE_PREFIX, resolution_names[resolution]);
+
+    FILE *f = fopen(path, "a+");
+    if (!f) return NULL;
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    rollup_file_header_t header;
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC));
+        header.resolution = resolution_seconds[resolution];
+        if (fwrite(&header, sizeof(header), 1, f) != 1 || fflush(f) != 0) {
+            fclose(f);
+            return NULL;
+        }
+        return f;
+    }
+
+    // Never append to something that is not a rollup file of this resolution
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC)) != 0 ||
+        header.resolution != resolution_seconds[resolution]) {
+        fprintf(stderr, "[!] ERR: %s is not a rollup file\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    off_t records = (st.st_size - (off_t)sizeof(header)) / sizeof(rollup_record_t);
+    off_t end = sizeof(header) + records * sizeof(rollup_record_t);
+    if (end != st.st_size && ftruncate(fileno(f), end) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+rollup_t *rollup_open() {
+    rollup_t *rollup = calloc(1, sizeof(*rollup));
+    if (!rollup) return NULL;
+
+    for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+        rollup->files[r] = open_file(r);
+        if (!rollup->files[r]) {
+            while (--r >= 0) fclose(rollup->files[r]);
+            free(rollup);
+            return NULL;
+        }
+    }
+    memset(rollup->room_of, 0xff, sizeof(rollup->room_of));
+    rollup->last_sweep = time(NULL);
+    return rollup;
+}
+
+static void emit(rollup_t *rollup, int resolution, const series_t *s, bucket_t *b) {
+    rollup_record_t record = {
+        .start = b->start,
+        .count = b->count,
+        .id = s->id,
+        .kind = s->kind,
+        .min = b->min,
+        .max = b->max,
+        .mean = b->sum / b->count,
+    };
+    fwrite(&record, sizeof(record), 1, rollup->files[resolution]);
+    b->count = 0;
+}
+
+static void bucket_add(bucket_t *b, int64_t start, double value) {
+    if (b->count == 0) {
+        b->start = start;
+        b->min = b->max = value;
+        b->sum = 0;
+    }
+    if (value < b->min) b->min = value;
+    if (value > b->max) b->max = value;
+    b->sum += value;
+    b->count++;
+}
+
+static series_t *get_series(rollup_t *rollup, int kind, uint16_t id) {
+    series_t *s = rollup->series[kind][id];
+    if (s) return s;
+
+    if (rollup->nb_series % 256 == 0) {
+        series_t **all = realloc(rollup->all, (rollup->nb_series + 256) * sizeof(*all));
+        if (!all) return NULL;
+        rollup->all = all;
+    }
+    s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->id = id;
+    s->kind = kind;
+    rollup->all[rollup->nb_series++] = s;
+    rollup->series[kind][id] = s;
+    return s;
+}
+
+static void series_add(rollup_t *rollup, series_t *s, int64_t ts, double value) {
+    for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+        int64_t length = resolution_seconds[r];
+        int64_t start = bucket_start(ts, length);
+        bucket_t *current = &s->current[r], *previous = &s->previous[r];
+
+        if (current->count && start > current->start) {
+            if (previous->count) emit(rollup, r, s, previous);
+            *previous = *current;
+            current->count = 0;
+        }
+
+        if (current->count == 0 || start == current->start) {
+            bucket_add(current, start, value);
+        } else if (previous->count && start == previous->start) {
+            bucket_add(previous, start, value);
+        } else {
+            // Older than both open buckets: a record of its own, merged by readers
+            bucket_t late = {0};
+            bucket_add(&late, start, value);
+            emit(rollup, r, s, &late);
+        }
+
+        if (previous->count && ts >= previous->start + length + ROLLUP_GRACE_SECONDS) {
+            emit(rollup, r, s, previous);
+        }
+    }
+}
+
+static void update_rooms(rollup_t *rollup, const sensor_map_t *map) {
+    if (rollup->have_map && map->generation == rollup->map_generation) return;
+
+    memset(rollup->room_of, 0xff, sizeof(rollup->room_of));
+    for (int i = 0; i < map->size; i++) {
+        rollup->room_of[map->sensor_ids[i]] = map->room_ids[i];
+    }
+    rollup->map_generation = map->generation;
+    rollup->have_map = true;
+}
+
+void rollup_add(rollup_t *rollup, const sensor_data_t *data, int count, const sensor_map_t *map) {
+    if (map) update_rooms(rollup, map);
+
+    for (int i = 0; i < count; i++) {
+        series_t *s = get_series(rollup, ROLLUP_SENSOR, data[i].id);
+        if (s) series_add(rollup, s, data[i].ts, data[i].value);
+
+        int32_t room = map ? rollup->room_of[data[i].id] : -1;
+        if (room >= 0 && (s = get_series(rollup, ROLLUP_ROOM, room)) != NULL) {
+            series_add(rollup, s, data[i].ts, data[i].value);
+        }
+    }
+}
+
+// Writes the buckets of sensors and rooms that stopped reporting, once their grace period is over.
+// Sensor timestamps are seconds since the epoch, so they can be compared with the wall clock.
+static void sweep(rollup_t *rollup, time_t now) {
+    for (int i = 0; i < rollup->nb_series; i++) {
+        series_t *s = rollup->all[i];
+        for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+            int64_t length = resolution_seconds[r];
+            if (s->previous[r].count && now >= s->previous[r].start + length + ROLLUP_GRACE_SECONDS) {
+                emit(rollup, r, s, &s->previous[r]);
+            }
+            if (s->current[r].count && now >= s->current[r].start + length + ROLLUP_GRACE_SECONDS) {
+                emit(rollup, r, s, &s->current[r]);
+            }
+        }
+    }
+    rollup->last_sweep = now;
+}
+
+int rollup_commit(rollup_t *rollup, bool sync) {
+    time_t now = time(NULL);
+    if (now - rollup->last_sweep >= ROLLUP_GRACE_SECONDS) sweep(rollup, now);
+
+    int result = ROLLUP_SUCCESS;
+    for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+        if (fflush(rollup->files[r]) != 0) result = ROLLUP_FAILURE;
+        if (sync && fdatasync(fileno(rollup->files[r])) != 0) result = ROLLUP_FAILURE;
+    }
+    return result;
+}
+
+int rollup_close(rollup_t **rollup, bool sync) {
+    if (rollup == NULL || *rollup == NULL) return ROLLUP_FAILURE;
+    rollup_t *state = *rollup;
+
+    // Partial buckets too: a restart adds the rest as another record of the same bucket
+    for (int i = 0; i < state->nb_series; i++) {
+        series_t *s = state->all[i];
+        for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+            if (s->previous[r].count) emit(state, r, s, &s->previous[r]);
+            if (s->current[r].count) emit(state, r, s, &s->current[r]);
+        }
+        free(s);
+    }
+
+    int result = rollup_commit(state, sync);
+    for (int r = 0; r < ROLLUP_NB_RESOLUTIONS; r++) {
+        if (fclose(state->files[r]) != 0) result = ROLLUP_FAILURE;
+    }
+    free(state->all);
+    free(state);
+    *rollup = NULL;
+    return result;
+}
+
+/* READER */
+
+static int compare_start(const void *a, const void *b) {
+    const rollup_record_t *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+int rollup_query(const char *path, int kind, uint16_t id, int64_t from, int64_t to, rollup_record_t **records) {
+    *records = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return ROLLUP_FAILURE;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(rollup_file_header_t)) {
+        close(fd);
+        return ROLLUP_FAILURE;
+    }
+    const char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) return ROLLUP_FAILURE;
+
+    if (memcmp(((const rollup_file_header_t *)file)->magic, ROLLUP_MAGIC, sizeof(ROLLUP_MAGIC)) != 0) {
+        munmap((void *)file, st.st_size);
+        return ROLLUP_FAILURE;
+    }
+
+    const rollup_record_t *all = (const rollup_record_t *)(file + sizeof(rollup_file_header_t));
+    size_t total = (st.st_size - sizeof(rollup_file_header_t)) / sizeof(rollup_record_t);
+    int n = 0, capacity = 0;
+    rollup_record_t *found = NULL;
+
+    for (size_t i = 0; i < total; i++) {
+        if (all[i].kind != kind || all[i].id != id || all[i].start < from || all[i].start > to) continue;
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            rollup_record_t *grown = realloc(found, capacity * sizeof(*found));
+            if (!grown) {
+                free(found);
+                munmap((void *)file, st.st_size);
+                return ROLLUP_FAILURE;
+            }
+            found = grown;
+        }
+        found[n++] = all[i];
+    }
+    munmap((void *)file, st.st_size);
+    if (n == 0) {
+        free(found);
+        return 0;
+    }
+
+    // Merge the records of each bucket into the first one
+    qsort(found, n, sizeof(*found), compare_start);
+    int merged = 0;
+    for (int i = 0; i < n; i++) {
+        rollup_record_t *last = merged > 0 ? &found[merged - 1] : NULL;
+        if (last && last->start == found[i].start) {
+            uint32_t count = last->count + found[i].count;
+            last->mean = (last->mean * last->count + found[i].mean * found[i].count) / count;
+            last->count = count;
+            if (found[i].min < last->min) last->min = found[i].min;
+            if (found[i].max > last->max) last->max = found[i].max;
+        } else {
+            found[merged++] = found[i];
+        }
+    }
+
+    *records = found;
+    return merged;
+}
@@ -0,0 +1,106 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_ROLLUP_H_
+#define _SENSOR_ROLLUP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+struct sensor_map;
+
+#define ROLLUP_FAILURE -1
+#define ROLLUP_SUCCESS 0
+
+/*
+ * Downsampled history, kept up to date by the storage manager as readings arrive.
+ * Every resolution has its own file '<ROLLUP_FILE_PREFIX>.1m', '.1h' and '.1d': a header followed
+ * by fixed-size records, one per sensor (and one per room) per bucket. A record is written once
+ * its bucket is over, so the files only grow by appending.
+ *
+ * A bucket can have more than one record: a reading that arrives after its bucket was written,
+ * a restart, or the partial buckets written at shutdown each add one. Readers merge records with
+ * the same kind, id and start; rollup_query() does this.
+ */
+#define ROLLUP_MAGIC "ROLLUP1"
+
+#define ROLLUP_1M 0
+#define ROLLUP_1H 1
+#define ROLLUP_1D 2
+#define ROLLUP_NB_RESOLUTIONS 3
+
+#define ROLLUP_SENSOR 0             /**< record for one sensor */
+#define ROLLUP_ROOM 1               /**< record for all sensors of a room in room_sensor.map */
+
+#ifndef ROLLUP_FILE_PREFIX
+#define ROLLUP_FILE_PREFIX "rollup"
+#endif
+
+// Seconds a finished bucket stays open for readings that arrive late, e.g. from other sensors of the same room
+#ifndef ROLLUP_GRACE_SECONDS
+#define ROLLUP_GRACE_SECONDS 60
+#endif
+
+typedef struct rollup_file_header {
+    char magic[8];
+    int64_t resolution;         /**< bucket length in seconds */
+} rollup_file_header_t;
+
+typedef struct rollup_record {
+    int64_t start;              /**< first second of the bucket, in sensor time */
+    uint32_t count;             /**< readings in the bucket */
+    uint16_t id;                /**< sensor id or room id */
+    uint8_t kind;               /**< ROLLUP_SENSOR or ROLLUP_ROOM */
+    uint8_t reserved;
+    double min;
+    double max;
+    double mean;
+} rollup_record_t;
+
+_Static_assert(sizeof(rollup_record_t) == 40, "rollup records are stored as-is");
+
+typedef struct rollup rollup_t;
+
+/**
+ * Returns the bucket length in seconds and the file name suffix ("1m", "1h", "1d") of a resolution
+ */
+int64_t rollup_resolution_seconds(int resolution);
+const char *rollup_resolution_name(int resolution);
+
+/**
+ * Opens (or creates) the rollup file of every resolution for appending
+ * \return new rollup state, or NULL if a file could not be opened
+ */
+rollup_t *rollup_open();
+
+/**
+ * Adds readings to the buckets of their sensor and, if 'map' knows the sensor, of its room
+ * Buckets that are over are queued as records for the next rollup_commit().
+ * \param map the current room/sensor map, or NULL to skip room rollups
+ */
+void rollup_add(rollup_t *rollup, const sensor_data_t *data, int count, const struct sensor_map *map);
+
+/**
+ * Appends the queued records to their files
+ */
+int rollup_commit(rollup_t *rollup, bool sync);
+
+/**
+ * Writes every open bucket, closes the files and frees the state
+ * \param rollup a double pointer to the state, set to NULL
+ */
+int rollup_close(rollup_t **rollup, bool sync);
+
+/**
+ * Reads the records of one sensor or room from a rollup file, merged per bucket and sorted by start
+ * \param path the rollup file
+ * \param kind ROLLUP_SENSOR or ROLLUP_ROOM
+ * \param from, to only buckets that start in [from, to]
+ * \param records set to a newly allocated array the caller frees, NULL if there are no records
+ * \return the number of records, or ROLLUP_FAILURE if the file could not be read
+ */
+int rollup_query(const char *path, int kind, uint16_t id, int64_t from, int64_t to, rollup_record_t **records);
+
+#endif /* _SENSOR_ROLLUP_H_ */
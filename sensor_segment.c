@@ -0,0 +1,404 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sensor_segment.h"
+#include "sensor_codec.h"
+
+struct segment_writer {
+    int fd;
+    segment_block_t block;              // block being filled
+    int block_no;                       // its position in the file
+    bool dirty;                         // block has records that were not written yet
+    segment_index_entry_t *index;       // one entry per finished block
+    int index_capacity;
+};
+
+struct segment_reader {
+    int fd;
+    int nb_blocks;
+    segment_index_entry_t *index;
+    uint8_t payload[SEGMENT_ZBLOCK_MAX_PAYLOAD];    // compressed block being decoded
+};
+
+static int write_all(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return SEGMENT_FAILURE;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return SEGMENT_SUCCESS;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return SEGMENT_FAILURE;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return SEGMENT_SUCCESS;
+}
+
+/* WRITER */
+
+segment_writer_t *segment_open(const char *path) {
+    segment_writer_t *writer = calloc(1, sizeof(*writer));
+    if (!writer) return NULL;
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+static int write_block(segment_writer_t *writer) {
+    off_t offset = (off_t)writer->block_no * SEGMENT_BLOCK_SIZE;
+    if (write_all(writer->fd, &writer->block, sizeof(writer->block), offset) != SEGMENT_SUCCESS) {
+        return SEGMENT_FAILURE;
+    }
+    writer->dirty = false;
+    return SEGMENT_SUCCESS;
+}
+
+// The current block is complete: remember it in the index and start the next one
+static int finish_block(segment_writer_t *writer) {
+    if (writer->dirty && write_block(writer) != SEGMENT_SUCCESS) return SEGMENT_FAILURE;
+
+    if (writer->block_no == writer->index_capacity) {
+        int capacity = writer->index_capacity ? 2 * writer->index_capacity : 64;
+        segment_index_entry_t *index = realloc(writer->index, capacity * sizeof(*index));
+        if (!index) return SEGMENT_FAILURE;
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+
+    segment_index_entry_t *entry = &writer->index[writer->block_no];
+    entry->offset = (uint64_t)writer->block_no * SEGMENT_BLOCK_SIZE;
+    entry->header = writer->block.header;
+
+    writer->block_no++;
+    memset(&writer->block, 0, sizeof(writer->block));
+    return SEGMENT_SUCCESS;
+}
+
+int segment_append(segment_writer_t *writer, const sensor_data_t *data) {
+    segment_block_header_t *header = &writer->block.header;
+    int64_t ts = data->ts;
+
+    if (header->count == 0) {
+        memcpy(header->magic, SEGMENT_BLOCK_MAGIC, sizeof(header->magic));
+        header->min_ts = header->max_ts = ts;
+        header->min_id = header->max_id = data->id;
+    } else {
+        if (ts < header->min_ts) header->min_ts = ts;
+        if (ts > header->max_ts) header->max_ts = ts;
+        if (data->id < header->min_id) header->min_id = data->id;
+        if (data->id > header->max_id) header->max_id = data->id;
+    }
+    header->id_bitmap[(data->id & 255) / 64] |= (uint64_t)1 << (data->id & 63);
+
+    int i = header->count++;
+    writer->block.ts[i] = ts;
+    writer->block.values[i] = data->value;
+    writer->block.ids[i] = data->id;
+    writer->dirty = true;
+
+    if (header->count == SEGMENT_BLOCK_RECORDS) return finish_block(writer);
+    return SEGMENT_SUCCESS;
+}
+
+int segment_commit(segment_writer_t *writer, bool sync) {
+    if (writer->dirty && write_block(writer) != SEGMENT_SUCCESS) return SEGMENT_FAILURE;
+    if (sync && fdatasync(writer->fd) != 0) return SEGMENT_FAILURE;
+    return SEGMENT_SUCCESS;
+}
+
+int segment_close(segment_writer_t **writer, bool sync) {
+    if (writer == NULL || *writer == NULL) return SEGMENT_FAILURE;
+    segment_writer_t *w = *writer;
+    int result = SEGMENT_SUCCESS;
+
+    if (w->block.header.count > 0 && finish_block(w) != SEGMENT_SUCCESS) result = SEGMENT_FAILURE;
+
+    if (result == SEGMENT_SUCCESS) {
+        segment_trailer_t trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, SEGMENT_TRAILER_MAGIC, sizeof(trailer.magic));
+        trailer.index_offset = (uint64_t)w->block_no * SEGMENT_BLOCK_SIZE;
+        trailer.nb_blocks = w->block_no;
+
+        size_t index_len = w->block_no * sizeof(*w->index);
+        if (write_all(w->fd, w->index, index_len, trailer.index_offset) != SEGMENT_SUCCESS ||
+            write_all(w->fd, &trailer, sizeof(trailer), trailer.index_offset + index_len) != SEGMENT_SUCCESS) {
+            result = SEGMENT_FAILURE;
+        }
+    }
+    if (sync && fdatasync(w->fd) != 0) result = SEGMENT_FAILURE;
+
+    close(w->fd);
+    free(w->index);
+    free(w);
+    *writer = NULL;
+    return result;
+}
+
+/* COMPRESSION */
+
+// Encode a block as one series per sensor; returns the payload size, or 0 if it did not fit
+static size_t compress_block(const segment_block_t *block, uint8_t *payload, uint32_t *nb_series) {
+    int n = block->header.count;
+    int order[SEGMENT_BLOCK_RECORDS];
+
+    // Stable sort on sensor id, so each series stays in arrival order
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        while (j > 0 && block->ids[order[j - 1]] > block->ids[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    bit_writer_t writer;
+    bit_writer_init(&writer, payload, SEGMENT_ZBLOCK_MAX_PAYLOAD);
+    *nb_series = 0;
+
+    // Series are short, so each one starts from what the decoder already knows: timestamps
+    // from the block's oldest one, values from the first value of the previous series
+    value_codec_t prev_first = {0};
+
+    for (int start = 0; start < n; ) {
+        int end = start;
+        while (end < n && block->ids[order[end]] == block->ids[order[start]]) end++;
+
+        bit_write(&writer, block->ids[order[start]], 16);
+        bit_write(&writer, end - start - 1, 8);
+
+        ts_codec_t ts_codec = {.count = 1, .prev_ts = block->header.min_ts};
+        value_codec_t value_codec = {.count = prev_first.count, .prev_bits = prev_first.prev_bits};
+        memcpy(&prev_first.prev_bits, &block->values[order[start]], sizeof(prev_first.prev_bits));
+        prev_first.count = 1;
+        for (int i = start; i < end; i++) {
+            ts_encode(&ts_codec, &writer, block->ts[order[i]]);
+            value_encode(&value_codec, &writer, block->values[order[i]]);
+        }
+
+        (*nb_series)++;
+        start = end;
+    }
+
+    return writer.overflow ? 0 : bit_writer_bytes(&writer);
+}
+
+static int decompress_block(const uint8_t *payload, size_t size, uint32_t nb_series, segment_block_t *block) {
+    bit_reader_t reader;
+    bit_reader_init(&reader, payload, size);
+
+    uint32_t n = 0;
+    value_codec_t prev_first = {0};
+    for (uint32_t s = 0; s < nb_series; s++) {
+        uint16_t id = bit_read(&reader, 16);
+        uint32_t count = bit_read(&reader, 8) + 1;
+        if (n + count > block->header.count) return SEGMENT_FAILURE;
+
+        ts_codec_t ts_codec = {.count = 1, .prev_ts = block->header.min_ts};
+        value_codec_t value_codec = {.count = prev_first.count, .prev_bits = prev_first.prev_bits};
+        for (uint32_t i = 0; i < count; i++, n++) {
+            block->ids[n] = id;
+            block->ts[n] = ts_decode(&ts_codec, &reader);
+            block->values[n] = value_decode(&value_codec, &reader);
+        }
+        memcpy(&prev_first.prev_bits, &block->values[n - count], sizeof(prev_first.prev_bits));
+        prev_first.count = 1;
+    }
+
+    if (reader.overflow || n != block->header.count) return SEGMENT_FAILURE;
+    memcpy(block->header.magic, SEGMENT_BLOCK_MAGIC, sizeof(block->header.magic));
+    return SEGMENT_SUCCESS;
+}
+
+int segment_compress(const char *src, const char *dst) {
+    segment_reader_t *reader = segment_reader_open(src);
+    if (!reader) return SEGMENT_FAILURE;
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dst);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int nb_blocks = reader->nb_blocks;
+    segment_index_entry_t *index = malloc((nb_blocks ? nb_blocks : 1) * sizeof(*index));
+    segment_block_t *block = malloc(sizeof(*block));
+    uint8_t *payload = malloc(SEGMENT_ZBLOCK_MAX_PAYLOAD);
+    int result = fd >= 0 && index && block && payload ? SEGMENT_SUCCESS : SEGMENT_FAILURE;
+
+    off_t offset = 0;
+    for (int b = 0; b < nb_blocks && result == SEGMENT_SUCCESS; b++) {
+        segment_zblock_info_t info;
+        if (segment_reader_read_block(reader, b, block) != SEGMENT_SUCCESS ||
+            (info.payload_size = compress_block(block, payload, &info.nb_series)) == 0) {
+            result = SEGMENT_FAILURE;
+            break;
+        }
+
+        segment_block_header_t header = block->header;
+        memcpy(header.magic, SEGMENT_ZBLOCK_MAGIC, sizeof(header.magic));
+        index[b].offset = offset;
+        index[b].header = header;
+
+        if (write_all(fd, &header, sizeof(header), offset) != SEGMENT_SUCCESS ||
+            write_all(fd, &info, sizeof(info), offset + sizeof(header)) != SEGMENT_SUCCESS ||
+            write_all(fd, payload, info.payload_size, offset + sizeof(header) + sizeof(info)) != SEGMENT_SUCCESS) {
+            result = SEGMENT_FAILURE;
+        }
+        offset += sizeof(header) + sizeof(info) + info.payload_size;
+    }
+
+    if (result == SEGMENT_SUCCESS) {
+        segment_trailer_t trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        memcpy(trailer.magic, SEGMENT_TRAILER_MAGIC, sizeof(trailer.magic));
+        trailer.index_offset = offset;
+        trailer.nb_blocks = nb_blocks;
+
+        size_t index_len = nb_blocks * sizeof(*index);
+        if (write_all(fd, index, index_len, offset) != SEGMENT_SUCCESS ||
+            write_all(fd, &trailer, sizeof(trailer), offset + index_len) != SEGMENT_SUCCESS ||
+            fdatasync(fd) != 0) {
+            result = SEGMENT_FAILURE;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    if (result == SEGMENT_SUCCESS && rename(tmp_path, dst) != 0) result = SEGMENT_FAILURE;
+    if (result != SEGMENT_SUCCESS) unlink(tmp_path);
+
+    free(payload);
+    free(block);
+    free(index);
+    segment_reader_close(&reader);
+    return result;
+}
+
+/* READER */
+
+// Use the index at the end of the file if there is a valid one
+static bool load_index(segment_reader_t *reader, off_t size) {
+    segment_trailer_t trailer;
+    if (size < (off_t)sizeof(trailer)) return false;
+    if (read_all(reader->fd, &trailer, sizeof(trailer), size - sizeof(trailer)) != SEGMENT_SUCCESS) return false;
+    if (memcmp(trailer.magic, SEGMENT_TRAILER_MAGIC, sizeof(trailer.magic)) != 0) return false;
+
+    size_t index_len = (size_t)trailer.nb_blocks * sizeof(segment_index_entry_t);
+    if (trailer.index_offset + index_len + sizeof(trailer) != (uint64_t)size) return false;
+
+    reader->index = malloc(index_len ? index_len : 1);
+    if (!reader->index) return false;
+    if (read_all(reader->fd, reader->index, index_len, trailer.index_offset) != SEGMENT_SUCCESS) {
+        free(reader->index);
+        reader->index = NULL;
+        return false;
+    }
+    reader->nb_blocks = trailer.nb_blocks;
+    return true;
+}
+
+// No index: walk the block headers until the first block that is not complete
+static bool scan_blocks(segment_reader_t *reader, off_t size) {
+    int max_blocks = size / SEGMENT_BLOCK_SIZE;
+    reader->index = malloc((max_blocks ? max_blocks : 1) * sizeof(*reader->index));
+    if (!reader->index) return false;
+
+    reader->nb_blocks = 0;
+    for (int i = 0; i < max_blocks; i++) {
+        segment_index_entry_t *entry = &reader->index[i];
+        entry->offset = (uint64_t)i * SEGMENT_BLOCK_SIZE;
+        if (read_all(reader->fd, &entry->header, sizeof(entry->header), entry->offset) != SEGMENT_SUCCESS ||
+            memcmp(entry->header.magic, SEGMENT_BLOCK_MAGIC, sizeof(entry->header.magic)) != 0 ||
+            entry->header.count > SEGMENT_BLOCK_RECORDS) {
+            break;
+        }
+        reader->nb_blocks++;
+    }
+    return true;
+}
+
+bool segment_is_closed(const char *path) {
+    segment_reader_t reader = {.fd = open(path, O_RDONLY), .nb_blocks = 0, .index = NULL};
+    struct stat st;
+    bool closed = reader.fd >= 0 && fstat(reader.fd, &st) == 0 && load_index(&reader, st.st_size);
+    if (reader.fd >= 0) close(reader.fd);
+    free(reader.index);
+    return closed;
+}
+
+segment_reader_t *segment_reader_open(const char *path) {
+    segment_reader_t *reader = calloc(1, sizeof(*reader));
+    if (!reader) return NULL;
+
+    reader->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (reader->fd < 0 || fstat(reader->fd, &st) != 0 ||
+        (!load_index(reader, st.st_size) && !scan_blocks(reader, st.st_size))) {
+        segment_reader_close(&reader);
+        return NULL;
+    }
+    return reader;
+}
+
+int segment_reader_nb_blocks(const segment_reader_t *reader) {
+    return reader->nb_blocks;
+}
+
+const segment_block_header_t *segment_reader_header(const segment_reader_t *reader, int i) {
+    return &reader->index[i].header;
+}
+
+int segment_reader_read_block(segment_reader_t *reader, int i, segment_block_t *block) {
+    if (i < 0 || i >= reader->nb_blocks) return SEGMENT_FAILURE;
+    uint64_t offset = reader->index[i].offset;
+
+    if (memcmp(reader->index[i].header.magic, SEGMENT_ZBLOCK_MAGIC, sizeof(block->header.magic)) == 0) {
+        segment_zblock_info_t info;
+        if (read_all(reader->fd, &block->header, sizeof(block->header), offset) != SEGMENT_SUCCESS ||
+            read_all(reader->fd, &info, sizeof(info), offset + sizeof(block->header)) != SEGMENT_SUCCESS ||
+            info.payload_size > SEGMENT_ZBLOCK_MAX_PAYLOAD || block->header.count > SEGMENT_BLOCK_RECORDS ||
+            read_all(reader->fd, reader->payload, info.payload_size,
+                    offset + sizeof(block->header) + sizeof(info)) != SEGMENT_SUCCESS) {
+            return SEGMENT_FAILURE;
+        }
+        return decompress_block(reader->payload, info.payload_size, info.nb_series, block);
+    }
+
+    if (read_all(reader->fd, block, sizeof(*block), offset) != SEGMENT_SUCCESS) {
+        return SEGMENT_FAILURE;
+    }
+    if (memcmp(block->header.magic, SEGMENT_BLOCK_MAGIC, sizeof(block->header.magic)) != 0 ||
+        block->header.count > SEGMENT_BLOCK_RECORDS) {
+        return SEGMENT_FAILURE;
+    }
+    return SEGMENT_SUCCESS;
+}
+
+void segment_reader_close(segment_reader_t **reader) {
+    if (reader == NULL || *reader == NULL) return;
+    if ((*reader)->fd >= 0) close((*reader)->fd);
+    free((*reader)->index);
+    free(*reader);
+    *reader = NULL;
+}
@@ -0,0 +1,171 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_SEGMENT_H_
+#define _SENSOR_SEGMENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+#define SEGMENT_FAILURE -1
+#define SEGMENT_SUCCESS 0
+
+/*
+ * A segment file is a sequence of fixed-size blocks followed by an index:
+ *
+ *   block 0 | block 1 | ... | block n-1 | index entry 0 .. n-1 | trailer
+ *
+ * Every block starts with a header saying which timestamps and sensors it holds, so a reader
+ * can skip blocks without decoding them. The index repeats those headers at the end of the file;
+ * it is written when the segment is closed. A segment without an index (e.g. after a crash)
+ * can still be read by walking the block headers.
+ *
+ * A closed segment can be compressed with segment_compress(). Its blocks then have variable
+ * size: the same header (with SEGMENT_ZBLOCK_MAGIC), the payload size, and the readings of every
+ * sensor in the block as one series of delta-of-delta timestamps and Gorilla XOR values
+ * (see sensor_codec.h). Readers decode these blocks transparently; within a decoded block the
+ * readings are ordered per sensor instead of in arrival order.
+ */
+#define SEGMENT_BLOCK_SIZE 4096
+#define SEGMENT_BLOCK_RECORDS 224
+#define SEGMENT_BLOCK_MAGIC "SBK1"
+#define SEGMENT_TRAILER_MAGIC "SEGIDX1"
+#define SEGMENT_ZBLOCK_MAGIC "SBZ1"
+#define SEGMENT_ZBLOCK_MAX_PAYLOAD 8192
+
+typedef struct segment_block_header {
+    char magic[4];
+    uint32_t count;             /**< records in the block */
+    int64_t min_ts;             /**< oldest and newest timestamp in the block */
+    int64_t max_ts;
+    uint16_t min_id;            /**< smallest and largest sensor id in the block */
+    uint16_t max_id;
+    uint32_t reserved;
+    uint64_t id_bitmap[4];      /**< bit (id % 256) is set for every sensor id in the block */
+} segment_block_header_t;
+
+// Records are stored column by column, so every field stays naturally aligned
+typedef struct segment_block {
+    segment_block_header_t header;
+    int64_t ts[SEGMENT_BLOCK_RECORDS];
+    double values[SEGMENT_BLOCK_RECORDS];
+    uint16_t ids[SEGMENT_BLOCK_RECORDS];
+} segment_block_t;
+
+// Follows the header of a compressed block, the payload comes right after it
+typedef struct segment_zblock_info {
+    uint32_t payload_size;      /**< bytes of compressed payload */
+    uint32_t nb_series;         /**< sensors in the block */
+} segment_zblock_info_t;
+
+typedef struct segment_index_entry {
+    uint64_t offset;            /**< file offset of the block */
+    segment_block_header_t header;
+} segment_index_entry_t;
+
+typedef struct segment_trailer {
+    char magic[8];
+    uint64_t index_offset;      /**< file offset of the first index entry */
+    uint32_t nb_blocks;
+    uint32_t reserved;
+} segment_trailer_t;
+
+_Static_assert(sizeof(segment_block_t) == SEGMENT_BLOCK_SIZE, "segment block must fill SEGMENT_BLOCK_SIZE");
+
+typedef struct segment_writer segment_writer_t;
+typedef struct segment_reader segment_reader_t;
+
+/**
+ * Returns true if a block with header 'header' can hold readings of 'sensor_id' between 'from' and 'to'
+ * \param sensor_id the sensor to look for, or 0 for any sensor
+ * \param from the oldest timestamp of interest
+ * \param to the newest timestamp of interest
+ */
+static inline bool segment_block_may_contain(const segment_block_header_t *header,
+        sensor_id_t sensor_id, int64_t from, int64_t to) {
+    if (header->max_ts < from || header->min_ts > to) return false;
+    if (sensor_id == 0) return true;
+    if (sensor_id < header->min_id || sensor_id > header->max_id) return false;
+    return (header->id_bitmap[(sensor_id & 255) / 64] >> (sensor_id & 63)) & 1;
+}
+
+/**
+ * Creates (or truncates) a segment file for writing
+ * \param path the file to write
+ * \return a new writer, or NULL if the file could not be created
+ */
+segment_writer_t *segment_open(const char *path);
+
+/**
+ * Appends a reading to the current block; full blocks are written out right away
+ * \param writer the segment to append to
+ * \param data the reading
+ * \return SEGMENT_SUCCESS on success, SEGMENT_FAILURE if a block could not be written
+ */
+int segment_append(segment_writer_t *writer, const sensor_data_t *data);
+
+/**
+ * Writes the partly filled current block to its place in the file, so every appended reading is in the file
+ * The block is rewritten in place as it fills up further.
+ * \param writer the segment
+ * \param sync also wait until the data is on disk (fdatasync)
+ * \return SEGMENT_SUCCESS on success, SEGMENT_FAILURE otherwise
+ */
+int segment_commit(segment_writer_t *writer, bool sync);
+
+/**
+ * Writes the last block and the index, closes the file and frees the writer
+ * \param writer a double pointer to the writer, set to NULL
+ * \param sync wait until the segment is on disk before closing it
+ * \return SEGMENT_SUCCESS on success, SEGMENT_FAILURE if the segment could not be completed
+ */
+int segment_close(segment_writer_t **writer, bool sync);
+
+/**
+ * Writes a compressed copy of the closed segment 'src' to 'dst'
+ * 'dst' is written through a temporary file and only appears once it is complete and synced.
+ * \param src a raw segment
+ * \param dst the compressed segment to create
+ * \return SEGMENT_SUCCESS on success, SEGMENT_FAILURE otherwise ('dst' is then not created)
+ */
+int segment_compress(const char *src, const char *dst);
+
+/**
+ * Returns true if 'path' ends in a valid index, which only segment_close() and segment_compress() write
+ * A segment that is still being written, or was never closed (e.g. after a crash), has none.
+ */
+bool segment_is_closed(const char *path);
+
+/**
+ * Opens a raw or compressed segment for reading and loads its block index
+ * Falls back to walking the block headers if a raw segment has no index
+ * \param path the segment file
+ * \return a new reader, or NULL if the file could not be read
+ */
+segment_reader_t *segment_reader_open(const char *path);
+
+/**
+ * Returns the number of blocks in the segment
+ */
+int segment_reader_nb_blocks(const segment_reader_t *reader);
+
+/**
+ * Returns the header of block 'i', without reading the block itself
+ */
+const segment_block_header_t *segment_reader_header(const segment_reader_t *reader, int i);
+
+/**
+ * Reads block 'i' into '*block', decompressing it if needed
+ * \return SEGMENT_SUCCESS on success, SEGMENT_FAILURE if the block could not be read
+ */
+int segment_reader_read_block(segment_reader_t *reader, int i, segment_block_t *block);
+
+/**
+ * Closes the segment and frees the reader
+ * \param reader a double pointer to the reader, set to NULL
+ */
+void segment_reader_close(segment_reader_t **reader);
+
+#endif /* _SENSOR_SEGMENT_H_ */
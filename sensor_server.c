@@ -0,0 +1,59 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sensor_server.h"
+
+int socket_server_start(socket_server_t *server, const char *path, void *(*run)(void *server)) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    server->path = path;
+    server->running = false;
+
+    if (pipe(server->wake_pipe) != 0) return SERVER_FAILURE;
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd >= 0) {
+        // A socket file left behind by an earlier run would make bind() fail
+        unlink(path);
+        if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(server->listen_fd, 16) == 0 && pthread_create(&server->thread, NULL, run, server) == 0) {
+            server->running = true;
+            return SERVER_SUCCESS;
+        }
+        close(server->listen_fd);
+        server->listen_fd = -1;
+    }
+    close(server->wake_pipe[0]);
+    close(server->wake_pipe[1]);
+    server->wake_pipe[0] = server->wake_pipe[1] = -1;
+    return SERVER_FAILURE;
+}
+
+int socket_server_accept(socket_server_t *server) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) return -1;
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+void socket_server_stop(socket_server_t *server) {
+    if (!server->running || write(server->wake_pipe[1], "", 1) != 1) return;
+    pthread_join(server->thread, NULL);
+    server->running = false;
+
+    close(server->listen_fd);
+    server->listen_fd = -1;
+    unlink(server->path);
+    close(server->wake_pipe[0]);
+    close(server->wake_pipe[1]);
+    server->wake_pipe[0] = server->wake_pipe[1] = -1;
+}
@@ -0,0 +1,46 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_SERVER_H_
+#define _SENSOR_SERVER_H_
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SERVER_FAILURE -1
+#define SERVER_SUCCESS 0
+
+/**
+ * A SOCK_STREAM Unix socket served by a thread of its own, as the cache and the metrics use
+ * The thread polls 'listen_fd' for clients and wake_pipe[0] for the end: once that becomes readable,
+ * it must return.
+ */
+typedef struct socket_server {
+    const char *path;
+    int listen_fd;
+    int wake_pipe[2];
+    pthread_t thread;
+    bool running;
+} socket_server_t;
+
+/**
+ * Listens on 'path', replacing a socket file an earlier run left there, and starts 'run(server)'
+ * \return SERVER_SUCCESS, or SERVER_FAILURE if the socket or the thread could not be set up
+ */
+int socket_server_start(socket_server_t *server, const char *path, void *(*run)(void *server));
+
+/**
+ * Accepts a client of the server
+ * Sends to it give up after a second, so a client that stops reading cannot hold the thread up for long.
+ * \return the client's socket, or -1
+ */
+int socket_server_accept(socket_server_t *server);
+
+/**
+ * Wakes the thread, waits for it to return, then closes the socket and removes its file
+ * Does nothing if the server is not running.
+ */
+void socket_server_stop(socket_server_t *server);
+
+#endif /* _SENSOR_SERVER_H_ */
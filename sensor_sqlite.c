@@ -0,0 +1,146 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sqlite3.h>
+
+#include "sensor_sqlite.h"
+
+typedef struct sqlite_storage {
+    const char *location;
+    sqlite3 *db;
+    sqlite3_stmt *insert;
+    sqlite3_stmt *begin;
+    sqlite3_stmt *commit;
+    sqlite3_stmt *rollback;
+    bool in_transaction;
+} sqlite_storage_t;
+
+static const char *schema =
+    "CREATE TABLE IF NOT EXISTS sensor_data ("
+    "  sensor_id INTEGER NOT NULL,"
+    "  value REAL NOT NULL,"
+    "  ts INTEGER NOT NULL);"
+    "CREATE INDEX IF NOT EXISTS sensor_data_sensor_ts ON sensor_data (sensor_id, ts);";
+
+static const char *synchronous =
+    DB_SYNC_POLICY == DB_SYNC_GROUP ? "PRAGMA synchronous = FULL;" :
+    DB_SYNC_POLICY == DB_SYNC_INTERVAL ? "PRAGMA synchronous = NORMAL;" :
+    "PRAGMA synchronous = OFF;";
+
+static void log_sqlite_error(sqlite3 *db, const char *what) {
+    log_event(LOG_SQLITE_ERROR, what, sqlite3_errmsg(db));
+}
+
+// Run a prepared statement that returns no rows, and make it ready for the next time
+static int step_once(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// Throw away the open transaction: a group that failed must not be committed along with the next one
+static void abort_transaction(sqlite_storage_t *s) {
+    if (!s->in_transaction) return;
+    if (step_once(s->rollback) != 0) log_sqlite_error(s->db, "rolling back");
+    s->in_transaction = false;
+}
+
+static int sqlite_close(void *storage, bool sync);
+
+static void *sqlite_open(const char *location) {
+    sqlite_storage_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->location = location;
+
+    if (sqlite3_open_v2(location, &s->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+        sqlite3_exec(s->db, "PRAGMA journal_mode = WAL;", NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(s->db, synchronous, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(s->db, schema, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(s->db, "INSERT INTO sensor_data (sensor_id, value, ts) VALUES (?, ?, ?);",
+                -1, &s->insert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(s->db, "BEGIN;", -1, &s->begin, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(s->db, "COMMIT;", -1, &s->commit, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(s->db, "ROLLBACK;", -1, &s->rollback, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[!] ERR: Could not open db: %s\n", s->db ? sqlite3_errmsg(s->db) : "out of memory");
+        sqlite_close(s, false);
+        return NULL;
+    }
+
+    log_event(LOG_SQLITE_OPENED, location);
+    return s;
+}
+
+static int sqlite_write_batch(void *storage, const sensor_data_t *data, int count) {
+    sqlite_storage_t *s = storage;
+
+    if (!s->in_transaction) {
+        if (step_once(s->begin) != 0) {
+            log_sqlite_error(s->db, "starting a transaction");
+            return -1;
+        }
+        s->in_transaction = true;
+    }
+
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_int(s->insert, 1, data[i].id);
+        sqlite3_bind_double(s->insert, 2, data[i].value);
+        sqlite3_bind_int64(s->insert, 3, data[i].ts);
+        if (step_once(s->insert) != 0) {
+            log_sqlite_error(s->db, "inserting a reading");
+            abort_transaction(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int sqlite_commit(void *storage, bool sync) {
+    sqlite_storage_t *s = storage;
+
+    if (s->in_transaction) {
+        if (step_once(s->commit) != 0) {
+            log_sqlite_error(s->db, "committing");
+            abort_transaction(s);
+            return -1;
+        }
+        s->in_transaction = false;
+    }
+
+    // FULL already synced the commit; otherwise move the WAL into the database, which syncs both
+    if (sync && DB_SYNC_POLICY != DB_SYNC_GROUP &&
+        sqlite3_wal_checkpoint_v2(s->db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL) != SQLITE_OK) {
+        log_sqlite_error(s->db, "checkpointing");
+        return -1;
+    }
+    return 0;
+}
+
+static int sqlite_close(void *storage, bool sync) {
+    sqlite_storage_t *s = storage;
+    int result = 0;
+
+    if (s->db && (s->in_transaction || sync)) result = sqlite_commit(s, sync);
+
+    sqlite3_finalize(s->insert);
+    sqlite3_finalize(s->begin);
+    sqlite3_finalize(s->commit);
+    sqlite3_finalize(s->rollback);
+    if (s->db) {
+        sqlite3_close(s->db);
+        log_event(LOG_SQLITE_CLOSED, s->location);
+    }
+    free(s);
+    return result;
+}
+
+const storage_backend_t sqlite_backend = {
+    .name = "sqlite",
+    .location = DB_SQLITE_FILE,
+    .open = sqlite_open,
+    .write_batch = sqlite_write_batch,
+    .commit = sqlite_commit,
+    .close = sqlite_close,
+};
@@ -0,0 +1,23 @@
+/**
+ * \author Archit Choudhary
+ */
+
+#ifndef _SENSOR_SQLITE_H_
+#define _SENSOR_SQLITE_H_
+
+#include "sensor_db.h"
+
+/*
+ * Storage backend that keeps readings in an SQLite database:
+ *
+ *   CREATE TABLE sensor_data (sensor_id INTEGER NOT NULL, value REAL NOT NULL, ts INTEGER NOT NULL)
+ *   with an index on (sensor_id, ts)
+ *
+ * The database runs in WAL mode and every group of readings is inserted with one prepared
+ * statement inside one transaction. DB_SYNC_POLICY maps onto PRAGMA synchronous: DB_SYNC_NONE
+ * is OFF, DB_SYNC_GROUP is FULL (every commit is durable) and DB_SYNC_INTERVAL is NORMAL, with a
+ * WAL checkpoint whenever the storage manager asks for a sync.
+ */
+extern const storage_backend_t sqlite_backend;
+
+#endif /* _SENSOR_SQLITE_H_ */